@@ -0,0 +1,119 @@
+// -*- c-basic-offset: 4 -*-
+
+/*
+  dssi-vst: a DSSI plugin wrapper for VST effects and instruments
+  Copyright 2012-2013 Filipe Coelho
+  Copyright 2010-2011 Kristian Amlie
+  Copyright 2004-2010 Chris Cannam
+*/
+
+// A stand-in stereo VST effect that passes its input through and
+// burns a fixed amount of CPU per sample, for timing how the server
+// scales across cores.  It is built as a real Windows DLL, with a
+// cross compiler, by "make bench".  DSSI_VST_BURN sets the work as
+// filter iterations per sample (default 200), and DSSI_VST_BURN_PARAMS
+// a number of parameters that do nothing, for timing the scanner.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aeffectx.h"
+
+struct Burn
+{
+    AEffect effect; // first, so that an AEffect * is a Burn *
+    int iterations;
+    float state[2];
+};
+
+static intptr_t
+dispatcher(AEffect *effect, int opcode, int index, intptr_t, void *ptr, float)
+{
+    switch (opcode) {
+
+    case effGetParamName:
+	sprintf((char *)ptr, "Parameter %d", index);
+	return 1;
+
+    case effClose:
+	delete (Burn *)effect;
+	return 1;
+
+    case effGetEffectName:
+	strcpy((char *)ptr, "Burn");
+	return 1;
+
+    case effGetVendorString:
+	strcpy((char *)ptr, "dssi-vst");
+	return 1;
+
+    case effGetVstVersion:
+	return 2400;
+
+    default:
+	return 0;
+    }
+}
+
+static void
+processReplacing(AEffect *effect, float **inputs, float **outputs, int frames)
+{
+    Burn *burn = (Burn *)effect;
+
+    for (int c = 0; c < 2; ++c) {
+	// A one-pole filter run over and over: each step depends on
+	// the last, so the compiler can't shortcut it.  The constant
+	// keeps the state clear of denormals on silent input.
+	float s = burn->state[c];
+	for (int i = 0; i < frames; ++i) {
+	    float x = inputs[c][i];
+	    for (int k = 0; k < burn->iterations; ++k) {
+		s = s * 0.999f + x * 0.001f + 1e-6f;
+	    }
+	    outputs[c][i] = x;
+	}
+	burn->state[c] = s;
+    }
+}
+
+static void
+setParameter(AEffect *, int, float)
+{
+}
+
+static float
+getParameter(AEffect *, int)
+{
+    return 0.5f;
+}
+
+extern "C" __declspec(dllexport) AEffect *
+VSTPluginMain(audioMasterCallback)
+{
+    Burn *burn = new Burn;
+    memset(burn, 0, sizeof(Burn));
+
+    AEffect *effect = &burn->effect;
+    effect->magic = kEffectMagic;
+    effect->dispatcher = dispatcher;
+    effect->process = processReplacing;
+    effect->processReplacing = processReplacing;
+    effect->setParameter = setParameter;
+    effect->getParameter = getParameter;
+    effect->numInputs = 2;
+    effect->numOutputs = 2;
+    effect->flags = effFlagsCanReplacing;
+    effect->unkown_float = 1.0f;
+    effect->uniqueID = CCONST('b', 'u', 'r', 'n');
+
+    char *env = getenv("DSSI_VST_BURN");
+    burn->iterations = (env ? atoi(env) : 200);
+    if (burn->iterations < 0) burn->iterations = 0;
+
+    env = getenv("DSSI_VST_BURN_PARAMS");
+    effect->numParams = (env ? atoi(env) : 0);
+    if (effect->numParams < 0) effect->numParams = 0;
+
+    return effect;
+}
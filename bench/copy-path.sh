@@ -0,0 +1,41 @@
+#!/bin/sh
+# Compare rendering straight into the plugin's shared memory buffers
+# with rendering through vsthost's own buffers, which process copies
+# to and from shared memory (vsthost --copy).  Prints the time per
+# block and the bytes of audio copied and not copied for each, through
+# a burn.dll that does no work.
+#
+# Usage: bench/copy-path.sh [block [seconds]]
+#
+# Needs "make bench", and vsthost and dssi-vst-server installed where
+# DSSI_PATH finds them.
+
+dir=`cd "\`dirname "$0"\`" && pwd`
+block=${1:-1024}
+seconds=${2:-60}
+
+test -f "$dir/burn.dll" || { echo "$dir/burn.dll not found; run \"make bench\"" 1>&2; exit 1; }
+
+tmp=`mktemp -d` || exit 1
+trap 'rm -rf "$tmp"' 0
+
+. "$dir/silence.sh"
+silence "$tmp/in.wav" $seconds
+
+echo "$seconds seconds of audio in blocks of $block frames"
+echo "buffers	us per block	bytes copied	bytes not copied"
+
+for path in shm copy; do
+    copy=
+    [ $path = copy ] && copy=--copy
+    DSSI_VST_BURN=0 VST_PATH="$dir" \
+	vsthost -n --block $block $copy --render "$tmp/in.wav" "$tmp/out.wav" \
+	burn.dll > "$tmp/log" 2>&1
+    us=`sed -n 's/.* blocks, \([0-9.e+-]*\) us per block.*/\1/p' "$tmp/log"`
+    bytes=`sed -n 's/.* copied \([0-9]*\) bytes .* skipped \([0-9]*\)$/\1	\2/p' "$tmp/log"`
+    if [ -z "$us" ] || [ -z "$bytes" ]; then
+	echo "render through $path buffers failed" 1>&2
+	exit 1
+    fi
+    echo "$path	$us	$bytes"
+done
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Time the process handshake between vsthost and the plugin server
+# with futex and with pipe signalling (DSSI_VST_SIGNAL), by rendering
+# silence in small blocks through a burn.dll that does no work.  The
+# time per block is then almost all round trip.
+#
+# Usage: bench/handshake.sh [block [seconds]]
+#
+# Needs "make bench", and vsthost and dssi-vst-server installed where
+# DSSI_PATH finds them.
+
+dir=`cd "\`dirname "$0"\`" && pwd`
+block=${1:-64}
+seconds=${2:-10}
+
+test -f "$dir/burn.dll" || { echo "$dir/burn.dll not found; run \"make bench\"" 1>&2; exit 1; }
+
+tmp=`mktemp -d` || exit 1
+trap 'rm -rf "$tmp"' 0
+
+. "$dir/silence.sh"
+silence "$tmp/in.wav" $seconds
+
+echo "$seconds seconds of audio in blocks of $block frames"
+echo "signal	us per block"
+
+for signal in futex pipe; do
+    us=`DSSI_VST_SIGNAL=$signal DSSI_VST_BURN=0 VST_PATH="$dir" \
+	vsthost -n --block $block --render "$tmp/in.wav" "$tmp/out.wav" burn.dll 2>&1 |
+	sed -n 's/.* blocks, \([0-9.e+-]*\) us per block.*/\1/p'`
+    if [ -z "$us" ]; then
+	echo "render with $signal signalling failed" 1>&2
+	exit 1
+    fi
+    echo "$signal	$us"
+done
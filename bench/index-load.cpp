@@ -0,0 +1,221 @@
+// -*- c-basic-offset: 4 -*-
+
+/*
+  dssi-vst: a DSSI plugin wrapper for VST effects and instruments
+  Copyright 2012-2013 Filipe Coelho
+  Copyright 2010-2011 Kristian Amlie
+  Copyright 2004-2010 Chris Cannam
+*/
+
+// Compare the time taken to get the scan results for many plugins
+// from the one memory-mapped index with reading them from a cache
+// file per DLL, as the plugin did before the index.  Both are timed
+// with the files in the page cache, over a generated directory of
+// fake scan results.
+//
+// Usage: bench/index-load [plugins [parameters [programs [runs]]]]
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "remotevstclient.h"
+#include "remoteplugin.h"
+#include "pluginindex.h"
+#include "paths.h"
+
+static double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+appendName(std::vector<char> &record, std::string name)
+{
+    char buffer[64];
+    memset(buffer, 0, sizeof(buffer));
+    snprintf(buffer, sizeof(buffer), "%s", name.c_str());
+    record.insert(record.end(), buffer, buffer + sizeof(buffer));
+}
+
+template <typename T>
+static void
+appendValue(std::vector<char> &record, T value)
+{
+    record.insert(record.end(), (const char *)&value,
+		  (const char *)&value + sizeof(T));
+}
+
+// A record laid out as dssi-vst-scanner writes it
+static void
+appendRecord(std::vector<char> &record, const RemoteVSTClient::PluginRecord &rec)
+{
+    appendName(record, rec.dllName);
+    appendName(record, rec.pluginName);
+    appendName(record, rec.vendorName);
+    appendValue(record, rec.isSynth);
+    appendValue(record, rec.hasGUI);
+    appendValue(record, rec.inputs);
+    appendValue(record, rec.outputs);
+    appendValue(record, rec.parameters);
+    for (int i = 0; i < rec.parameters; ++i) {
+	appendName(record, rec.parameterNames[i]);
+	appendValue(record, rec.parameterDefaults[i]);
+    }
+    appendValue(record, rec.programs);
+    for (int i = 0; i < rec.programs; ++i) {
+	appendName(record, rec.programNames[i]);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    int count = (argc > 1 ? atoi(argv[1]) : 500);
+    int parameters = (argc > 2 ? atoi(argv[2]) : 64);
+    int programs = (argc > 3 ? atoi(argv[3]) : 32);
+    int runs = (argc > 4 ? atoi(argv[4]) : 20);
+
+    if (count < 1 || parameters < 0 || programs < 0 || runs < 1) {
+	std::cerr << "Usage: " << argv[0]
+		  << " [plugins [parameters [programs [runs]]]]" << std::endl;
+	return 2;
+    }
+
+    char dirName[] = "/tmp/dssi-vst-bench-XXXXXX";
+    if (!mkdtemp(dirName)) {
+	perror("mkdtemp");
+	return 1;
+    }
+    std::string dir = dirName;
+
+    int version = int(RemotePluginVersion * 1000);
+    std::vector<PluginIndex::Dll> dlls;
+    std::vector<RemoteVSTClient::PluginRecord> plugins;
+    std::vector<std::string> cacheFiles;
+
+    for (int p = 0; p < count; ++p) {
+
+	char name[40];
+	snprintf(name, sizeof(name), "plugin%04d.dll", p);
+
+	PluginIndex::Dll dll;
+	dll.path = "/usr/lib/vst/" + std::string(name);
+	memset(&dll.stamp, 0, sizeof(DllStamp));
+	dll.stamp.size = 1000000 + p;
+	dlls.push_back(dll);
+
+	RemoteVSTClient::PluginRecord rec;
+	rec.dllName = name;
+	rec.pluginName = std::string("Plugin ") + name;
+	rec.vendorName = "Vendor";
+	rec.isSynth = (p % 2 == 0);
+	rec.hasGUI = true;
+	rec.inputs = 2;
+	rec.outputs = 2;
+	rec.parameters = parameters;
+	for (int i = 0; i < parameters; ++i) {
+	    char pname[64];
+	    snprintf(pname, sizeof(pname), "Parameter %d", i);
+	    rec.parameterNames.push_back(pname);
+	    rec.parameterDefaults.push_back(0.5f);
+	}
+	rec.programs = programs;
+	for (int i = 0; i < programs; ++i) {
+	    char pname[64];
+	    snprintf(pname, sizeof(pname), "Program %d", i);
+	    rec.programNames.push_back(pname);
+	}
+	plugins.push_back(rec);
+
+	std::vector<char> file;
+	appendCacheHeader(file, version, dll.stamp, dll.path);
+	appendRecord(file, rec);
+
+	std::string cacheFile = dir + "/" + name + ".cache";
+	int fd = open(cacheFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, &file[0], file.size()) != (ssize_t)file.size()) {
+	    perror(cacheFile.c_str());
+	    return 1;
+	}
+	close(fd);
+	cacheFiles.push_back(cacheFile);
+    }
+
+    std::string indexFile = dir + "/plugins.index";
+    if (!PluginIndex::save(indexFile, PluginIndex::build(dlls, plugins))) {
+	return 1;
+    }
+
+    double cacheBest = 0.0, indexBest = 0.0;
+    size_t checksum = 0;
+
+    for (int run = 0; run < runs; ++run) {
+
+	// The old way: open each cache file, check its header and read
+	// its record into a PluginRecord
+	double start = now();
+	int found = 0;
+	for (size_t i = 0; i < cacheFiles.size(); ++i) {
+	    int fd = open(cacheFiles[i].c_str(), O_RDONLY);
+	    if (fd < 0) continue;
+	    DllStamp stamp;
+	    std::string dllPath;
+	    RemoteVSTClient::PluginRecord rec;
+	    if (parseCacheHeader(fd, version, stamp, dllPath) &&
+		isSameDll(stamp, dlls[i].stamp) &&
+		RemoteVSTClient::addFromFd(fd, rec)) {
+		checksum += rec.pluginName.length();
+		++found;
+	    }
+	    close(fd);
+	}
+	double elapsed = now() - start;
+	if (found != count) {
+	    std::cerr << "read " << found << " of " << count
+		      << " cache files" << std::endl;
+	    return 1;
+	}
+	if (run == 0 || elapsed < cacheBest) cacheBest = elapsed;
+
+	// The index: map it, check the DLL table, and touch every
+	// plugin's name as building the descriptors would
+	start = now();
+	PluginIndex index;
+	if (!index.load(indexFile)) {
+	    std::cerr << "failed to load " << indexFile << std::endl;
+	    return 1;
+	}
+	for (int i = 0; i < index.getDllCount(); ++i) {
+	    if (!isSameDll(index.getDllStamp(i), dlls[i].stamp)) return 1;
+	}
+	for (int i = 0; i < index.getPluginCount(); ++i) {
+	    checksum += strlen(index.getString(index.getPlugin(i).pluginName));
+	}
+	elapsed = now() - start;
+	if (run == 0 || elapsed < indexBest) indexBest = elapsed;
+    }
+
+    for (size_t i = 0; i < cacheFiles.size(); ++i) unlink(cacheFiles[i].c_str());
+    unlink(indexFile.c_str());
+    rmdir(dirName);
+
+    printf("%d plugins, %d parameters and %d programs each; best of %d runs\n",
+	   count, parameters, programs, runs);
+    printf("cache files: %10.3f ms\n", cacheBest * 1000.0);
+    printf("index:       %10.3f ms\n", indexBest * 1000.0);
+    if (indexBest > 0.0) {
+	printf("index is %.1f times faster\n", cacheBest / indexBest);
+    }
+
+    return (checksum ? 0 : 1);
+}
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Time a chain of side-by-side plugins (burn.dll + burn.dll + ...) on
+# 1 to N CPUs, through vsthost's offline render, to see how the
+# server's worker pool scales.  The work is the same on every run:
+# one burn.dll per CPU of the largest run.
+#
+# Usage: bench/parallel-scaling.sh [cpus [seconds]]
+#
+# Needs "make bench", and vsthost and dssi-vst-server installed where
+# DSSI_PATH finds them.  DSSI_VST_BURN sets the work per plugin.
+
+dir=`cd "\`dirname "$0"\`" && pwd`
+cpus=${1:-`nproc`}
+seconds=${2:-10}
+
+test -f "$dir/burn.dll" || { echo "$dir/burn.dll not found; run \"make bench\"" 1>&2; exit 1; }
+
+tmp=`mktemp -d` || exit 1
+trap 'rm -rf "$tmp"' 0
+
+. "$dir/silence.sh"
+silence "$tmp/in.wav" $seconds
+
+chain=burn.dll
+i=1
+while [ $i -lt $cpus ]; do
+    chain="$chain + burn.dll"
+    i=$((i + 1))
+done
+[ $cpus -gt 1 ] && chain="-c $chain"
+
+echo "$cpus burn.dll plugins side by side, $seconds seconds of audio"
+echo "cpus	x real time	speedup"
+
+base=
+n=1
+while [ $n -le $cpus ]; do
+    speed=`DSSI_VST_CPUS=0-$((n - 1)) VST_PATH="$dir" \
+	vsthost -n --render "$tmp/in.wav" "$tmp/out.wav" $chain 2>&1 |
+	sed -n 's/.*(\([0-9.e+-]*\)x real time).*/\1/p'`
+    if [ -z "$speed" ]; then
+	echo "render on $n cpus failed" 1>&2
+	exit 1
+    fi
+    base=${base:-$speed}
+    echo "$n	$speed	`echo "$speed $base" | awk '{ printf "%.2f", $1 / $2 }'`"
+    n=$((n + 1))
+done
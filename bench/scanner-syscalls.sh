@@ -0,0 +1,99 @@
+#!/bin/sh
+# Count the writes dssi-vst-scanner makes to its cache files and to
+# the FIFO the host reads its plugin records from, and fail if there
+# are more than a few per record, as there were when every name and
+# number went out in its own write() and cache files were forwarded a
+# byte at a time.  The scan is run twice through strace: once with no
+# cache, so that each DLL is scanned and cached, and once to forward
+# the cached records.
+#
+# Usage: bench/scanner-syscalls.sh [dlls [parameters [max-per-record]]]
+#
+# Needs strace, "make bench", and dssi-vst-scanner.exe installed where
+# DSSI_PATH finds it.  Each DLL is a copy of burn.dll with the given
+# number of parameters.
+
+dir=`cd "\`dirname "$0"\`" && pwd`
+dlls=${1:-4}
+params=${2:-2000}
+max=${3:-4}
+
+test -f "$dir/burn.dll" || { echo "$dir/burn.dll not found; run \"make bench\"" 1>&2; exit 1; }
+type strace >/dev/null 2>&1 || { echo "strace not found" 1>&2; exit 1; }
+
+scanner=
+for d in `echo "${DSSI_PATH:-$HOME/.dssi:/usr/local/lib/dssi:/usr/lib/dssi}" | tr : ' '`; do
+    if [ -x "$d/dssi-vst/dssi-vst-scanner.exe" ]; then
+	scanner="$d/dssi-vst/dssi-vst-scanner.exe"
+	break
+    fi
+done
+test -n "$scanner" || { echo "dssi-vst-scanner.exe not found in DSSI_PATH" 1>&2; exit 1; }
+
+tmp=`mktemp -d` || exit 1
+trap 'rm -rf "$tmp"' 0
+
+# The cache goes in a fresh HOME; keep the Wine prefix where it was
+WINEPREFIX=${WINEPREFIX:-$HOME/.wine}
+export WINEPREFIX
+
+mkdir "$tmp/home" "$tmp/vst"
+i=0
+while [ $i -lt $dlls ]; do
+    cp "$dir/burn.dll" "$tmp/vst/burn$i.dll"
+    i=$((i + 1))
+done
+
+# Print the number of writes made to files under $tmp, from an strace
+# log, following which fd each file was opened on
+count() {
+    awk -v tmp="$tmp/" '
+	/(open|openat)\(/ && index($0, "\"" tmp) {
+	    if (match($0, /= [0-9]+$/)) fds[substr($0, RSTART + 2)] = 1
+	    else if (/unfinished/) opening[$1] = 1
+	    next
+	}
+	/<\.\.\. (open|openat) resumed>/ && ($1 in opening) {
+	    delete opening[$1]
+	    if (match($0, /= [0-9]+$/)) fds[substr($0, RSTART + 2)] = 1
+	    next
+	}
+	match($0, /(write|writev|pwrite64|sendfile|sendfile64)\([0-9]+,/) {
+	    s = substr($0, RSTART, RLENGTH - 1)
+	    if (substr(s, index(s, "(") + 1) in fds) ++n
+	    next
+	}
+	match($0, /close\([0-9]+\)/) {
+	    delete fds[substr($0, RSTART + 6, RLENGTH - 7)]
+	}
+	END { print n + 0 }' "$1"
+}
+
+echo "$dlls DLLs with $params parameters each"
+echo "run	writes	limit"
+
+status=0
+for run in scan forward; do
+    rm -f "$tmp/fifo"
+    mkfifo "$tmp/fifo" || exit 1
+    cat "$tmp/fifo" > "$tmp/records" &
+    HOME="$tmp/home" VST_PATH="$tmp/vst" DSSI_VST_BURN_PARAMS=$params \
+	strace -f -qq -o "$tmp/trace" \
+	-e trace=open,openat,close,write,writev,pwrite64,sendfile,sendfile64 \
+	"$scanner" "$tmp/fifo" 2>/dev/null
+    wait
+    if [ ! -s "$tmp/records" ]; then
+	echo "$run: the scanner wrote no records" 1>&2
+	exit 1
+    fi
+    # One version number, then a record per DLL to the FIFO, and on
+    # the first run a record per DLL to its cache file as well
+    records=$dlls
+    [ $run = scan ] && records=$((dlls * 2))
+    limit=$((1 + records * max))
+    writes=`count "$tmp/trace"`
+    echo "$run	$writes	$limit"
+    [ $writes -le $limit ] || status=1
+done
+
+exit $status
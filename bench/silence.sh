@@ -0,0 +1,21 @@
+# Sourced by the bench scripts.  silence <file> <seconds> writes that
+# many seconds of silent 16-bit stereo WAV at 48 kHz.
+
+# Write an n-byte little-endian number
+le() {
+    v=$1; n=$2
+    while [ $n -gt 0 ]; do
+	printf "\\`printf %03o $((v % 256))`"
+	v=$((v / 256)); n=$((n - 1))
+    done
+}
+
+silence() {
+    size=$(($2 * 48000 * 4))
+    {
+	printf RIFF; le $((36 + size)) 4; printf 'WAVEfmt '
+	le 16 4; le 1 2; le 2 2; le 48000 4; le 192000 4; le 4 2; le 16 2
+	printf data; le $size 4
+	head -c $size /dev/zero
+    } > "$1"
+}
@@ -0,0 +1,26 @@
+// -*- c-basic-offset: 4 -*-
+
+/*
+  dssi-vst: a DSSI plugin wrapper for VST effects and instruments
+  Copyright 2012-2013 Filipe Coelho
+  Copyright 2010-2011 Kristian Amlie
+  Copyright 2004-2010 Chris Cannam
+*/
+
+// Brings the plugin index in ~/.dssi-vst up to date with the DLLs in
+// VST_PATH, running the scanner on any that are new or have changed.
+// The DSSI plugin and vsthost start this in the background when they
+// find the index out of date, rather than scan from a forked copy of
+// the host.
+
+#include "remotevstclient.h"
+
+#include <signal.h>
+
+int
+main(int, char **)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    return RemoteVSTClient::updateIndex() ? 0 : 1;
+}
@@ -17,7 +17,9 @@
 #include <fcntl.h>
 #include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <dirent.h>
+#include <errno.h>
 #include <unistd.h>
 #include <cstdlib>
 
@@ -150,6 +152,333 @@ hostCallback(AEffect *plugin, long opcode, long index,
     return 0;
 };
 
+static std::string
+dllPathFor(std::string vstDir, std::string libname)
+{
+    if (vstDir[vstDir.length()-1] == '/') return vstDir + libname;
+    return vstDir + "/" + libname;
+}
+
+static void
+append(std::vector<char> &record, const void *data, size_t size)
+{
+    record.insert(record.end(), (const char *)data, (const char *)data + size);
+}
+
+static bool
+writeAll(int fd, const char *data, size_t size)
+{
+    while (size > 0) {
+	ssize_t w = write(fd, data, size);
+	if (w < 0 && errno == EINTR) continue;
+	if (w <= 0) return false;
+	data += w;
+	size -= w;
+    }
+    return true;
+}
+
+// Load the plugin in vstDir/libname and append its record to record,
+// to be written out in one go by the caller.  For each plugin, we
+// add:
+//
+// dll name (64 chars)
+// name (64 chars)
+// vendor (64 chars)
+// is synth (bool)
+// have editor (bool)
+// input count (int)
+// output count (int)
+// 
+// parameter count (int)
+// then for each parameter:
+// name (64 chars)
+// default value (float)
+//
+// program count (int)
+// then for each program:
+// name (64 chars)
+//
+// Nothing is added if the DLL can't be loaded or isn't a plugin.
+static void
+scanPlugin(std::string vstDir, std::string libname, std::vector<char> &record)
+{
+    char *home = getenv("HOME");
+    HINSTANCE libHandle = 0;
+
+    int inputs = 0, outputs = 0, params = 0, programs = 0;
+    char buffer[65];
+    bool synth = false, gui = false;
+    int i = 0;
+    AEffect *(__stdcall* getInstance)(audioMasterCallback) = 0;
+    AEffect *plugin = 0;
+    std::string libPath = dllPathFor(vstDir, libname);
+
+    libHandle = LoadLibrary(libPath.c_str());
+    cerr << "dssi-vst-scanner: " << (libHandle ? "" : "not ")
+	 << "found in " << libPath << endl;
+		
+    if (!libHandle) {
+	if (home && home[0] != '\0') {
+	    if (libPath.substr(0, strlen(home)) == home) {
+		libPath = libPath.substr(strlen(home) + 1);
+	    }
+	    libHandle = LoadLibrary(libPath.c_str());
+	    cerr << "dssi-vst-scanner: " << (libHandle ? "" : "not ")
+		 << "found in " << libPath << endl;
+	}
+    }
+		
+    if (!libHandle) {
+	cerr << "dssi-vst-scanner: Couldn't load DLL " << libPath << endl;
+	goto done;
+    }
+
+    getInstance = (AEffect*(__stdcall*)(audioMasterCallback))
+	GetProcAddress(libHandle, NEW_PLUGIN_ENTRY_POINT);
+
+    if (!getInstance) {
+	getInstance = (AEffect*(__stdcall*)(audioMasterCallback))
+	    GetProcAddress(libHandle, OLD_PLUGIN_ENTRY_POINT);
+
+	if (!getInstance) {
+	    cerr << "dssi-vst-scanner: VST entrypoints \""
+		 << NEW_PLUGIN_ENTRY_POINT << "\" or \"" 
+		 << OLD_PLUGIN_ENTRY_POINT << "\" not found in DLL \""
+		 << libname << "\"" << endl;
+	    goto done;
+	}
+    }
+
+    plugin = getInstance(hostCallback);
+
+    if (!plugin) {
+	cerr << "dssi-vst-scanner: Failed to instantiate plugin in VST DLL \""
+	     << libPath << "\"" << endl;
+	goto done;
+    }
+
+    if (plugin->magic != kEffectMagic) {
+	cerr << "dssi-vst-scanner: Not a VST effect in DLL \""
+	     << libPath << "\"" << endl;
+	goto done;
+    }
+
+    if (!(plugin->flags & effFlagsCanReplacing)) {
+	cerr << "dssi-vst-scanner: Effect does not support processReplacing (required)"
+	     << endl;
+	goto done;
+    }
+
+    memset(buffer, 0, 65);
+    snprintf(buffer, 64, "%s", libname.c_str());
+    append(record, buffer, 64);
+
+    memset(buffer, 0, 65);
+    plugin->dispatcher(plugin, effGetEffectName, 0, 0, buffer, 0);
+    if (buffer[0] == '\0') {
+	snprintf(buffer, 64, "%s", libname.c_str());
+    }
+    append(record, buffer, 64);
+
+    memset(buffer, 0, 65);
+    plugin->dispatcher(plugin, effGetVendorString, 0, 0, buffer, 0);
+    if (buffer[0] == '\0') {
+	snprintf(buffer, 64, "Unknown");
+    }
+    append(record, buffer, 64);
+
+    synth = false;
+    if (plugin->flags & effFlagsIsSynth) synth = true;
+    append(record, &synth, sizeof(bool));
+
+    gui = false;
+    if (plugin->flags & effFlagsHasEditor) gui = true;
+    append(record, &gui, sizeof(bool));
+
+    inputs = plugin->numInputs;
+    append(record, &inputs, sizeof(int));
+
+    outputs = plugin->numOutputs;
+    append(record, &outputs, sizeof(int));
+
+    params = plugin->numParams;
+    append(record, &params, sizeof(int));
+
+    for (i = 0; i < params; ++i) {
+	memset(buffer, 0, 65);
+	plugin->dispatcher(plugin, effGetParamName, i, 0, buffer, 0);
+	if (buffer[0] == '\0') {
+	    snprintf(buffer, 64, "Unnamed %i", i);
+	}
+	append(record, buffer, 64);
+	float f = plugin->getParameter(plugin, i);
+	append(record, &f, sizeof(float));
+    }
+
+    programs = plugin->numPrograms;
+    append(record, &programs, sizeof(int));
+
+    for (i = 0; i < programs; ++i) {
+	memset(buffer, 0, 65);
+	// effGetProgramName appears to return the name of the
+	// current program, not program <index> -- though we
+	// pass in <index> as well, just in case
+	plugin->dispatcher(plugin, effSetProgram, 0, i, NULL, 0);
+	plugin->dispatcher(plugin, effGetProgramName, i, 0, buffer, 0);
+	if (buffer[0] == '\0') {
+	    snprintf(buffer, 64, "Unnamed %i", i);
+	}
+	append(record, buffer, 64);
+    }
+
+done:
+    if (plugin) plugin->dispatcher(plugin, effClose, 0, 0, NULL, 0);
+    if (libHandle) FreeLibrary(libHandle);
+}
+
+// Copy the rest of a cache file, from just past its header, to the
+// output.  sendfile copies within the kernel; if it can't be used
+// for this pair of files, fall back to copying through a buffer.
+static void
+copyRecord(int fd, int targetfd)
+{
+    ssize_t n;
+    while ((n = sendfile(targetfd, fd, NULL, 1 << 20)) > 0 ||
+	   (n < 0 && errno == EINTR));
+    if (n == 0) return;
+
+    if (errno != EINVAL && errno != ENOSYS) {
+	perror("dssi-vst-scanner: Failed to copy cache file");
+	return;
+    }
+
+    static char buffer[65536];
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+	if (!writeAll(targetfd, buffer, n)) break;
+    }
+}
+
+static bool
+makeCacheDir(std::string &cacheDir)
+{
+    char *home = getenv("HOME");
+    cacheDir = std::string(home) + "/.dssi-vst";
+
+    DIR *test = opendir(cacheDir.c_str());
+    if (test) {
+	closedir(test);
+	return true;
+    }
+
+    if (mkdir(cacheDir.c_str(), 0755)) {
+	cerr << "dssi-vst-scanner: failed to create cache directory " << cacheDir;
+	perror(0);
+	return false;
+    }
+    return true;
+}
+
+// Read the header from the start of a cache file, returning true if
+// it is for this DLL as it is now
+static bool
+readCacheHeader(int fd, std::string cacheFileName, std::string dllPath,
+		int version)
+{
+    DllStamp cached, current;
+    std::string cachedPath;
+    if (!parseCacheHeader(fd, version, cached, cachedPath)) {
+	cerr << "dssi-vst-scanner: Cache file " << cacheFileName
+	     << " is unreadable or of another version (wanted "
+	     << version << ") - rewriting" << endl;
+	return false;
+    }
+
+    if (cachedPath != dllPath ||
+	!getDllStamp(dllPath, current) ||
+	!isSameDll(cached, current)) {
+	cerr << "dssi-vst-scanner: DLL " << dllPath << " has changed since "
+	     << "it was cached - rewriting" << endl;
+	return false;
+    }
+
+    return true;
+}
+
+// Scan a plugin into its cache file.  The record goes to a temporary
+// file that is renamed into place once complete, so a plugin that
+// crashes or hangs the scanner never leaves a partial record behind.
+static bool
+writeCache(std::string vstDir, std::string libname,
+	   std::string cacheFileName, int version)
+{
+    DllStamp stamp;
+    if (!getDllStamp(dllPathFor(vstDir, libname), stamp)) {
+	cerr << "dssi-vst-scanner: Failed to stat DLL " << libname << endl;
+	return false;
+    }
+
+    char tmpSuffix[30];
+    sprintf(tmpSuffix, ".tmp%d", (int)getpid());
+    std::string tmpFileName = cacheFileName + tmpSuffix;
+
+    int fd = open(tmpFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+	cerr << "dssi-vst-scanner: Failed to open cache file " << tmpFileName;
+	perror(" for writing");
+	return false;
+    }
+
+    std::vector<char> record;
+    appendCacheHeader(record, version, stamp, dllPathFor(vstDir, libname));
+    scanPlugin(vstDir, libname, record);
+
+    bool written = writeAll(fd, &record[0], record.size());
+    if (close(fd) || !written) {
+	cerr << "dssi-vst-scanner: Failed to write cache file " << tmpFileName;
+	perror(" ");
+	unlink(tmpFileName.c_str());
+	return false;
+    }
+
+    if (rename(tmpFileName.c_str(), cacheFileName.c_str())) {
+	cerr << "dssi-vst-scanner: Failed to rename cache file " << tmpFileName;
+	perror(" into place");
+	unlink(tmpFileName.c_str());
+	return false;
+    }
+    return true;
+}
+
+// Scan each DLL listed (by full path, one per line) in jobFile into
+// its cache file, writing nothing else.  The client runs several of
+// us at once on its own shares of the DLLs that need scanning, and
+// watches the cache files appear to see how each of us is getting
+// on; see RemoteVSTClient::queryPlugins.
+static int
+scanJobList(std::string jobFile, int version)
+{
+    std::string cacheDir;
+    if (!makeCacheDir(cacheDir)) return 1;
+
+    std::ifstream jobs(jobFile.c_str());
+    if (!jobs) {
+	cerr << "dssi-vst-scanner: Failed to open job list " << jobFile << endl;
+	return 1;
+    }
+
+    std::string dllPath;
+    while (std::getline(jobs, dllPath)) {
+	size_t slash = dllPath.rfind('/');
+	if (slash == std::string::npos) continue;
+	std::string vstDir = dllPath.substr(0, slash + 1);
+	std::string libname = dllPath.substr(slash + 1);
+	writeCache(vstDir, libname, cacheDir + "/" + libname + ".cache", version);
+    }
+
+    return 0;
+}
+
 int WINAPI
 WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, LPSTR cmdline, int cmdshow)
 {
@@ -158,6 +487,12 @@ WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, LPSTR cmdline, int cmdshow)
     cout << "DSSI VST plugin scanner v0.3" << endl;
     cout << "Copyright (c) 2004-2010 Chris Cannam" << endl;
 
+    int version = int(RemotePluginVersion * 1000);
+
+    if (cmdline && !strncmp(cmdline, "-j ", 3)) {
+	return scanJobList(cmdline + 3, version);
+    }
+
     if (cmdline && cmdline[0]) destFile = strdup(cmdline);
     
     int targetfd = 0;
@@ -170,14 +505,14 @@ WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, LPSTR cmdline, int cmdshow)
 	}
     }
 
-    int version = int(RemotePluginVersion * 1000);
     write(targetfd, &version, sizeof(int));
 
-    HINSTANCE libHandle = 0;
-
     std::vector<std::string> vstPath = Paths::getPath
 	("VST_PATH", "/usr/local/lib/vst:/usr/lib/vst", "/vst");
 
+    std::string cacheDir;
+    bool haveCacheDir = makeCacheDir(cacheDir);
+
     for (size_t i = 0; i < vstPath.size(); ++i) {
 	
 	std::string vstDir = vstPath[i];
@@ -190,43 +525,8 @@ WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, LPSTR cmdline, int cmdshow)
 	}
 
 	struct dirent *entry;
-	char *home = getenv("HOME");
-	std::string cacheDir = std::string(home) + "/.dssi-vst";
-	bool haveCacheDir = false;
-
-	DIR *test = opendir(cacheDir.c_str());
-	if (!test) {
-	    if (mkdir(cacheDir.c_str(), 0755)) {
-		cerr << "dssi-vst-scanner: failed to create cache directory " << cacheDir;
-		perror(0);
-	    } else {
-		haveCacheDir = true;
-	    }
-	} else {
-	    haveCacheDir = true;
-	    closedir(test);
-	}
 	
 	while ((entry = readdir(directory))) {
-	    
-	    // For each plugin, we write:
-	    //
-	    // dll name (64 chars)
-	    // name (64 chars)
-	    // vendor (64 chars)
-	    // is synth (bool)
-	    // have editor (bool)
-	    // input count (int)
-	    // output count (int)
-	    // 
-	    // parameter count (int)
-	    // then for each parameter:
-	    // name (64 chars)
-	    // default value (float)
-	    //
-	    // program count (int)
-	    // then for each program:
-	    // name (64 chars)
 
 	    std::string libname = entry->d_name;
 
@@ -237,202 +537,45 @@ WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, LPSTR cmdline, int cmdshow)
 		continue;
 	    }
 
-	    int fd = targetfd;
+	    int fd = -1;
 	    bool haveCache = false;
-	    bool writingCache = false;
 	    std::string cacheFileName = cacheDir + "/" + libname + ".cache";
 
 	    if (haveCacheDir) {
 	
-		struct stat st;
-		if (!stat(cacheFileName.c_str(), &st)) {
-		    int testfd = open(cacheFileName.c_str(), O_RDONLY);
-		    if (testfd >= 0) {
-			int testVersion = 0;
-			if (read(testfd, &testVersion, sizeof(int)) == sizeof(int) &&
-			    testVersion == version) {
-			    haveCache = true;
-			} else {
-			    cerr << "dssi-vst-scanner: Cache version mismatch for file "
-				 << cacheFileName << " (" << testVersion << ", wanted "
-				 << version << ") - rewriting" << endl;
-			}
-			close(testfd);
-		    }
+		int testfd = open(cacheFileName.c_str(), O_RDONLY);
+		if (testfd >= 0) {
+		    haveCache = readCacheHeader(testfd, cacheFileName,
+						dllPathFor(vstDir, libname),
+						version);
+		    close(testfd);
 		}
 		if (!haveCache) {
-		    if ((fd = open(cacheFileName.c_str(), O_WRONLY | O_CREAT, 0644)) < 0) {
-			cerr << "dssi-vst-scanner: Failed to open cache file " << cacheFileName;
-			perror(" for writing");
-			fd = targetfd;
-		    } else {
-			writingCache = true;
-			write(fd, &version, sizeof(int));
-		    }
+		    haveCache = writeCache(vstDir, libname, cacheFileName, version);
 		}
 	    }
 
 	    if (!haveCache) {
-
-		int inputs = 0, outputs = 0, params = 0, programs = 0;
-		char buffer[65];
-		bool synth = false, gui = false;
-		int i = 0;
-		AEffect *(__stdcall* getInstance)(audioMasterCallback) = 0;
-		AEffect *plugin = 0;
-		std::string libPath;
-
-		if (vstDir[vstDir.length()-1] == '/') {
-		    libPath = vstDir + libname;
-		} else {
-		    libPath = vstDir + "/" + libname;
-		}
-		
-		libHandle = LoadLibrary(libPath.c_str());
-		cerr << "dssi-vst-scanner: " << (libHandle ? "" : "not ")
-		     << "found in " << libPath << endl;
-		
-		if (!libHandle) {
-		    if (home && home[0] != '\0') {
-			if (libPath.substr(0, strlen(home)) == home) {
-			    libPath = libPath.substr(strlen(home) + 1);
-			}
-			libHandle = LoadLibrary(libPath.c_str());
-			cerr << "dssi-vst-scanner: " << (libHandle ? "" : "not ")
-			     << "found in " << libPath << endl;
-		    }
-		}
-		
-		if (!libHandle) {
-		    cerr << "dssi-vst-scanner: Couldn't load DLL " << libPath << endl;
-		    goto done;
+		std::vector<char> record;
+		scanPlugin(vstDir, libname, record);
+		if (!record.empty()) {
+		    writeAll(targetfd, &record[0], record.size());
 		}
-
-		getInstance = (AEffect*(__stdcall*)(audioMasterCallback))
-		    GetProcAddress(libHandle, NEW_PLUGIN_ENTRY_POINT);
-
-		if (!getInstance) {
-		    getInstance = (AEffect*(__stdcall*)(audioMasterCallback))
-			GetProcAddress(libHandle, OLD_PLUGIN_ENTRY_POINT);
-
-		    if (!getInstance) {
-			cerr << "dssi-vst-scanner: VST entrypoints \""
-			     << NEW_PLUGIN_ENTRY_POINT << "\" or \"" 
-			     << OLD_PLUGIN_ENTRY_POINT << "\" not found in DLL \""
-			     << libname << "\"" << endl;
-			goto done;
-		    }
-		}
-
-		plugin = getInstance(hostCallback);
-
-		if (!plugin) {
-		    cerr << "dssi-vst-scanner: Failed to instantiate plugin in VST DLL \""
-			 << libPath << "\"" << endl;
-		    goto done;
-		}
-
-		if (plugin->magic != kEffectMagic) {
-		    cerr << "dssi-vst-scanner: Not a VST effect in DLL \""
-			 << libPath << "\"" << endl;
-		    goto done;
-		}
-
-		if (!plugin->flags & effFlagsCanReplacing) {
-		    cerr << "dssi-vst-scanner: Effect does not support processReplacing (required)"
-			 << endl;
-		    goto done;
-		}
-
-		memset(buffer, 0, 65);
-		snprintf(buffer, 64, "%s", libname.c_str());
-		write(fd, buffer, 64);
-
-		memset(buffer, 0, 65);
-		plugin->dispatcher(plugin, effGetEffectName, 0, 0, buffer, 0);
-		if (buffer[0] == '\0') {
-		    snprintf(buffer, 64, "%s", libname.c_str());
-		}
-		write(fd, buffer, 64);
-
-		memset(buffer, 0, 65);
-		plugin->dispatcher(plugin, effGetVendorString, 0, 0, buffer, 0);
-                if (buffer[0] == '\0') {
-                    snprintf(buffer, 64, "Unknown");
-                }
-		write(fd, buffer, 64);
-
-		synth = false;
-		if (plugin->flags & effFlagsIsSynth) synth = true;
-		write(fd, &synth, sizeof(bool));
-
-		gui = false;
-		if (plugin->flags & effFlagsHasEditor) gui = true;
-		write(fd, &gui, sizeof(bool));
-
-		inputs = plugin->numInputs;
-		write(fd, &inputs, sizeof(int));
-
-		outputs = plugin->numOutputs;
-		write(fd, &outputs, sizeof(int));
-
-		params = plugin->numParams;
-		write(fd, &params, sizeof(int));
-
-		for (i = 0; i < params; ++i) {
-		    memset(buffer, 0, 65);
-		    plugin->dispatcher(plugin, effGetParamName, i, 0, buffer, 0);
-                    if (buffer[0] == '\0') {
-                        snprintf(buffer, 64, "Unnamed %i", i);
-                    }
-		    write(fd, buffer, 64);
-		    float f = plugin->getParameter(plugin, i);
-		    write(fd, &f, sizeof(float));
-		}
-
-		programs = plugin->numPrograms;
-		write(fd, &programs, sizeof(int));
-
-		for (i = 0; i < programs; ++i) {
-		    memset(buffer, 0, 65);
-		    // effGetProgramName appears to return the name of the
-		    // current program, not program <index> -- though we
-		    // pass in <index> as well, just in case
-		    plugin->dispatcher(plugin, effSetProgram, 0, i, NULL, 0);
-		    plugin->dispatcher(plugin, effGetProgramName, i, 0, buffer, 0);
-                    if (buffer[0] == '\0') {
-                        snprintf(buffer, 64, "Unnamed %i", i);
-                    }
-		    write(fd, buffer, 64);
-		}
-
-	    done:
-		if (plugin) plugin->dispatcher(plugin, effClose, 0, 0, NULL, 0);
-		FreeLibrary(libHandle);
-	    }
-
-	    if (writingCache) {
-		close(fd);
+		continue;
 	    }
 
-	    if (haveCache || writingCache) {
-		// need to read from cache as well
-		if ((fd = open(cacheFileName.c_str(), O_RDONLY)) < 0) {
-		    cerr << "dssi-vst-scanner: Failed to open cache file " << cacheFileName;
-		    perror("for reading");
+	    // need to read from cache as well
+	    if ((fd = open(cacheFileName.c_str(), O_RDONLY)) < 0) {
+		cerr << "dssi-vst-scanner: Failed to open cache file " << cacheFileName;
+		perror("for reading");
+	    } else {
+		if (!readCacheHeader(fd, cacheFileName,
+				     dllPathFor(vstDir, libname), version)) {
+		    cerr << "dssi-vst-scanner: Internal error: cache file " << cacheFileName << " verified earlier, but now fails" << endl;
 		} else {
-		    int testVersion = 0;
-		    if (read(fd, &testVersion, sizeof(int)) != sizeof(int) ||
-			testVersion != version) {
-			cerr << "dssi-vst-scanner: Internal error: cache file " << cacheFileName << " verified earlier, but now fails version test (" << testVersion << " != " << version << ")" << endl;
-		    } else {
-			unsigned char c;
-			while (read(fd, &c, 1) == 1) {
-			    write(targetfd, &c, 1);
-			}
-		    }
-		    close(fd);
+		    copyRecord(fd, targetfd);
 		}
+		close(fd);
 	    }
 	}
 
@@ -11,6 +11,7 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <algorithm>
 
 #include <stdlib.h>
 
@@ -20,7 +21,10 @@
 #include <sys/un.h>
 #include <sys/time.h>
 #include <sys/poll.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <errno.h>
+#include <string.h>
 
 #include <unistd.h>
 #include <sched.h>
@@ -57,21 +61,15 @@ struct Rect {
     short right;
 };
 
-static bool inProcessThread = false;
-static HANDLE audioThreadHandle = 0;
-static bool exiting = false;
-static HWND hWnd = 0;
-static double currentSamplePosition = 0.0;
+// Process-wide state.  Everything to do with a single plugin lives
+// in its RemoteVSTServer, as a shared server hosts several of them.
+static HINSTANCE appInstance = 0;
 
-static bool ready = false;
-static bool alive = false;
-static int bufferSize = 0;
-static int sampleRate = 0;
-static bool guiVisible = false;
-static bool needIdle = false;
+// Set around the plugin's entry point, before we have had the chance
+// to point AEffect::user at the instance
+static __thread bool instantiating = false;
 
 static RemotePluginDebugLevel debugLevel = RemotePluginDebugNone;
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static jack_client_t* jack_client = 0;
 static int jack_process_callback(jack_nframes_t, void*)
@@ -79,27 +77,90 @@ static int jack_process_callback(jack_nframes_t, void*)
 
 using namespace std;
 
+// CPUs to run audio and worker threads on, from DSSI_VST_CPUS (such
+// as "2,3" or "2-5"), handed out to the threads in turn.  Empty to
+// leave affinity alone.
+static std::vector<int> audioCpus;
+static int nextAudioCpu = 0;
+
+static void
+parseCpuList(const char *list)
+{
+    while (list && *list) {
+	char *end = 0;
+	long first = strtol(list, &end, 10);
+	if (end == list || first < 0) break;
+	long last = first;
+	if (*end == '-') {
+	    list = end + 1;
+	    last = strtol(list, &end, 10);
+	    if (end == list || last < first) break;
+	}
+	for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+	    audioCpus.push_back(cpu);
+	}
+	if (*end != ',') break;
+	list = end + 1;
+    }
+}
+
+static void
+bindThreadToCpu(const char *what)
+{
+    if (audioCpus.empty()) return;
+
+    int n = __atomic_fetch_add(&nextAudioCpu, 1, __ATOMIC_RELAXED);
+    int cpu = audioCpus[n % audioCpus.size()];
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+	cerr << "dssi-vst-server: Failed to bind " << what << " thread to CPU "
+	     << cpu << ": " << strerror(errno) << endl;
+    } else if (debugLevel > 0) {
+	cerr << "dssi-vst-server[1]: bound " << what << " thread to CPU "
+	     << cpu << endl;
+    }
+}
+
+static double
+monotonicTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
 class RemoteVSTServer : public RemotePluginServer
 {
 public:
-    RemoteVSTServer(std::string fileIdentifiers, AEffect *plugin, std::string fallbackName);
+    // More than one plugin makes a chain, run in order on each block.
+    // Programs, chunks and the editor belong to the first, and MIDI
+    // goes to the plugins of the first stage (see m_stages).
+    RemoteVSTServer(std::string fileIdentifiers,
+		    const std::vector<AEffect *> &chain,
+		    std::string fallbackName);
     virtual ~RemoteVSTServer();
  
-    virtual bool         isReady() { return ready; }
+    virtual bool         isReady() { return m_ready; }
    
     virtual std::string  getName() { return m_name; }
     virtual std::string  getMaker() { return m_maker; }
     virtual void         setBufferSize(int);
     virtual void         setSampleRate(int);
+    virtual void         setOffline(bool offline) { m_offline = offline; }
     virtual void         reset();
     virtual void         terminate();
     
-    virtual int          getInputCount() { return m_plugin->numInputs; }
-    virtual int          getOutputCount() { return m_plugin->numOutputs; }
+    virtual int          getInputCount();
+    virtual int          getOutputCount();
 
-    virtual int          getParameterCount() { return m_plugin->numParams; }
+    virtual int          getParameterCount();
     virtual std::string  getParameterName(int);
     virtual void         setParameter(int, float);
+    virtual void         setParameterAt(int, float, int);
     virtual float        getParameter(int);
     virtual float        getParameterDefault(int);
     virtual void         getParameters(int, int, float *);
@@ -118,7 +179,7 @@ public:
 
     //Deryabin Andrew: vst chunks support
     virtual std::vector<char> getVSTChunk();
-    virtual bool setVSTChunk(std::vector<char>);
+    virtual bool setVSTChunk(const std::vector<char> &);
     //Deryabin Andrew: vst chunks support: end code
 
     virtual void process(float **inputs, float **outputs);
@@ -137,8 +198,42 @@ public:
     void checkGUIExited();
     void terminateGUIProcess();
 
+    // Re-read the plugin's latency and channel counts after it has
+    // told us they changed; returns false if the channel counts did,
+    // which we can't follow
+    bool ioChanged();
+
+    // The index in our own parameter space of the given plugin's
+    // parameter 0 (for hostCallback, which sees per-plugin indices)
+    int          getParameterOffset(AEffect *plugin);
+
+    // Host state for hostCallback, which finds us via AEffect::user
+    int          getSampleRate() const { return m_sampleRate; }
+    int          getBlockSize() const { return m_blockSize; }
+    double       getSamplePosition() const { return m_currentSamplePosition; }
+    HWND         getWindow() const { return m_hWnd; }
+    bool         isInProcessThread() const { return m_inProcessThread; }
+    bool         isOffline() const { return m_offline; }
+    void         setNeedIdle() { m_needIdle = true; }
+
+    // Each instance has its own window, editor and audio thread.
+    // If showEditor, the editor is opened straight away and the
+    // instance exits when it is closed (the "-g" mode).
+    bool         createWindow(bool showEditor);
+    bool         startAudioThread();
+    void         stopAudioThread();
+    void         idle();
+    bool         isExiting() const { return m_exiting; }
+    bool         isEditorVisible() const { return m_guiVisible; }
+    bool         hasLostEditor() const { return m_followEditor && !m_guiVisible; }
+
+    DWORD        audioThread();
+    DWORD        watchdogThread();
+    DWORD        workerThread();
+
 private:
     AEffect *m_plugin;
+    std::vector<AEffect *> m_chain;
 
     std::string m_name;
     std::string m_maker;
@@ -165,14 +260,123 @@ private:
     float *m_defaults;
     float *m_values;
     bool m_hasMIDI;
-};
+    int m_inputCount; // -1 until the chain is built
+    int m_outputCount;
 
-static RemoteVSTServer *remoteVSTServerInstance = 0;
+    void updateLatency();
+
+    // MIDI received since the last process call, possibly over
+    // several ring transactions; handed to the plugin in one go
+    // just before processReplacing.  A block skipped because the
+    // plugin is busy carries its events over.  Audio thread only.
+#define MIDI_EVENT_BUFFER_COUNT 1024
+    VstMidiEvent m_midiEvents[MIDI_EVENT_BUFFER_COUNT];
+    int m_midiEventFrames[MIDI_EVENT_BUFFER_COUNT];
+    char m_vstEventsBuffer[sizeof(VstMidiEvent *) * MIDI_EVENT_BUFFER_COUNT +
+			   sizeof(VstEvents)];
+    int m_midiEventCount;
+
+    // Parameter changes due part way through the next block, which
+    // process applies by splitting the block at their frames.  Audio
+    // thread only, like the MIDI buffer.
+    struct ParameterEvent {
+	int frame;
+	int index;
+	float value;
+	bool operator<(const ParameterEvent &e) const { return frame < e.frame; }
+    };
+#define PARAMETER_EVENT_BUFFER_COUNT 1024
+    ParameterEvent m_paramEvents[PARAMETER_EVENT_BUFFER_COUNT];
+    int m_paramEventCount;
+    std::vector<float *> m_segmentInputs;
+    std::vector<float *> m_segmentOutputs;
+
+    void processEvents(int start, int end);
+
+    // Chain support.  The parameters of a chain are those of each
+    // plugin in turn, followed by a bypass switch for each plugin.
+    // Plugins after the first read the previous one's output from
+    // one of two internal buffers and write into the other.
+    std::vector<std::string> m_linkNames;
+    std::vector<char> m_bypass;
+    std::vector<float> m_chainData[2];
+    std::vector<float *> m_chainBuffers[2];
+    std::vector<float> m_silence;
+    std::vector<float *> m_linkInputs;
+    int m_chainChannels;
+
+    bool findParameter(int p, int &link, int &index);
+    void setChainParameter(int p, float v);
+    void dispatchChain(int opcode, int index, intptr_t value, float opt);
+    void allocateChainBuffers();
+    void processChain(float **inputs, float **outputs, int frames);
+
+    // Plugins separated by '+' rather than '|' make up a stage: they
+    // all read the stage's input and their outputs are mixed.  This
+    // holds the index in m_chain of the first plugin of each stage,
+    // then the chain's length.  A bypassed plugin drops out of its
+    // stage's mix, unless all of them are bypassed.
+    std::vector<int> m_stages;
+    int m_widestStage;
+    std::vector<float> m_branchData;
+    std::vector<std::vector<float *> > m_branchBuffers;
+
+    int processStage(int stage, float **in, int inCount, float **out,
+		     int frames);
+
+    // The plugins of a stage run in parallel, on the audio thread
+    // and a pool of worker threads.  A stage is posted by setting
+    // m_workFirst and m_workCount, resetting m_workTicket to the new
+    // generation with task 0, and then bumping m_workGeneration (the
+    // futex word the idle workers sleep on).  Every thread takes
+    // tasks by advancing the ticket until they run out; the ticket
+    // carries the generation so that a worker arriving late can't
+    // take a task from the next stage.  The audio thread returns
+    // once m_workDone reaches the count.
+    std::vector<HANDLE> m_workerHandles;
+    int32_t m_workGeneration;
+    uint32_t m_workTicket;
+    int32_t m_workDone;
+    int32_t m_workCount;
+    int m_workFirst;
+    int m_workFrames;
+    bool m_workersExiting;
+
+    void startWorkers();
+    void stopWorkers();
+    void takeBranches(uint32_t generation);
+    void runBranches(int first, int count, int frames);
+
+    // Blocks in which a chain with parallel stages took longer than
+    // the block's own duration, counted by the audio thread and
+    // reported from idle()
+    double m_blockDeadline;
+    uint32_t m_deadlineMisses;
+    uint32_t m_deadlineMissesReported;
+    time_t m_lastMissReport;
+
+    pthread_mutex_t m_mutex;
+    HWND m_hWnd;
+    HANDLE m_audioThreadHandle;
+    bool m_inProcessThread;
+    bool m_offline;
+    bool m_guiVisible;
+    bool m_followEditor;
+    bool m_needIdle;
+    bool m_ready;
+    bool m_alive;
+    bool m_exiting;
+    int m_blockSize;
+    int m_sampleRate;
+    double m_currentSamplePosition;
+};
 
 RemoteVSTServer::RemoteVSTServer(std::string fileIdentifiers,
-				 AEffect *plugin, std::string fallbackName) :
+				 const std::vector<AEffect *> &chain,
+				 std::string fallbackName) :
     RemotePluginServer(fileIdentifiers),
-    m_plugin(plugin),
+    m_plugin(chain[0]),
+    m_chain(chain),
     m_name(fallbackName),
     m_maker(""),
     m_guiFifoFile(""),
@@ -180,9 +384,56 @@ RemoteVSTServer::RemoteVSTServer(std::string fileIdentifiers,
     m_guiEventsExpected(0),
     m_paramChangeReadIndex(0),
     m_paramChangeWriteIndex(0),
-    m_editLevel(EditNone)
+    m_editLevel(EditNone),
+    m_inputCount(-1),
+    m_outputCount(-1),
+    m_midiEventCount(0),
+    m_paramEventCount(0),
+    m_chainChannels(0),
+    m_widestStage(1),
+    m_workGeneration(0),
+    m_workTicket(0),
+    m_workDone(0),
+    m_workCount(0),
+    m_workFirst(0),
+    m_workFrames(0),
+    m_workersExiting(false),
+    m_blockDeadline(0.0),
+    m_deadlineMisses(0),
+    m_deadlineMissesReported(0),
+    m_lastMissReport(0),
+    m_hWnd(0),
+    m_audioThreadHandle(0),
+    m_inProcessThread(false),
+    m_offline(false),
+    m_guiVisible(false),
+    m_followEditor(false),
+    m_needIdle(false),
+    m_ready(false),
+    m_alive(false),
+    m_exiting(false),
+    m_blockSize(0),
+    m_sampleRate(0),
+    m_currentSamplePosition(0.0)
 {
-    pthread_mutex_lock(&mutex);
+    pthread_mutex_init(&m_mutex, 0);
+    pthread_mutex_lock(&m_mutex);
+
+    // Find the chain's stages from the separators between its DLL
+    // names, before any plugin can ask us for our channel counts
+    m_stages.push_back(0);
+    for (size_t i = 0, n = 1; i < fallbackName.length() && n < m_chain.size(); ++i) {
+	if (fallbackName[i] == '|') m_stages.push_back(n);
+	if (fallbackName[i] == '|' || fallbackName[i] == '+') ++n;
+    }
+    m_stages.push_back(m_chain.size());
+
+    for (size_t s = 0; s + 1 < m_stages.size(); ++s) {
+	m_widestStage = std::max(m_widestStage, m_stages[s + 1] - m_stages[s]);
+    }
+
+    // Lets hostCallback find this instance when the plugin calls back
+    m_plugin->user = this;
 
     if (debugLevel > 0) {
 	cerr << "dssi-vst-server[1]: opening plugin" << endl;
@@ -238,19 +489,64 @@ RemoteVSTServer::RemoteVSTServer(std::string fileIdentifiers,
 
     m_plugin->dispatcher(m_plugin, effMainsChanged, 0, 1, NULL, 0);
 
-    m_defaults = new float[m_plugin->numParams];
-    m_values = new float[m_plugin->numParams];
-    for (int i = 0; i < m_plugin->numParams; ++i) {
-	m_defaults[i] = m_plugin->getParameter(m_plugin, i);
+    if (m_chain.size() > 1) {
+
+	for (size_t i = 1; i < m_chain.size(); ++i) {
+	    AEffect *link = m_chain[i];
+	    link->user = this;
+	    link->dispatcher(link, effOpen, 0, 0, NULL, 0);
+	    link->dispatcher(link, effMainsChanged, 0, 1, NULL, 0);
+	}
+
+	// Name the chain after its plugins, falling back on the DLL
+	// names we were given
+	std::string dllNames = fallbackName;
+	m_name = "";
+	char separator = '|';
+
+	for (size_t i = 0; i < m_chain.size(); ++i) {
+
+	    size_t bar = dllNames.find_first_of("|+");
+	    std::string linkName = dllNames.substr(0, bar);
+
+	    buffer[0] = '\0';
+	    m_chain[i]->dispatcher(m_chain[i], effGetEffectName, 0, 0, buffer, 0);
+	    if (buffer[0]) linkName = buffer;
+
+	    m_linkNames.push_back(linkName);
+	    if (i > 0) m_name += (separator == '+' ? " + " : " > ");
+	    m_name += linkName;
+
+	    if (bar == std::string::npos) break;
+	    separator = dllNames[bar];
+	    dllNames = dllNames.substr(bar + 1);
+	}
+
+	if (debugLevel > 0) {
+	    cerr << "dssi-vst-server[1]: chain is \"" << m_name << "\"" << endl;
+	}
+    }
+
+    m_bypass.assign(m_chain.size(), 0);
+
+    m_inputCount = getInputCount();
+    m_outputCount = getOutputCount();
+    updateLatency();
+
+    int count = getParameterCount();
+    m_defaults = new float[count];
+    m_values = new float[count];
+    for (int i = 0; i < count; ++i) {
+	m_defaults[i] = getParameter(i);
 	m_values[i] = m_defaults[i];
     }
 
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&m_mutex);
 }
 
 RemoteVSTServer::~RemoteVSTServer()
 {
-    pthread_mutex_lock(&mutex);
+    pthread_mutex_lock(&m_mutex);
 
     if (m_guiFifoFd >= 0) {
 	try {
@@ -259,105 +555,515 @@ RemoteVSTServer::~RemoteVSTServer()
 	close(m_guiFifoFd);
     }
 
-    if (guiVisible) {
-	ShowWindow(hWnd, SW_HIDE);
-	UpdateWindow(hWnd);
+    if (m_guiVisible) {
+	ShowWindow(m_hWnd, SW_HIDE);
+	UpdateWindow(m_hWnd);
 	m_plugin->dispatcher(m_plugin, effEditClose, 0, 0, 0, 0);
-	guiVisible = false;
+	m_guiVisible = false;
     }
 
-    m_plugin->dispatcher(m_plugin, effMainsChanged, 0, 0, NULL, 0);
-    m_plugin->dispatcher(m_plugin, effClose, 0, 0, NULL, 0);
+    dispatchChain(effMainsChanged, 0, 0, 0);
+    dispatchChain(effClose, 0, 0, 0);
     delete[] m_defaults;
+    delete[] m_values;
+
+    pthread_mutex_unlock(&m_mutex);
+    pthread_mutex_destroy(&m_mutex);
 
-    pthread_mutex_unlock(&mutex);
+    if (m_hWnd) DestroyWindow(m_hWnd);
 }
 
 void
 RemoteVSTServer::process(float **inputs, float **outputs)
 {
-    if (pthread_mutex_trylock(&mutex)) {
-	for (int i = 0; i < m_plugin->numOutputs; ++i) {
-	    memset(outputs[i], 0, bufferSize * sizeof(float));
+    // An offline render waits for the plugin rather than write a
+    // block of silence into its output
+    if (m_offline) {
+	pthread_mutex_lock(&m_mutex);
+    } else if (pthread_mutex_trylock(&m_mutex)) {
+	for (int i = 0; i < getOutputCount(); ++i) {
+	    memset(outputs[i], 0, m_blockSize * sizeof(float));
+	}
+	// Keep the MIDI and parameter changes for the next block, at
+	// its start, so that no note-off or automation is lost
+	for (int i = 0; i < m_midiEventCount; ++i) {
+	    m_midiEventFrames[i] = 0;
+	}
+	for (int i = 0; i < m_paramEventCount; ++i) {
+	    m_paramEvents[i].frame = 0;
 	}
-	currentSamplePosition += bufferSize;
+	m_currentSamplePosition += m_blockSize;
 	return;
     }
     
-    inProcessThread = true;
-    
-    // superclass guarantees setBufferSize will be called before this
-    m_plugin->processReplacing(m_plugin, inputs, outputs, bufferSize);
-    currentSamplePosition += bufferSize;
+    m_inProcessThread = true;
+
+    // An offline render has no deadline to miss
+    if (m_widestStage > 1 && !m_offline) {
+	m_blockDeadline = monotonicTime() + double(m_blockSize) / m_sampleRate;
+    }
+
+    if (m_paramEventCount == 0) {
+
+	processEvents(0, m_blockSize);
+
+	// superclass guarantees setBufferSize will be called before this
+	processChain(inputs, outputs, m_blockSize);
+	m_currentSamplePosition += m_blockSize;
+
+    } else {
+
+	// Run the block in segments, applying each timed parameter
+	// change at the start of the segment it falls on.  Changes
+	// arrive nearly in order, so sort them by insertion, which
+	// allocates nothing and keeps changes for the same frame in
+	// their order.
+	for (int i = 1; i < m_paramEventCount; ++i) {
+	    ParameterEvent e = m_paramEvents[i];
+	    int j = i;
+	    while (j > 0 && e < m_paramEvents[j-1]) {
+		m_paramEvents[j] = m_paramEvents[j-1];
+		--j;
+	    }
+	    m_paramEvents[j] = e;
+	}
+
+	m_segmentInputs.resize(getInputCount());
+	m_segmentOutputs.resize(getOutputCount());
+
+	int start = 0;
+	int ei = 0;
+
+	while (start < m_blockSize) {
+
+	    while (ei < m_paramEventCount && m_paramEvents[ei].frame <= start) {
+		setChainParameter(m_paramEvents[ei].index,
+				  m_paramEvents[ei].value);
+		++ei;
+	    }
+
+	    int end = m_blockSize;
+	    if (ei < m_paramEventCount && m_paramEvents[ei].frame < end) {
+		end = m_paramEvents[ei].frame;
+	    }
+
+	    for (size_t i = 0; i < m_segmentInputs.size(); ++i) {
+		m_segmentInputs[i] = inputs[i] + start;
+	    }
+	    for (size_t i = 0; i < m_segmentOutputs.size(); ++i) {
+		m_segmentOutputs[i] = outputs[i] + start;
+	    }
+
+	    processEvents(start, end);
+
+	    processChain(m_segmentInputs.empty() ? 0 : &m_segmentInputs[0],
+			 m_segmentOutputs.empty() ? 0 : &m_segmentOutputs[0],
+			 end - start);
+	    m_currentSamplePosition += end - start;
+	    start = end;
+	}
+
+	// anything timed beyond the end of the block
+	while (ei < m_paramEventCount) {
+	    setChainParameter(m_paramEvents[ei].index, m_paramEvents[ei].value);
+	    ++ei;
+	}
+
+	m_paramEventCount = 0;
+    }
+
+    m_midiEventCount = 0;
+
+    if (m_widestStage > 1 && !m_offline && monotonicTime() > m_blockDeadline) {
+	__atomic_add_fetch(&m_deadlineMisses, 1, __ATOMIC_RELAXED);
+    }
     
-    inProcessThread = false;
-    pthread_mutex_unlock(&mutex);
+    m_inProcessThread = false;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void
+RemoteVSTServer::processEvents(int start, int end)
+{
+    // Hand the plugin the MIDI events falling in [start, end), timed
+    // relative to start.  The final segment also takes any events
+    // timed at or beyond the end of the block.
+    VstEvents *vstev = (VstEvents *)m_vstEventsBuffer;
+    int n = 0;
+
+    for (int i = 0; i < m_midiEventCount; ++i) {
+	int frame = m_midiEventFrames[i];
+	if (frame < start) continue;
+	if (frame >= end && end < m_blockSize) continue;
+	m_midiEvents[i].deltaFrames = (frame < end ? frame - start : end - start - 1);
+	vstev->events[n++] = (VstEvent *)&m_midiEvents[i];
+    }
+
+    if (n > 0) {
+	vstev->reserved = 0;
+	vstev->numEvents = n;
+	for (int i = 0; i < m_stages[1]; ++i) {
+	    m_chain[i]->dispatcher(m_chain[i], effProcessEvents, 0, 0, vstev, 0);
+	}
+    }
+}
+
+void
+RemoteVSTServer::allocateChainBuffers()
+{
+    if (m_chain.size() == 1) return;
+
+    m_chainChannels = 1;
+    for (size_t i = 0; i < m_chain.size(); ++i) {
+	m_chainChannels = std::max(m_chainChannels, m_chain[i]->numInputs);
+	m_chainChannels = std::max(m_chainChannels, m_chain[i]->numOutputs);
+    }
+
+    for (int b = 0; b < 2; ++b) {
+	m_chainData[b].assign(m_chainChannels * m_blockSize, 0.0f);
+	m_chainBuffers[b].resize(m_chainChannels);
+	for (int c = 0; c < m_chainChannels; ++c) {
+	    m_chainBuffers[b][c] = &m_chainData[b][c * m_blockSize];
+	}
+    }
+
+    m_silence.assign(m_blockSize, 0.0f);
+    m_linkInputs.resize(m_chainChannels);
+
+    if (m_widestStage == 1) return;
+
+    m_branchData.assign(m_widestStage * m_chainChannels * m_blockSize, 0.0f);
+    m_branchBuffers.resize(m_widestStage);
+    for (int b = 0; b < m_widestStage; ++b) {
+	m_branchBuffers[b].resize(m_chainChannels);
+	for (int c = 0; c < m_chainChannels; ++c) {
+	    m_branchBuffers[b][c] =
+		&m_branchData[(b * m_chainChannels + c) * m_blockSize];
+	}
+    }
+}
+
+void
+RemoteVSTServer::processChain(float **inputs, float **outputs, int frames)
+{
+    if (m_chain.size() == 1) {
+	m_plugin->processReplacing(m_plugin, inputs, outputs, frames);
+	return;
+    }
+
+    // Each plugin takes channel c from channel c (modulo the count)
+    // of whatever came before it; a bypassed plugin passes that
+    // straight through
+    float **in = inputs;
+    int inCount = getInputCount();
+    int stages = m_stages.size() - 1;
+
+    for (int s = 0; s < stages; ++s) {
+
+	bool last = (s + 1 == stages);
+	float **out = (last ? outputs : &m_chainBuffers[s % 2][0]);
+
+	if (m_stages[s + 1] - m_stages[s] > 1) {
+	    inCount = processStage(s, in, inCount, out, frames);
+	    in = out;
+	    continue;
+	}
+
+	int i = m_stages[s];
+	AEffect *link = m_chain[i];
+	int outCount = std::min(link->numOutputs, m_chainChannels);
+
+	if (m_bypass[i]) {
+	    for (int c = 0; c < outCount; ++c) {
+		const float *src =
+		    (inCount > 0 ? in[c % inCount] : &m_silence[0]);
+		memcpy(out[c], src, frames * sizeof(float));
+	    }
+	} else {
+	    int linkInputs = std::min(link->numInputs, m_chainChannels);
+	    for (int c = 0; c < linkInputs; ++c) {
+		m_linkInputs[c] = (inCount > 0 ? in[c % inCount] : &m_silence[0]);
+	    }
+	    link->processReplacing(link, &m_linkInputs[0], out, frames);
+	}
+
+	in = out;
+	inCount = outCount;
+    }
+}
+
+int
+RemoteVSTServer::processStage(int stage, float **in, int inCount,
+			      float **out, int frames)
+{
+    int first = m_stages[stage];
+    int count = m_stages[stage + 1] - first;
+
+    // The stage is as wide as its widest plugin, and every plugin
+    // in it reads the same input
+    int outCount = 0;
+    bool active = false;
+    for (int i = first; i < first + count; ++i) {
+	outCount = std::max(outCount, std::min(m_chain[i]->numOutputs,
+					       m_chainChannels));
+	if (!m_bypass[i]) active = true;
+    }
+
+    for (int c = 0; c < m_chainChannels; ++c) {
+	m_linkInputs[c] = (inCount > 0 ? in[c % inCount] : &m_silence[0]);
+    }
+
+    if (!active) {
+	for (int c = 0; c < outCount; ++c) {
+	    memcpy(out[c], m_linkInputs[c], frames * sizeof(float));
+	}
+	return outCount;
+    }
+
+    runBranches(first, count, frames);
+
+    for (int c = 0; c < outCount; ++c) {
+	bool written = false;
+	for (int b = 0; b < count; ++b) {
+	    AEffect *link = m_chain[first + b];
+	    if (m_bypass[first + b] || c >= link->numOutputs) continue;
+	    const float *src = m_branchBuffers[b][c];
+	    if (!written) {
+		memcpy(out[c], src, frames * sizeof(float));
+		written = true;
+	    } else {
+		for (int f = 0; f < frames; ++f) out[c][f] += src[f];
+	    }
+	}
+	if (!written) memset(out[c], 0, frames * sizeof(float));
+    }
+
+    return outCount;
+}
+
+void
+RemoteVSTServer::runBranches(int first, int count, int frames)
+{
+    m_workFirst = first;
+    m_workFrames = frames;
+    __atomic_store_n(&m_workCount, count, __ATOMIC_RELAXED);
+    __atomic_store_n(&m_workDone, 0, __ATOMIC_RELAXED);
+
+    uint32_t generation =
+	(__atomic_load_n(&m_workGeneration, __ATOMIC_RELAXED) + 1) & 0xffff;
+    __atomic_store_n(&m_workTicket, generation << 16, __ATOMIC_RELEASE);
+    __atomic_store_n(&m_workGeneration, generation, __ATOMIC_SEQ_CST);
+
+    for (size_t i = 0; i < m_workerHandles.size(); ++i) {
+	rdwr_futexWake(&m_workGeneration);
+    }
+
+    takeBranches(generation);
+
+    // Wait for any tasks still running on workers; the plugins are
+    // writing into our buffers, so there's no leaving early
+    int32_t done;
+    while ((done = __atomic_load_n(&m_workDone, __ATOMIC_ACQUIRE)) < count) {
+	rdwr_futexWait(&m_workDone, done, -1);
+    }
+}
+
+void
+RemoteVSTServer::takeBranches(uint32_t generation)
+{
+    uint32_t ticket = __atomic_load_n(&m_workTicket, __ATOMIC_ACQUIRE);
+
+    while ((ticket >> 16) == generation) {
+
+	int32_t count = __atomic_load_n(&m_workCount, __ATOMIC_RELAXED);
+	int task = ticket & 0xffff;
+	if (task >= count) break;
+
+	if (!__atomic_compare_exchange_n(&m_workTicket, &ticket, ticket + 1,
+					 false, __ATOMIC_ACQUIRE,
+					 __ATOMIC_ACQUIRE)) {
+	    continue; // ticket now holds the new value
+	}
+
+	int i = m_workFirst + task;
+	if (!m_bypass[i]) {
+	    AEffect *link = m_chain[i];
+	    link->processReplacing(link, &m_linkInputs[0],
+				   &m_branchBuffers[task][0], m_workFrames);
+	}
+
+	if (__atomic_add_fetch(&m_workDone, 1, __ATOMIC_ACQ_REL) == count) {
+	    rdwr_futexWake(&m_workDone);
+	}
+
+	ticket = __atomic_load_n(&m_workTicket, __ATOMIC_ACQUIRE);
+    }
 }
 
 void
 RemoteVSTServer::setBufferSize(int sz)
 {
-    pthread_mutex_lock(&mutex);
+    pthread_mutex_lock(&m_mutex);
 
-    if (bufferSize != sz) {
-	m_plugin->dispatcher(m_plugin, effMainsChanged, 0, 0, NULL, 0);
-	m_plugin->dispatcher(m_plugin, effSetBlockSize, 0, sz, NULL, 0);
-	m_plugin->dispatcher(m_plugin, effMainsChanged, 0, 1, NULL, 0);
-	bufferSize = sz;
+    if (m_blockSize != sz) {
+	dispatchChain(effMainsChanged, 0, 0, 0);
+	dispatchChain(effSetBlockSize, 0, sz, 0);
+	dispatchChain(effMainsChanged, 0, 1, 0);
+	m_blockSize = sz;
+	allocateChainBuffers();
+	updateLatency();
     }
 
     if (debugLevel > 0) {
 	cerr << "dssi-vst-server[1]: set buffer size to " << sz << endl;
     }
 
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&m_mutex);
 }
 
 void
 RemoteVSTServer::setSampleRate(int sr)
 {
-    pthread_mutex_lock(&mutex);
+    pthread_mutex_lock(&m_mutex);
 
-    if (sampleRate != sr) {
-	m_plugin->dispatcher(m_plugin, effMainsChanged, 0, 0, NULL, 0);
-	m_plugin->dispatcher(m_plugin, effSetSampleRate, 0, 0, NULL, (float)sr);
-	m_plugin->dispatcher(m_plugin, effMainsChanged, 0, 1, NULL, 0);
-	sampleRate = sr;
+    if (m_sampleRate != sr) {
+	dispatchChain(effMainsChanged, 0, 0, 0);
+	dispatchChain(effSetSampleRate, 0, 0, (float)sr);
+	dispatchChain(effMainsChanged, 0, 1, 0);
+	m_sampleRate = sr;
+	updateLatency();
     }
 
     if (debugLevel > 0) {
 	cerr << "dssi-vst-server[1]: set sample rate to " << sr << endl;
     }
 
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&m_mutex);
 }
 
 void
 RemoteVSTServer::reset()
 {
-    pthread_mutex_lock(&mutex);
+    pthread_mutex_lock(&m_mutex);
 
     cerr << "dssi-vst-server[1]: reset" << endl;
 
-    m_plugin->dispatcher(m_plugin, effMainsChanged, 0, 0, NULL, 0);
-    m_plugin->dispatcher(m_plugin, effMainsChanged, 0, 1, NULL, 0);
+    dispatchChain(effMainsChanged, 0, 0, 0);
+    dispatchChain(effMainsChanged, 0, 1, 0);
+    updateLatency();
 
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&m_mutex);
 }
 
 void
 RemoteVSTServer::terminate()
 {
     cerr << "RemoteVSTServer::terminate: setting exiting flag" << endl;
-    exiting = true;
+    m_exiting = true;
+}
+
+int
+RemoteVSTServer::getInputCount()
+{
+    int count = 0;
+    for (int i = 0; i < m_stages[1]; ++i) {
+	count = std::max(count, m_chain[i]->numInputs);
+    }
+    return count;
+}
+
+int
+RemoteVSTServer::getOutputCount()
+{
+    int count = 0;
+    for (int i = m_stages[m_stages.size() - 2]; i < (int)m_chain.size(); ++i) {
+	count = std::max(count, m_chain[i]->numOutputs);
+    }
+    return count;
+}
+
+int
+RemoteVSTServer::getParameterCount()
+{
+    if (m_chain.size() == 1) return m_plugin->numParams;
+
+    int count = 0;
+    for (size_t i = 0; i < m_chain.size(); ++i) {
+	count += m_chain[i]->numParams;
+    }
+    return count + m_chain.size();
+}
+
+bool
+RemoteVSTServer::findParameter(int p, int &link, int &index)
+{
+    // Returns false for the bypass switches, with link set
+    for (size_t i = 0; i < m_chain.size(); ++i) {
+	if (p < m_chain[i]->numParams) {
+	    link = i;
+	    index = p;
+	    return true;
+	}
+	p -= m_chain[i]->numParams;
+    }
+    link = p;
+    index = -1;
+    return false;
+}
+
+int
+RemoteVSTServer::getParameterOffset(AEffect *plugin)
+{
+    int offset = 0;
+    for (size_t i = 0; i < m_chain.size() && m_chain[i] != plugin; ++i) {
+	offset += m_chain[i]->numParams;
+    }
+    return offset;
+}
+
+void
+RemoteVSTServer::setChainParameter(int p, float v)
+{
+    if (m_chain.size() == 1) {
+	m_plugin->setParameter(m_plugin, p, v);
+	return;
+    }
+
+    int link, index;
+    if (findParameter(p, link, index)) {
+	m_chain[link]->setParameter(m_chain[link], index, v);
+    } else if (link < (int)m_bypass.size()) {
+	m_bypass[link] = (v > 0.5f);
+    }
+}
+
+void
+RemoteVSTServer::dispatchChain(int opcode, int index, intptr_t value, float opt)
+{
+    for (size_t i = 0; i < m_chain.size(); ++i) {
+	m_chain[i]->dispatcher(m_chain[i], opcode, index, value, NULL, opt);
+    }
 }
 
 std::string
 RemoteVSTServer::getParameterName(int p)
 {
     char name[24];
-    m_plugin->dispatcher(m_plugin, effGetParamName, p, 0, name, 0);
-    return name;
+
+    if (m_chain.size() == 1) {
+	m_plugin->dispatcher(m_plugin, effGetParamName, p, 0, name, 0);
+	return name;
+    }
+
+    int link, index;
+    if (!findParameter(p, link, index)) {
+	if (link >= (int)m_linkNames.size()) return "";
+	return "Bypass " + m_linkNames[link];
+    }
+
+    name[0] = '\0';
+    m_chain[link]->dispatcher(m_chain[link], effGetParamName, index, 0, name, 0);
+    return m_linkNames[link] + ": " + name;
 }
 
 void
@@ -367,7 +1073,7 @@ RemoteVSTServer::setParameter(int p, float v)
 	cerr << "dssi-vst-server[2]: setParameter (" << p << "," << v << ")" << endl;
     }
 
-    pthread_mutex_lock(&mutex);
+    pthread_mutex_lock(&m_mutex);
     
     if (debugLevel > 1)
         cerr << "RemoteVSTServer::setParameter (" << p << "," << v << "): " << m_guiEventsExpected << " events expected" << endl;
@@ -388,20 +1094,77 @@ RemoteVSTServer::setParameter(int p, float v)
 	} else {
 	    --m_guiEventsExpected;
 	    //cerr << "Reduced to " << m_guiEventsExpected << endl;
-	    pthread_mutex_unlock(&mutex);
+	    pthread_mutex_unlock(&m_mutex);
 	    return;
 	}
     }
     
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&m_mutex);
     
-    m_plugin->setParameter(m_plugin, p, v);
+    setChainParameter(p, v);
+}
+
+void
+RemoteVSTServer::updateLatency()
+{
+    // initialDelay follows the two reserved pointers in AEffect, which
+    // vestige leaves as the start of empty3.  A chain's is the sum
+    // over its stages of the longest delay of the plugins in each,
+    // as those of a stage run side by side.
+    int32_t delay = 0;
+    for (size_t s = 0; s + 1 < m_stages.size(); ++s) {
+	int32_t stageDelay = 0;
+	for (int i = m_stages[s]; i < m_stages[s + 1]; ++i) {
+	    int32_t d;
+	    memcpy(&d, m_chain[i]->empty3, sizeof(int32_t));
+	    stageDelay = std::max(stageDelay, d);
+	}
+	delay += stageDelay;
+    }
+
+    if (debugLevel > 0) {
+	cerr << "dssi-vst-server[1]: plugin latency is " << delay << " frames" << endl;
+    }
+
+    publishLatency(delay);
+}
+
+bool
+RemoteVSTServer::ioChanged()
+{
+    // A plugin may report a change during effOpen, before there are
+    // any counts to compare with; they are recorded once it is loaded
+    if (m_inputCount < 0) return true;
+
+    updateLatency();
+    return (getInputCount() == m_inputCount &&
+	    getOutputCount() == m_outputCount);
+}
+
+void
+RemoteVSTServer::setParameterAt(int p, float v, int frame)
+{
+    if (frame <= 0 || m_paramEventCount >= PARAMETER_EVENT_BUFFER_COUNT) {
+	setParameter(p, v);
+	return;
+    }
+
+    ParameterEvent &e = m_paramEvents[m_paramEventCount++];
+    e.frame = frame;
+    e.index = p;
+    e.value = v;
 }
 
 float
 RemoteVSTServer::getParameter(int p)
 {
-    return m_plugin->getParameter(m_plugin, p);
+    if (m_chain.size() == 1) return m_plugin->getParameter(m_plugin, p);
+
+    int link, index;
+    if (findParameter(p, link, index)) {
+	return m_chain[link]->getParameter(m_chain[link], index);
+    }
+    return (link < (int)m_bypass.size() && m_bypass[link]) ? 1.0f : 0.0f;
 }
 
 float
@@ -414,7 +1177,7 @@ void
 RemoteVSTServer::getParameters(int p0, int pn, float *v)
 {
     for (int i = p0; i <= pn; ++i) {
-	v[i - p0] = m_plugin->getParameter(m_plugin, i);
+	v[i - p0] = getParameter(i);
     }
 }
 
@@ -425,7 +1188,7 @@ RemoteVSTServer::getProgramName(int p)
 	cerr << "dssi-vst-server[2]: getProgramName(" << p << ")" << endl;
     }
 
-    pthread_mutex_lock(&mutex);
+    pthread_mutex_lock(&m_mutex);
 
     char name[24];
 
@@ -442,7 +1205,7 @@ RemoteVSTServer::getProgramName(int p)
         m_plugin->dispatcher(m_plugin, effGetProgramNameIndexed, p, 0, name, 0);
     }
 
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&m_mutex);
     return name;
 }
 
@@ -453,51 +1216,43 @@ RemoteVSTServer::setCurrentProgram(int p)
 	cerr << "dssi-vst-server[2]: setCurrentProgram(" << p << ")" << endl;
     }
 
-    pthread_mutex_lock(&mutex);
+    pthread_mutex_lock(&m_mutex);
 
     m_plugin->dispatcher(m_plugin, effSetProgram, 0, p, 0, 0);
 
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&m_mutex);
 }
 
 void
 RemoteVSTServer::sendMIDIData(unsigned char *data, int *frameOffsets, int events)
 {
-#define MIDI_EVENT_BUFFER_COUNT 1024
-    static VstMidiEvent vme[MIDI_EVENT_BUFFER_COUNT];
-    static char evbuf[sizeof(VstMidiEvent *) * MIDI_EVENT_BUFFER_COUNT +
-		      sizeof(VstEvents)];
-    
-    VstEvents *vstev = (VstEvents *)evbuf;
-    vstev->reserved = 0;
-
-    int ix = 0;
-
-    if (events > MIDI_EVENT_BUFFER_COUNT) {
-	std::cerr << "vstserv: WARNING: " << events << " MIDI events received "
-		  << "for " << MIDI_EVENT_BUFFER_COUNT << "-event buffer"
-		  << std::endl;
-	events = MIDI_EVENT_BUFFER_COUNT;
-    }
-
-    while (ix < events) {
-
-	vme[ix].type = kVstMidiType;
-	vme[ix].byteSize = 24;
-	vme[ix].deltaFrames = (frameOffsets ? frameOffsets[ix] : 0);
-	vme[ix].flags = 0;
-	vme[ix].noteLength = 0;
-	vme[ix].noteOffset = 0;
-	vme[ix].detune = 0;
-	vme[ix].noteOffVelocity = 0;
-	vme[ix].reserved1 = 0;
-	vme[ix].reserved2 = 0;
-	vme[ix].midiData[0] = data[ix*3];
-	vme[ix].midiData[1] = data[ix*3+1];
-	vme[ix].midiData[2] = data[ix*3+2];
-	vme[ix].midiData[3] = 0;
-	
-	vstev->events[ix] = (VstEvent *)&vme[ix];
+    if (m_midiEventCount + events > MIDI_EVENT_BUFFER_COUNT) {
+	std::cerr << "vstserv: WARNING: " << m_midiEventCount + events
+		  << " MIDI events received for " << MIDI_EVENT_BUFFER_COUNT
+		  << "-event buffer" << std::endl;
+	events = MIDI_EVENT_BUFFER_COUNT - m_midiEventCount;
+    }
+
+    for (int ix = 0; ix < events; ++ix) {
+
+	int frame = (frameOffsets ? frameOffsets[ix] : 0);
+	m_midiEventFrames[m_midiEventCount] = (frame > 0 ? frame : 0);
+	VstMidiEvent &vme = m_midiEvents[m_midiEventCount++];
+
+	vme.type = kVstMidiType;
+	vme.byteSize = 24;
+	vme.deltaFrames = frame;
+	vme.flags = 0;
+	vme.noteLength = 0;
+	vme.noteOffset = 0;
+	vme.detune = 0;
+	vme.noteOffVelocity = 0;
+	vme.reserved1 = 0;
+	vme.reserved2 = 0;
+	vme.midiData[0] = data[ix*3];
+	vme.midiData[1] = data[ix*3+1];
+	vme.midiData[2] = data[ix*3+2];
+	vme.midiData[3] = 0;
 	
 	if (debugLevel > 1) {
 	    cerr << "dssi-vst-server[2]: MIDI event in: "
@@ -505,22 +1260,13 @@ RemoteVSTServer::sendMIDIData(unsigned char *data, int *frameOffsets, int events
 		 << (int)data[ix*3+1] << " "
 		 << (int)data[ix*3+2] << endl;
 	}
-	
-	++ix;
     }
-
-    pthread_mutex_lock(&mutex);
-
-    vstev->numEvents = events;
-    m_plugin->dispatcher(m_plugin, effProcessEvents, 0, 0, vstev, 0);
-
-    pthread_mutex_unlock(&mutex);
 }
 
 bool
 RemoteVSTServer::warn(std::string warning)
 {
-    if (hWnd) MessageBox(hWnd, warning.c_str(), "Error", 0);
+    if (m_hWnd) MessageBox(m_hWnd, warning.c_str(), "Error", 0);
     return true;
 }
 
@@ -528,10 +1274,10 @@ void
 RemoteVSTServer::showGUI(std::string guiData)
 {
     if (debugLevel > 0) {
-	cerr << "RemoteVSTServer::showGUI(" << guiData << "): guiVisible is " << guiVisible << endl;
+	cerr << "RemoteVSTServer::showGUI(" << guiData << "): guiVisible is " << m_guiVisible << endl;
     }
 
-    if (guiVisible) return;
+    if (m_guiVisible) return;
 
     const std::string guiTitle = guiData.substr(23, guiData.length());
     const std::string guiFifoFile = guiData.erase(23, std::string::npos);
@@ -548,14 +1294,14 @@ RemoteVSTServer::showGUI(std::string guiData)
 	if ((m_guiFifoFd = open(m_guiFifoFile.c_str(), O_WRONLY | O_NONBLOCK)) < 0) {
 	    perror(m_guiFifoFile.c_str());
 	    cerr << "WARNING: Failed to open FIFO to GUI manager process" << endl;
-	    pthread_mutex_unlock(&mutex);
+	    pthread_mutex_unlock(&m_mutex);
 	    return;
 	}
 
 	writeOpcode(m_guiFifoFd, RemotePluginIsReady);
     }
 
-    m_plugin->dispatcher(m_plugin, effEditOpen, 0, 0, hWnd, 0);
+    m_plugin->dispatcher(m_plugin, effEditOpen, 0, 0, m_hWnd, 0);
     Rect *rect = 0;
     m_plugin->dispatcher(m_plugin, effEditGetRect, 0, 0, &rect, 0);
     if (!rect) {
@@ -564,7 +1310,7 @@ RemoteVSTServer::showGUI(std::string guiData)
 	// Seems we need to provide space in here for the titlebar
 	// and frame, even though we don't know how big they'll
 	// be!  How crap.
-	SetWindowPos(hWnd, 0, 0, 0,
+	SetWindowPos(m_hWnd, 0, 0, 0,
 		     rect->right - rect->left + 6,
 		     rect->bottom - rect->top + 25,
 		     SWP_NOACTIVATE | SWP_NOMOVE |
@@ -574,10 +1320,10 @@ RemoteVSTServer::showGUI(std::string guiData)
 	    cerr << "dssi-vst-server[1]: sized window" << endl;
 	}
 
-	SetWindowTextA(hWnd, guiTitle.c_str());
-	ShowWindow(hWnd, SW_SHOWNORMAL);
-	UpdateWindow(hWnd);
-	guiVisible = true;
+	SetWindowTextA(m_hWnd, guiTitle.c_str());
+	ShowWindow(m_hWnd, SW_SHOWNORMAL);
+	UpdateWindow(m_hWnd);
+	m_guiVisible = true;
     }
 
     m_paramChangeReadIndex = m_paramChangeWriteIndex;
@@ -586,7 +1332,7 @@ RemoteVSTServer::showGUI(std::string guiData)
 void
 RemoteVSTServer::hideGUI()
 {
-    if (!guiVisible) return;
+    if (!m_guiVisible) return;
 
     if (m_guiFifoFd >= 0) {
 	int fd = m_guiFifoFd;
@@ -594,10 +1340,10 @@ RemoteVSTServer::hideGUI()
 	close(fd);
     }
 
-    ShowWindow(hWnd, SW_HIDE);
-    UpdateWindow(hWnd);
+    ShowWindow(m_hWnd, SW_HIDE);
+    UpdateWindow(m_hWnd);
     m_plugin->dispatcher(m_plugin, effEditClose, 0, 0, 0, 0);
-    guiVisible = false;
+    m_guiVisible = false;
 }
 
 //Deryabin Andrew: vst chunks support
@@ -607,10 +1353,7 @@ std::vector<char> RemoteVSTServer::getVSTChunk()
     char * chunkraw = 0;
     int len = m_plugin->dispatcher(m_plugin, 23, 0, 0, (void **)&chunkraw, 0);
     std::vector<char> chunk;
-    for(int i = 0; i < len; i++)
-    {
-        chunk.push_back(chunkraw [i]);
-    }
+    if (len > 0 && chunkraw) chunk.assign(chunkraw, chunkraw + len);
 
     if (len > 0)
     {
@@ -620,14 +1363,15 @@ std::vector<char> RemoteVSTServer::getVSTChunk()
     return chunk;
 }
 
-bool RemoteVSTServer::setVSTChunk(std::vector<char> chunk)
+bool RemoteVSTServer::setVSTChunk(const std::vector<char> &chunk)
 {
     cerr << "dssi-vst-server: Sending vst chunk to plugin. Size=" << chunk.size() << endl;
-    std::vector<char>::pointer ptr = &chunk [0];
+    if (chunk.empty()) return true;
+    void *ptr = (void *)&chunk[0];
 
-    pthread_mutex_lock(&mutex);
-    m_plugin->dispatcher(m_plugin, 24, 0, chunk.size(), (void *)ptr, 0);
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_lock(&m_mutex);
+    m_plugin->dispatcher(m_plugin, 24, 0, chunk.size(), ptr, 0);
+    pthread_mutex_unlock(&m_mutex);
 
     return true;
 }
@@ -760,7 +1504,10 @@ hostCallback(AEffect *plugin, long opcode, long index,
 	     long value, void *ptr, float opt)
 #endif
 {
-    static VstTimeInfo_R timeInfo;
+    // Per thread, as each instance's audio thread may ask for it
+    static __thread VstTimeInfo_R timeInfo;
+    RemoteVSTServer *server =
+	((plugin && !instantiating) ? (RemoteVSTServer *)plugin->user : 0);
     int rv = 0;
 
     switch (opcode) {
@@ -784,8 +1531,11 @@ hostCallback(AEffect *plugin, long opcode, long index,
 	if (debugLevel > 1)
 	    cerr << "dssi-vst-server[2]: audioMasterAutomate(" << index << "," << v << ")" << endl;
 
-	if (remoteVSTServerInstance)
-	    remoteVSTServerInstance->scheduleGUINotify(index, v);
+	if (server) {
+	    int p = server->getParameterOffset(plugin) + index;
+	    server->publishParameter(p, v);
+	    server->scheduleGUINotify(p, v);
+	}
 
 	break;
     }
@@ -826,8 +1576,10 @@ hostCallback(AEffect *plugin, long opcode, long index,
 //	if (debugLevel > 1)
 //	    cerr << "dssi-vst-server[2]: audioMasterGetTime requested" << endl;
         memset(&timeInfo, 0, sizeof(VstTimeInfo_R));
-        timeInfo.sampleRate = sampleRate;
-        timeInfo.samplePos  = currentSamplePosition;
+        if (server) {
+            timeInfo.sampleRate = server->getSampleRate();
+            timeInfo.samplePos  = server->getSamplePosition();
+        }
 
         if (jack_client)
         {
@@ -908,14 +1660,19 @@ hostCallback(AEffect *plugin, long opcode, long index,
     case audioMasterIOChanged:
 	if (debugLevel > 1)
 	    cerr << "dssi-vst-server[2]: audioMasterIOChanged requested" << endl;
-	cerr << "WARNING: Plugin inputs and/or outputs changed: NOT SUPPORTED" << endl;
+	if (server) {
+	    if (!server->ioChanged()) {
+		cerr << "WARNING: Plugin inputs and/or outputs changed: NOT SUPPORTED" << endl;
+	    }
+	    rv = 1;
+	}
 	break;
 
     case DEPRECATED_VST_SYMBOL(audioMasterNeedIdle):
 	if (debugLevel > 1) {
 	    cerr << "dssi-vst-server[2]: audioMasterNeedIdle requested" << endl;
 	}
-	needIdle=true;
+	if (server) server->setNeedIdle();
 	rv = 1;
 	break;
 
@@ -923,8 +1680,8 @@ hostCallback(AEffect *plugin, long opcode, long index,
 	if (debugLevel > 1) {
 	    cerr << "dssi-vst-server[2]: audioMasterSizeWindow requested" << endl;
 	}
-	if (hWnd) {
-	    SetWindowPos(hWnd, 0, 0, 0,
+	if (server && server->getWindow()) {
+	    SetWindowPos(server->getWindow(), 0, 0, 0,
 			 index + 6,
 			 value + 25,
 			 SWP_NOACTIVATE | SWP_NOMOVE |
@@ -934,8 +1691,10 @@ hostCallback(AEffect *plugin, long opcode, long index,
 	break;
 
     case audioMasterGetSampleRate:
+    {
 	if (debugLevel > 1)
 	    cerr << "dssi-vst-server[2]: audioMasterGetSampleRate requested" << endl;
+	int sampleRate = (server ? server->getSampleRate() : 0);
 	if (!sampleRate) {
 	    cerr << "WARNING: Sample rate requested but not yet set" << endl;
 	}
@@ -943,10 +1702,13 @@ hostCallback(AEffect *plugin, long opcode, long index,
 			   0, 0, NULL, (float)sampleRate);
         rv = sampleRate;
 	break;
+    }
 
     case audioMasterGetBlockSize:
+    {
 	if (debugLevel > 1)
 	    cerr << "dssi-vst-server[2]: audioMasterGetBlockSize requested" << endl;
+	int bufferSize = (server ? server->getBlockSize() : 0);
 	if (!bufferSize) {
 	    cerr << "WARNING: Buffer size requested but not yet set" << endl;
 	}
@@ -954,6 +1716,7 @@ hostCallback(AEffect *plugin, long opcode, long index,
 			   0, bufferSize, NULL, 0);
         rv = bufferSize;
 	break;
+    }
 
     case audioMasterGetInputLatency:
 	if (debugLevel > 1)
@@ -983,13 +1746,16 @@ hostCallback(AEffect *plugin, long opcode, long index,
 	break;
 
     case audioMasterGetCurrentProcessLevel:
-	if (debugLevel > 1) {
-	    cerr << "dssi-vst-server[2]: audioMasterGetCurrentProcessLevel requested (level is " << (inProcessThread ? 2 : 1) << ")" << endl;
-	}
+    {
+	bool inProcessThread = (server && server->isInProcessThread());
 	// 0 -> unsupported, 1 -> gui, 2 -> process, 3 -> midi/timer, 4 -> offline
-	if (inProcessThread) rv = 2;
+	if (inProcessThread) rv = (server->isOffline() ? 4 : 2);
 	else rv = 1;
+	if (debugLevel > 1) {
+	    cerr << "dssi-vst-server[2]: audioMasterGetCurrentProcessLevel requested (level is " << rv << ")" << endl;
+	}
 	break;
+    }
 
     case audioMasterGetAutomationState:
 	if (debugLevel > 1)
@@ -1108,13 +1874,13 @@ hostCallback(AEffect *plugin, long opcode, long index,
     case audioMasterBeginEdit:
 	if (debugLevel > 1)
 	    cerr << "dssi-vst-server[2]: audioMasterBeginEdit requested" << endl;
-	remoteVSTServerInstance->startEdit();
+	if (server) server->startEdit();
 	break;
 
     case audioMasterEndEdit:
 	if (debugLevel > 1)
 	    cerr << "dssi-vst-server[2]: audioMasterEndEdit requested" << endl;
-	remoteVSTServerInstance->endEdit();
+	if (server) server->endEdit();
 	break;
 
     case audioMasterOpenFileSelector:
@@ -1155,8 +1921,26 @@ hostCallback(AEffect *plugin, long opcode, long index,
 DWORD WINAPI
 WatchdogThreadMain(LPVOID parameter)
 {
-    struct sched_param param;
-    param.sched_priority = 2;
+    return ((RemoteVSTServer *)parameter)->watchdogThread();
+}
+
+DWORD WINAPI
+AudioThreadMain(LPVOID parameter)
+{
+    return ((RemoteVSTServer *)parameter)->audioThread();
+}
+
+DWORD WINAPI
+WorkerThreadMain(LPVOID parameter)
+{
+    return ((RemoteVSTServer *)parameter)->workerThread();
+}
+
+DWORD
+RemoteVSTServer::watchdogThread()
+{
+    struct sched_param param;
+    param.sched_priority = 2;
     int result = sched_setscheduler(0, SCHED_FIFO, &param);
     if (result < 0) {
 	perror("Failed to set realtime priority for watchdog thread");
@@ -1164,15 +1948,15 @@ WatchdogThreadMain(LPVOID parameter)
 
     int count = 0;
 
-    while (!exiting) {
-	if (!alive) {
+    while (!m_exiting) {
+	if (!m_alive) {
 	    ++count;
 	}
 	if (count == 20) {
 	    cerr << "Remote VST plugin watchdog: terminating audio thread" << endl;
 	    // bam
-	    TerminateThread(audioThreadHandle, 0);
-	    exiting = 1;
+	    TerminateThread(m_audioThreadHandle, 0);
+	    m_exiting = true;
 	    break;
 	} else {
 //	    cerr << "Remote VST plugin watchdog: OK, count is " << count << endl;
@@ -1187,12 +1971,14 @@ WatchdogThreadMain(LPVOID parameter)
     return 0;
 }
 
-DWORD WINAPI
-AudioThreadMain(LPVOID parameter)
+DWORD
+RemoteVSTServer::audioThread()
 {
     struct sched_param param;
     param.sched_priority = 1;
-    HANDLE watchdogThreadHandle;
+    HANDLE watchdogThreadHandle = 0;
+
+    bindThreadToCpu("audio");
 
     int result = sched_setscheduler(0, SCHED_FIFO, &param);
 
@@ -1202,7 +1988,7 @@ AudioThreadMain(LPVOID parameter)
 	// Start a watchdog thread as well
 	DWORD watchdogThreadId = 0;
 	watchdogThreadHandle =
-	    CreateThread(0, 0, WatchdogThreadMain, 0, 0, &watchdogThreadId);
+	    CreateThread(0, 0, WatchdogThreadMain, this, 0, &watchdogThreadId);
 	if (!watchdogThreadHandle) {
 	    cerr << "Failed to create watchdog thread -- not using RT priority for audio thread" << endl;
 	    param.sched_priority = 0;
@@ -1210,17 +1996,17 @@ AudioThreadMain(LPVOID parameter)
 	}
     }
 
-    while (!exiting) {
-	alive = true;
+    while (!m_exiting) {
+	m_alive = true;
 	try {
 	    // This can call sendMIDIData, setCurrentProgram, process
-	    remoteVSTServerInstance->dispatchProcess(50);
+	    dispatchProcess(50);
 	} catch (std::string message) {
 	    cerr << "ERROR: Remote VST server instance failed: " << message << endl;
-	    exiting = true;
+	    m_exiting = true;
 	} catch (RemotePluginClosedException) {
 	    cerr << "ERROR: Remote VST plugin communication failure in audio thread" << endl;
-	    exiting = true;
+	    m_exiting = true;
 	}
     }
 
@@ -1236,70 +2022,241 @@ AudioThreadMain(LPVOID parameter)
     return 0;
 }
 
+DWORD
+RemoteVSTServer::workerThread()
+{
+    bindThreadToCpu("worker");
+
+    // Same priority as the audio thread, which waits for us
+    struct sched_param param;
+    param.sched_priority = 1;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+	perror("Failed to set realtime priority for worker thread");
+    }
+
+    int32_t seen = __atomic_load_n(&m_workGeneration, __ATOMIC_ACQUIRE);
+
+    while (!m_workersExiting) {
+	int32_t generation = __atomic_load_n(&m_workGeneration, __ATOMIC_ACQUIRE);
+	if (generation == seen) {
+	    rdwr_futexWait(&m_workGeneration, seen, 500);
+	    continue;
+	}
+	seen = generation;
+	takeBranches(generation);
+    }
+
+    param.sched_priority = 0;
+    (void)sched_setscheduler(0, SCHED_OTHER, &param);
+    return 0;
+}
+
+void
+RemoteVSTServer::startWorkers()
+{
+    // The audio thread takes a share of the work itself, so it's one
+    // fewer than the widest stage, and there's no point in more than
+    // we have CPUs for
+    int cpus = audioCpus.size();
+    if (cpus == 0) cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = std::min(m_widestStage, cpus) - 1;
+
+    for (int i = 0; i < workers; ++i) {
+	DWORD threadId = 0;
+	HANDLE handle = CreateThread(0, 0, WorkerThreadMain, this, 0, &threadId);
+	if (!handle) {
+	    cerr << "dssi-vst-server: Failed to create worker thread" << endl;
+	    break;
+	}
+	m_workerHandles.push_back(handle);
+    }
+
+    if (debugLevel > 0) {
+	cerr << "dssi-vst-server[1]: created " << m_workerHandles.size()
+	     << " worker thread(s)" << endl;
+    }
+}
+
+void
+RemoteVSTServer::stopWorkers()
+{
+    if (m_workerHandles.empty()) return;
+
+    m_workersExiting = true;
+    __atomic_add_fetch(&m_workGeneration, 1, __ATOMIC_SEQ_CST);
+    for (size_t i = 0; i < m_workerHandles.size(); ++i) {
+	rdwr_futexWake(&m_workGeneration);
+    }
+
+    for (size_t i = 0; i < m_workerHandles.size(); ++i) {
+	if (WaitForSingleObject(m_workerHandles[i], 1000) != WAIT_OBJECT_0) {
+	    cerr << "dssi-vst-server: worker thread failed to exit, terminating it" << endl;
+	    TerminateThread(m_workerHandles[i], 0);
+	}
+	CloseHandle(m_workerHandles[i]);
+    }
+
+    m_workerHandles.clear();
+}
+
 LRESULT WINAPI
 MainProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
 {
     switch (msg) {
     case WM_CLOSE:
-	remoteVSTServerInstance->terminateGUIProcess();
-        remoteVSTServerInstance->hideGUI();
+    {
+	RemoteVSTServer *server =
+	    (RemoteVSTServer *)GetWindowLongPtrA(hWnd, GWLP_USERDATA);
+	if (server) {
+	    server->terminateGUIProcess();
+	    server->hideGUI();
+	}
         return TRUE;
     }
+    }
 
     return DefWindowProc(hWnd, msg, wParam, lParam);
 }
 
-int WINAPI
-WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, LPSTR cmdline, int cmdshow)
+bool
+RemoteVSTServer::createWindow(bool showEditor)
 {
-    char *libname = 0;
-    char *fileInfo = 0;
-    bool tryGui = false, haveGui = true;
+    m_hWnd = CreateWindow
+	(APPLICATION_CLASS_NAME, m_name.c_str(),
+	 WS_OVERLAPPEDWINDOW & ~WS_THICKFRAME & ~WS_MAXIMIZEBOX,
+	 CW_USEDEFAULT, CW_USEDEFAULT, CW_USEDEFAULT, CW_USEDEFAULT,
+	 0, 0, appInstance, 0);
+    if (!m_hWnd) {
+	cerr << "dssi-vst-server: ERROR: Failed to create window!\n" << endl;
+	return false;
+    } else if (debugLevel > 0) {
+	cerr << "dssi-vst-server[1]: created main window" << endl;
+    }
 
-    cout << "DSSI VST plugin server v" << RemotePluginVersion << endl;
-    cout << "Copyright (c) 2012-2013 Filipe Coelho" << endl;
-    cout << "Copyright (c) 2010-2011 Kristian Amlie" << endl;
-    cout << "Copyright (c) 2004-2010 Chris Cannam" << endl;
+    // Lets MainProc find this instance
+    SetWindowLongPtrA(m_hWnd, GWLP_USERDATA, (LONG_PTR)this);
 
-    char *home = getenv("HOME");
-
-    if (cmdline) {
-	int offset = 0;
-	if (cmdline[0] == '"' || cmdline[0] == '\'') offset = 1;
-	if (!strncmp(&cmdline[offset], "-g ", 3)) {
-	    tryGui = true;
-	    offset += 3;
-	}
-	for (int ci = offset; cmdline[ci]; ++ci) {
-	    if (cmdline[ci] == ',') {
-		libname = strndup(cmdline + offset, ci - offset);
-		++ci;
-		if (cmdline[ci]) {
-		    fileInfo = strdup(cmdline + ci);
-		    int l = strlen(fileInfo);
-		    if (fileInfo[l-1] == '"' ||
-			fileInfo[l-1] == '\'') {
-			fileInfo[l-1] = '\0';
-		    }
-		}
-	    }
+    if (!(m_plugin->flags & effFlagsHasEditor)) {
+	if (debugLevel > 0) {
+	    cerr << "dssi-vst-server[1]: Plugin has no GUI" << endl;
 	}
+	cerr << "Should be showing message here" << endl;
+	return true;
+    } else if (debugLevel > 0) {
+	cerr << "dssi-vst-server[1]: plugin has a GUI" << endl;
     }
 
-    if (!libname || !libname[0] || !fileInfo || !fileInfo[0]) {
-	cerr << "Usage: dssi-vst-server <vstname.dll>,<tmpfilebase>" << endl;
-	cerr << "(Command line was: " << cmdline << ")" << endl;
-	exit(2);
+    if (!showEditor) return true;
+
+    m_plugin->dispatcher(m_plugin, effEditOpen, 0, 0, m_hWnd, 0);
+    Rect *rect = 0;
+    m_plugin->dispatcher(m_plugin, effEditGetRect, 0, 0, &rect, 0);
+    if (!rect) {
+	cerr << "dssi-vst-server: ERROR: Plugin failed to report window size\n" << endl;
+	return false;
     }
 
-    // LADSPA labels can't contain spaces so dssi-vst replaces spaces
-    // with asterisks.
-    for (int ci = 0; libname[ci]; ++ci) {
-	if (libname[ci] == '*') libname[ci] = ' ';
+    // Seems we need to provide space in here for the titlebar
+    // and frame, even though we don't know how big they'll
+    // be!  How crap.
+    SetWindowPos(m_hWnd, 0, 0, 0,
+		 rect->right - rect->left + 6,
+		 rect->bottom - rect->top + 25,
+		 SWP_NOACTIVATE | SWP_NOMOVE |
+		 SWP_NOOWNERZORDER | SWP_NOZORDER);
+
+    if (debugLevel > 0) {
+	cerr << "dssi-vst-server[1]: sized window" << endl;
     }
 
-    cout << "Loading \"" << libname << "\"... ";
-    if (debugLevel > 0) cout << endl;
+    ShowWindow(m_hWnd, SW_SHOWNORMAL);
+    UpdateWindow(m_hWnd);
+
+    if (debugLevel > 0) {
+	cerr << "dssi-vst-server[1]: showed window" << endl;
+    }
+
+    m_guiVisible = true;
+    m_followEditor = true;
+    return true;
+}
+
+bool
+RemoteVSTServer::startAudioThread()
+{
+    if (m_widestStage > 1) startWorkers();
+
+    DWORD threadId = 0;
+    m_audioThreadHandle = CreateThread(0, 0, AudioThreadMain, this, 0, &threadId);
+    if (!m_audioThreadHandle) {
+	cerr << "Failed to create audio thread!" << endl;
+	return false;
+    } else if (debugLevel > 0) {
+	cerr << "dssi-vst-server[1]: created audio thread" << endl;
+    }
+
+    m_ready = true;
+    return true;
+}
+
+void
+RemoteVSTServer::stopAudioThread()
+{
+    if (!m_audioThreadHandle) return;
+
+    m_exiting = true;
+
+    // The audio thread checks the flag at least every 50ms unless
+    // the plugin itself is stuck
+    if (WaitForSingleObject(m_audioThreadHandle, 1000) != WAIT_OBJECT_0) {
+	cerr << "dssi-vst-server: audio thread failed to exit, terminating it" << endl;
+	TerminateThread(m_audioThreadHandle, 0);
+    }
+
+    CloseHandle(m_audioThreadHandle);
+    m_audioThreadHandle = 0;
+
+    if (debugLevel > 0) {
+	cerr << "dssi-vst-server[1]: closed audio thread" << endl;
+    }
+
+    stopWorkers();
+}
+
+void
+RemoteVSTServer::idle()
+{
+    /* this bit based on fst by Torben Hohn, patch worked out
+     * by Robert Jonsson - thanks! */
+    m_plugin->dispatcher(m_plugin, effEditIdle, 0, 0, NULL, 0);
+    if (m_needIdle) {
+	m_plugin->dispatcher(m_plugin, 53, 0, 0, NULL, 0);
+    }
+
+    uint32_t misses = __atomic_load_n(&m_deadlineMisses, __ATOMIC_RELAXED);
+    if (misses != m_deadlineMissesReported) {
+	time_t now = time(0);
+	if (now >= m_lastMissReport + 5) {
+	    cerr << "dssi-vst-server: WARNING: \"" << m_name << "\" overran "
+		 << misses - m_deadlineMissesReported << " block(s)"
+		 << " (" << misses << " in all)" << endl;
+	    m_deadlineMissesReported = misses;
+	    m_lastMissReport = now;
+	}
+    }
+}
+
+// DLLs are loaded once however many instances use them
+struct LoadedLibrary {
+    HINSTANCE handle;
+    int refCount;
+};
+static std::map<std::string, LoadedLibrary> loadedLibraries;
+
+static HINSTANCE
+findLibrary(std::string libname)
+{
+    char *home = getenv("HOME");
 
     HINSTANCE libHandle = 0;
 
@@ -1340,16 +2297,109 @@ WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, LPSTR cmdline, int cmdshow)
     }	
 
     if (!libHandle) {
-	libHandle = LoadLibrary(libname);
+	libHandle = LoadLibrary(libname.c_str());
 	if (debugLevel > 0) {
 	    cerr << "dssi-vst-server[1]: " << (libHandle ? "" : "not ")
 		 << "found in DLL path" << endl;
 	}
     }
 
+    return libHandle;
+}
+
+static HINSTANCE
+acquireLibrary(std::string libname)
+{
+    std::map<std::string, LoadedLibrary>::iterator i =
+	loadedLibraries.find(libname);
+
+    if (i != loadedLibraries.end()) {
+	if (debugLevel > 0) {
+	    cerr << "dssi-vst-server[1]: reusing loaded DLL" << endl;
+	}
+	++i->second.refCount;
+	return i->second.handle;
+    }
+
+    HINSTANCE libHandle = findLibrary(libname);
+    if (libHandle) {
+	LoadedLibrary lib;
+	lib.handle = libHandle;
+	lib.refCount = 1;
+	loadedLibraries[libname] = lib;
+    }
+    return libHandle;
+}
+
+static void
+releaseLibrary(std::string libname)
+{
+    std::map<std::string, LoadedLibrary>::iterator i =
+	loadedLibraries.find(libname);
+
+    if (i == loadedLibraries.end()) return;
+    if (--i->second.refCount > 0) return;
+
+    FreeLibrary(i->second.handle);
+    loadedLibraries.erase(i);
+
+    if (debugLevel > 0) {
+	cerr << "dssi-vst-server[1]: freed dll" << endl;
+    }
+}
+
+// Parse "[-g ]<vstname.dll>,<fileidentifiers>", as found on the
+// command line or in a request to a shared server
+static bool
+parseRequest(std::string request, std::string &libname,
+	     std::string &fileInfo, bool &tryGui)
+{
+    size_t offset = 0;
+    if (!request.empty() && (request[0] == '"' || request[0] == '\'')) {
+	offset = 1;
+    }
+
+    tryGui = false;
+    if (request.compare(offset, 3, "-g ") == 0) {
+	tryGui = true;
+	offset += 3;
+    }
+
+    size_t comma = request.rfind(',');
+    if (comma == std::string::npos || comma < offset) return false;
+
+    libname = request.substr(offset, comma - offset);
+    fileInfo = request.substr(comma + 1);
+
+    if (!fileInfo.empty() &&
+	(fileInfo[fileInfo.length()-1] == '"' ||
+	 fileInfo[fileInfo.length()-1] == '\'')) {
+	fileInfo.erase(fileInfo.length()-1);
+    }
+
+    // Four six-character identifiers: see RemotePluginServer
+    if (libname.empty() || fileInfo.length() < 24) return false;
+
+    // LADSPA labels can't contain spaces so dssi-vst replaces spaces
+    // with asterisks.
+    for (size_t ci = 0; ci < libname.length(); ++ci) {
+	if (libname[ci] == '*') libname[ci] = ' ';
+    }
+
+    return true;
+}
+
+static AEffect *
+loadPlugin(std::string libname)
+{
+    cout << "Loading \"" << libname << "\"... ";
+    if (debugLevel > 0) cout << endl;
+
+    HINSTANCE libHandle = acquireLibrary(libname);
+
     if (!libHandle) {
 	cerr << "dssi-vst-server: ERROR: Couldn't load VST DLL \"" << libname << "\"" << endl;
-	return 1;
+	return 0;
     }
 
     cout << "done" << endl;
@@ -1380,7 +2430,8 @@ WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, LPSTR cmdline, int cmdshow)
 		 << NEW_PLUGIN_ENTRY_POINT << "\" or \"" 
 		 << OLD_PLUGIN_ENTRY_POINT << "\" not found in DLL \""
 		 << libname << "\"" << endl;
-	    return 1;
+	    releaseLibrary(libname);
+	    return 0;
 	} else if (debugLevel > 0) {
 	    cerr << "dssi-vst-server[1]: VST entrypoint \""
 		 << OLD_PLUGIN_ENTRY_POINT << "\" found" << endl;
@@ -1391,54 +2442,321 @@ WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, LPSTR cmdline, int cmdshow)
 	     << NEW_PLUGIN_ENTRY_POINT << "\" found" << endl;
     }
 
+    instantiating = true;
     AEffect *plugin = getInstance(hostCallback);
+    instantiating = false;
 
     if (!plugin) {
 	cerr << "dssi-vst-server: ERROR: Failed to instantiate plugin in VST DLL \""
 	     << libname << "\"" << endl;
-	return 1;
+	releaseLibrary(libname);
+	return 0;
     } else if (debugLevel > 0) {
 	cerr << "dssi-vst-server[1]: plugin instantiated" << endl;
     }
 
     if (plugin->magic != kEffectMagic) {
 	cerr << "dssi-vst-server: ERROR: Not a VST plugin in DLL \"" << libname << "\"" << endl;
-	return 1;
+	releaseLibrary(libname);
+	return 0;
     } else if (debugLevel > 0) {
 	cerr << "dssi-vst-server[1]: plugin is a VST" << endl;
     }
 
-    if (!(plugin->flags & effFlagsHasEditor)) {
-	if (debugLevel > 0) {
-	    cerr << "dssi-vst-server[1]: Plugin has no GUI" << endl;
-	}
-	haveGui = false;
-    } else if (debugLevel > 0) {
-	cerr << "dssi-vst-server[1]: plugin has a GUI" << endl;
-    }
-
     if (!(plugin->flags & effFlagsCanReplacing)) {
 	cerr << "dssi-vst-server: ERROR: Plugin does not support processReplacing (required)"
 	     << endl;
-	return 1;
+	plugin->dispatcher(plugin, effClose, 0, 0, NULL, 0);
+	releaseLibrary(libname);
+	return 0;
     } else if (debugLevel > 0) {
 	cerr << "dssi-vst-server[1]: plugin supports processReplacing" << endl;
     }
 
+    return plugin;
+}
+
+// Split "a.dll|b.dll+c.dll|..." into its DLL names
+static std::vector<std::string>
+splitChain(std::string libname)
+{
+    std::vector<std::string> names;
+    size_t start = 0, bar;
+    while ((bar = libname.find_first_of("|+", start)) != std::string::npos) {
+	names.push_back(libname.substr(start, bar - start));
+	start = bar + 1;
+    }
+    names.push_back(libname.substr(start));
+    return names;
+}
+
+// detached is true if we were not started by the instance's own
+// client, as a shared or pooled server
+static RemoteVSTServer *
+startInstance(std::string libname, std::string fileInfo, bool tryGui,
+	      bool detached)
+{
+    std::vector<std::string> names = splitChain(libname);
+    std::vector<AEffect *> chain;
+
+    for (size_t i = 0; i < names.size(); ++i) {
+	AEffect *plugin = loadPlugin(names[i]);
+	if (!plugin) break;
+	chain.push_back(plugin);
+    }
+
+    if (chain.size() < names.size()) {
+	for (size_t i = 0; i < chain.size(); ++i) {
+	    chain[i]->dispatcher(chain[i], effClose, 0, 0, NULL, 0);
+	    releaseLibrary(names[i]);
+	}
+	return 0;
+    }
+
+    RemoteVSTServer *server = 0;
+
     try {
-	remoteVSTServerInstance =
-	    new RemoteVSTServer(fileInfo, plugin, libname);
+	server = new RemoteVSTServer(fileInfo, chain, libname);
     } catch (std::string message) {
 	cerr << "ERROR: Remote VST startup failed: " << message << endl;
-	return 1;
     } catch (RemotePluginClosedException) {
 	cerr << "ERROR: Remote VST plugin communication failure in startup" << endl;
-	return 1;
     }
 
+    if (!server) {
+	for (size_t i = 0; i < chain.size(); ++i) {
+	    chain[i]->dispatcher(chain[i], effClose, 0, 0, NULL, 0);
+	    releaseLibrary(names[i]);
+	}
+	return 0;
+    }
+
+    // The run pipes are inherited by a server started for a single
+    // instance, so any other server can only be woken by futex
+    if (detached && !server->usesFutexSignal()) {
+	cerr << "dssi-vst-server: ERROR: A shared or pooled server needs futex signalling"
+	     << endl;
+	delete server;
+	for (size_t i = 0; i < names.size(); ++i) releaseLibrary(names[i]);
+	return 0;
+    }
+
+    if (!server->createWindow(tryGui) || !server->startAudioThread()) {
+	delete server;
+	for (size_t i = 0; i < names.size(); ++i) releaseLibrary(names[i]);
+	return 0;
+    }
+
+    cout << "done" << endl;
+
+    return server;
+}
+
+struct Instance {
+    RemoteVSTServer *server;
+    std::string libname;
+};
+
+static void
+stopInstance(Instance &instance)
+{
+    instance.server->stopAudioThread();
+    delete instance.server;
+    instance.server = 0;
+
+    std::vector<std::string> names = splitChain(instance.libname);
+    for (size_t i = 0; i < names.size(); ++i) releaseLibrary(names[i]);
+}
+
+// Start an instance for each complete request waiting on the listen FIFO
+static void
+acceptRequests(int fd, std::vector<Instance> &instances)
+{
+    char record[RemotePluginServerRequestSize];
+
+    while (read(fd, record, sizeof(record)) == (ssize_t)sizeof(record)) {
+
+	record[sizeof(record) - 1] = '\0';
+
+	std::string libname, fileInfo;
+	bool tryGui = false;
+
+	if (!parseRequest(record, libname, fileInfo, tryGui)) {
+	    cerr << "dssi-vst-server: ignoring malformed request \""
+		 << record << "\"" << endl;
+	    continue;
+	}
+
+	Instance instance;
+	instance.server = startInstance(libname, fileInfo, tryGui, true);
+	instance.libname = libname;
+	if (instance.server) instances.push_back(instance);
+    }
+}
+
+// How long a shared server with no instances waits for a new request
+// before exiting
+#define SHARED_SERVER_IDLE_TIMEOUT 10 // sec
+
+static int
+openListenFifo(std::string name, int &writeFd)
+{
+    if (mkfifo(name.c_str(), 0600) && errno != EEXIST) {
+	perror(name.c_str());
+	return -1;
+    }
+
+    int fd = open(name.c_str(), O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+	perror(name.c_str());
+	return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISFIFO(st.st_mode) || st.st_uid != getuid()) {
+	cerr << "dssi-vst-server: ERROR: " << name
+	     << " is not a FIFO belonging to this user" << endl;
+	close(fd);
+	return -1;
+    }
+
+    // Hold a writer ourselves, so that the FIFO doesn't keep polling
+    // as hung up in between clients
+    writeFd = open(name.c_str(), O_WRONLY | O_NONBLOCK);
+
+    return fd;
+}
+
+static void
+closeListenFifo(std::string name, int &fd, int &writeFd,
+		std::vector<Instance> *drainInto)
+{
+    // Unlink first, so that new clients start a fresh server instead
+    // of writing to us -- but only if the name still refers to our
+    // FIFO, as another server may have replaced it since
+    struct stat ours, named;
+    if (!fstat(fd, &ours) && !stat(name.c_str(), &named) &&
+	ours.st_dev == named.st_dev && ours.st_ino == named.st_ino) {
+	unlink(name.c_str());
+    }
+
+    // Anything written before the unlink is still ours to serve
+    if (drainInto) acceptRequests(fd, *drainInto);
+
+    if (writeFd >= 0) close(writeFd);
+    close(fd);
+    fd = writeFd = -1;
+}
+
+// How long a pooled server waits to be given an instance before
+// giving up and exiting
+#define POOL_SERVER_IDLE_TIMEOUT 600 // sec
+
+// Wait as a member of the server pool for a single request, which the
+// caller then serves as an ordinary single-instance server would.
+// Returns false if none came.
+static bool
+waitForPoolRequest(std::string name, std::string &libname,
+		   std::string &fileInfo, bool &tryGui)
+{
+    int writeFd = -1;
+    int fd = openListenFifo(name, writeFd);
+    if (fd < 0) return false;
+
+    cout << "Pooled server waiting on " << name << endl;
+
+    char record[RemotePluginServerRequestSize];
+    time_t deadline = time(0) + POOL_SERVER_IDLE_TIMEOUT;
+    bool found = false;
+
+    while (!found) {
+
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	time_t now = time(0);
+	int rv = poll(&pfd, 1, now < deadline ? (deadline - now) * 1000 : 0);
+	if (rv < 0 && errno != EINTR) {
+	    perror("dssi-vst-server: poll failed");
+	    break;
+	}
+
+	// Every pooled server wakes for a request but only one gets to
+	// read it; the rest go back to waiting.  Try even on timeout,
+	// in case a request arrived at the last moment.
+	if (read(fd, record, sizeof(record)) == (ssize_t)sizeof(record)) {
+	    record[sizeof(record) - 1] = '\0';
+	    if (parseRequest(record, libname, fileInfo, tryGui)) {
+		found = true;
+	    } else {
+		cerr << "dssi-vst-server: ignoring malformed request \""
+		     << record << "\"" << endl;
+	    }
+	} else if (rv == 0) {
+	    break;
+	}
+    }
+
+    // Leave the FIFO to the rest of the pool
+    if (writeFd >= 0) close(writeFd);
+    close(fd);
+
+    if (!found) {
+	cerr << "dssi-vst-server: Pooled server idle, exiting" << endl;
+    }
+    return found;
+}
+
+int WINAPI
+WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, LPSTR cmdline, int cmdshow)
+{
+    std::string libname;
+    std::string fileInfo;
+    std::string listenFifo;
+    std::string poolFifo;
+    bool tryGui = false;
+
+    cout << "DSSI VST plugin server v" << RemotePluginVersion << endl;
+    cout << "Copyright (c) 2012-2013 Filipe Coelho" << endl;
+    cout << "Copyright (c) 2010-2011 Kristian Amlie" << endl;
+    cout << "Copyright (c) 2004-2010 Chris Cannam" << endl;
+
+    std::string args = (cmdline ? cmdline : "");
+    size_t offset = 0;
+    if (!args.empty() && (args[0] == '"' || args[0] == '\'')) offset = 1;
+
+    if (args.compare(offset, 3, "-s ") == 0 ||
+	args.compare(offset, 3, "-p ") == 0) {
+	std::string fifo = args.substr(offset + 3);
+	if (!fifo.empty() &&
+	    (fifo[fifo.length()-1] == '"' ||
+	     fifo[fifo.length()-1] == '\'')) {
+	    fifo.erase(fifo.length()-1);
+	}
+	if (args[offset + 1] == 's') listenFifo = fifo;
+	else poolFifo = fifo;
+    }
+
+    bool shared = !listenFifo.empty();
+    bool pooled = !poolFifo.empty();
+
+    if (!shared && !pooled && !parseRequest(args, libname, fileInfo, tryGui)) {
+	cerr << "Usage: dssi-vst-server [-g ]<vstname.dll>[{|+}<vstname.dll>...],<tmpfilebase>" << endl;
+	cerr << "   or: dssi-vst-server -s <listenfifo>" << endl;
+	cerr << "   or: dssi-vst-server -p <poolfifo>" << endl;
+	cerr << "(Command line was: " << args << ")" << endl;
+	exit(2);
+    }
+
+    parseCpuList(getenv("DSSI_VST_CPUS"));
+
     cout << "Initialising Windows subsystem... ";
     if (debugLevel > 0) cout << endl;
 
+    appInstance = hInst;
+
     WNDCLASSEX wclass;
     wclass.cbSize = sizeof(WNDCLASSEX);
     wclass.style = 0;
@@ -1459,70 +2777,9 @@ WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, LPSTR cmdline, int cmdshow)
     } else if (debugLevel > 0) {
 	cerr << "dssi-vst-server[1]: registered Windows application class \"" << APPLICATION_CLASS_NAME << "\"" << endl;
     }
-    
-    hWnd = CreateWindow
-	(APPLICATION_CLASS_NAME, remoteVSTServerInstance->getName().c_str(),
-	 WS_OVERLAPPEDWINDOW & ~WS_THICKFRAME & ~WS_MAXIMIZEBOX,
-	 CW_USEDEFAULT, CW_USEDEFAULT, CW_USEDEFAULT, CW_USEDEFAULT,
-	 0, 0, hInst, 0);
-    if (!hWnd) {
-	cerr << "dssi-vst-server: ERROR: Failed to create window!\n" << endl;
-	return 1;
-    } else if (debugLevel > 0) {
-	cerr << "dssi-vst-server[1]: created main window" << endl;
-    }
-    
-    if (!haveGui) {
-	cerr << "Should be showing message here" << endl;
-    } else {
-	
-	if (tryGui) {
-	
-	    plugin->dispatcher(plugin, effEditOpen, 0, 0, hWnd, 0);
-	    Rect *rect = 0;
-	    plugin->dispatcher(plugin, effEditGetRect, 0, 0, &rect, 0);
-	    if (!rect) {
-		cerr << "dssi-vst-server: ERROR: Plugin failed to report window size\n" << endl;
-		return 1;
-	    }
-	
-	    // Seems we need to provide space in here for the titlebar
-	    // and frame, even though we don't know how big they'll
-	    // be!  How crap.
-	    SetWindowPos(hWnd, 0, 0, 0,
-			 rect->right - rect->left + 6,
-			 rect->bottom - rect->top + 25,
-			 SWP_NOACTIVATE | SWP_NOMOVE |
-			 SWP_NOOWNERZORDER | SWP_NOZORDER);
-	    
-	    if (debugLevel > 0) {
-		cerr << "dssi-vst-server[1]: sized window" << endl;
-	    }
-
-	    ShowWindow(hWnd, SW_SHOWNORMAL);
-	    UpdateWindow(hWnd);
-
-	    if (debugLevel > 0) {
-		cerr << "dssi-vst-server[1]: showed window" << endl;
-	    }
-
-	    guiVisible = true;
-	}
-    }
 
     cout << "done" << endl;
 
-    DWORD threadId = 0;
-    audioThreadHandle = CreateThread(0, 0, AudioThreadMain, 0, 0, &threadId);
-    if (!audioThreadHandle) {
-	cerr << "Failed to create audio thread!" << endl;
-	delete remoteVSTServerInstance;
-	FreeLibrary(libHandle);
-	return 1;
-    } else if (debugLevel > 0) {
-	cerr << "dssi-vst-server[1]: created audio thread" << endl;
-    }
-
     /* create a dummy window for timer events - this bit based on fst
      * by Torben Hohn, patch worked out by Robert Jonsson - thanks! */
     if ((hInst = GetModuleHandleA (NULL)) == NULL) {
@@ -1554,75 +2811,130 @@ WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, LPSTR cmdline, int cmdshow)
 	cerr << "cannot set timer on window" << endl;
     }
 
-    ready = true;
+    std::vector<Instance> instances;
+    int listenFd = -1;
+    int listenWriteFd = -1;
+
+    if (pooled) {
+	// Everything up to here is done in advance of the request, which
+	// is why it's worth keeping a pool of us waiting
+	if (!waitForPoolRequest(poolFifo, libname, fileInfo, tryGui)) {
+	    return 0;
+	}
+    }
+
+    if (shared) {
+	if ((listenFd = openListenFifo(listenFifo, listenWriteFd)) < 0) {
+	    return 1;
+	}
+	cout << "Shared server listening on " << listenFifo << endl;
+    } else {
+	Instance instance;
+	instance.server = startInstance(libname, fileInfo, tryGui, pooled);
+	instance.libname = libname;
+	if (!instance.server) return 1;
+	instances.push_back(instance);
+    }
 
+    time_t idleSince = time(0);
+    std::vector<struct pollfd> pfds;
     MSG msg;
-    exiting = false;
-    while (!exiting) {
 
-	while (!exiting && PeekMessage(&msg, 0, 0, 0, PM_REMOVE)) {
-	    DispatchMessage(&msg);
+    while (true) {
 
-	    /* this bit based on fst by Torben Hohn, patch worked out
-	     * by Robert Jonsson - thanks! */
+	while (PeekMessage(&msg, 0, 0, 0, PM_REMOVE)) {
+	    DispatchMessage(&msg);
 	    if (msg.message == WM_TIMER) {
-		plugin->dispatcher (plugin, effEditIdle, 0, 0, NULL, 0);
-		if (needIdle) {
-		    if (plugin) {
-			plugin->dispatcher(plugin, 53, 0, 0, NULL, 0);
-		    }
+		for (size_t i = 0; i < instances.size(); ++i) {
+		    instances[i].server->idle();
 		}
 	    }
 	}
 
-	if (tryGui && haveGui && !guiVisible) {
-	    // Running in GUI-always-on mode and GUI has exited: follow it
-	    cerr << "dssi-vst-server: Running in GUI mode and GUI has exited: going with it" << endl;
-	    exiting = true;
+	// Retire instances whose client has gone, or whose editor has
+	// been closed when running in GUI-always-on mode
+	for (size_t i = 0; i < instances.size(); ) {
+	    RemoteVSTServer *server = instances[i].server;
+	    if (server->hasLostEditor()) {
+		cerr << "dssi-vst-server: Running in GUI mode and GUI has exited: going with it" << endl;
+	    }
+	    if (server->isExiting() || server->hasLostEditor()) {
+		stopInstance(instances[i]);
+		instances.erase(instances.begin() + i);
+		idleSince = time(0);
+	    } else {
+		++i;
+	    }
 	}
 
-	if (exiting) break;
-
-	try {
-	    if (guiVisible) {
-		remoteVSTServerInstance->dispatchControl(10);
-	    } else {
-		remoteVSTServerInstance->dispatchControl(500);
+	if (instances.empty()) {
+	    if (listenFd < 0) break;
+	    if (time(0) - idleSince >= SHARED_SERVER_IDLE_TIMEOUT) {
+		cerr << "dssi-vst-server: Shared server idle, exiting" << endl;
+		closeListenFifo(listenFifo, listenFd, listenWriteFd, &instances);
+		continue;
 	    }
-	} catch (RemotePluginClosedException) {
-	    cerr << "ERROR: Remote VST plugin communication failure in GUI thread" << endl;
-	    exiting = true;
+	}
+
+	bool editorVisible = false;
+	pfds.clear();
+	for (size_t i = 0; i < instances.size(); ++i) {
+	    struct pollfd pfd;
+	    pfd.fd = instances[i].server->getControlFd();
+	    pfd.events = POLLIN | POLLPRI;
+	    pfd.revents = 0;
+	    pfds.push_back(pfd);
+	    if (instances[i].server->isEditorVisible()) editorVisible = true;
+	}
+	if (listenFd >= 0) {
+	    struct pollfd pfd;
+	    pfd.fd = listenFd;
+	    pfd.events = POLLIN;
+	    pfd.revents = 0;
+	    pfds.push_back(pfd);
+	}
+
+	if (poll(&pfds[0], pfds.size(), editorVisible ? 10 : 500) < 0 &&
+	    errno != EINTR) {
+	    perror("dssi-vst-server: poll failed");
 	    break;
 	}
 
-	remoteVSTServerInstance->checkGUIExited();
-	remoteVSTServerInstance->monitorEdits();
-    }
+	for (size_t i = 0; i < instances.size(); ++i) {
+	    RemoteVSTServer *server = instances[i].server;
+	    if (pfds[i].revents) {
+		try {
+		    server->dispatchControl(0);
+		} catch (RemotePluginClosedException) {
+		    cerr << "ERROR: Remote VST plugin communication failure in GUI thread" << endl;
+		    server->terminate();
+		}
+	    }
+	    server->checkGUIExited();
+	    server->monitorEdits();
+	}
 
-    // wait for audio thread to catch up
-    sleep(1);
+	if (listenFd >= 0 && pfds.back().revents) {
+	    acceptRequests(listenFd, instances);
+	}
+    }
 
     if (debugLevel > 0) {
 	cerr << "dssi-vst-server[1]: cleaning up" << endl;
     }
 
-    if (jack_client)
-    {
-        jack_deactivate(jack_client);
-        jack_client_close(jack_client);
+    for (size_t i = 0; i < instances.size(); ++i) {
+	stopInstance(instances[i]);
     }
 
-    CloseHandle(audioThreadHandle);
-    if (debugLevel > 0) {
-	cerr << "dssi-vst-server[1]: closed audio thread" << endl;
+    if (listenFd >= 0) {
+	closeListenFifo(listenFifo, listenFd, listenWriteFd, 0);
     }
 
-    delete remoteVSTServerInstance;
-    remoteVSTServerInstance = 0;
-
-    FreeLibrary(libHandle);
-    if (debugLevel > 0) {
-	cerr << "dssi-vst-server[1]: freed dll" << endl;
+    if (jack_client)
+    {
+        jack_deactivate(jack_client);
+        jack_client_close(jack_client);
     }
 
     if (debugLevel > 0) {
@@ -1631,4 +2943,3 @@ WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, LPSTR cmdline, int cmdshow)
 
     return 0;
 }
-
@@ -9,6 +9,7 @@
 */
 
 #include "remotevstclient.h"
+#include "pluginindex.h"
 #include "rdwrops.h"
 
 #include "dssi/ladspa.h"
@@ -35,6 +36,12 @@ public:
 
     bool isOK() { return m_ok; }
 
+    // Controls, audio ins and outs, and latency, as the live plugin
+    // has them
+    unsigned long getPortCount() {
+	return m_controlPortCount + m_audioInCount + m_audioOutCount + 1;
+    }
+
     // LADSPA methods:
 
     void activate();
@@ -92,6 +99,9 @@ public:
     DSSIVSTPlugin();
     virtual ~DSSIVSTPlugin();
 
+    unsigned long getDescriptorCount() const { return m_descriptors.size(); }
+    bool isSynth(unsigned long index) const;
+
     DSSI_Descriptor *queryDescriptor(unsigned long index);
 
     // LADSPA methods:
@@ -130,9 +140,12 @@ public:
     static int get_custom_data(LADSPA_Handle Instance, void **Data, unsigned long *DataLength);
 
 private:
-    typedef std::pair<std::string, DSSI_Descriptor *> PluginPair;
-    typedef std::vector<PluginPair> PluginList;
-    PluginList m_descriptors;
+    DSSI_Descriptor *makeDescriptor(int p);
+
+    // Descriptors are made from the index when first asked for, so
+    // that a host listing plugins only pays for the ones it looks at
+    PluginIndex m_index;
+    std::vector<DSSI_Descriptor *> m_descriptors;
 };
 
 
@@ -179,26 +192,33 @@ DSSIVSTPluginInstance::DSSIVSTPluginInstance(std::string dllName,
 	return;
     }
 
-    m_controlPortCount = m_plugin->getParameterCount();
-    m_controlPorts = new LADSPA_Data*[m_controlPortCount];
+    RemotePluginMetadata md = m_plugin->getMetadata();
+
+    m_controlPortCount = md.parameterNames.size();
+    m_controlPorts = new LADSPA_Data*[m_controlPortCount]();
     m_controlPortsSaved = new LADSPA_Data[m_controlPortCount];
 
     for (unsigned long i = 0; i < m_controlPortCount; ++i) {
 	m_controlPortsSaved[i] = NO_CONTROL_DATA;
     }
 
-    m_audioInCount = m_plugin->getInputCount();
-    m_audioIns = new LADSPA_Data*[m_audioInCount];
+    m_audioInCount = md.inputs;
+    m_audioIns = new LADSPA_Data*[m_audioInCount]();
 
-    m_audioOutCount = m_plugin->getOutputCount();
-    m_audioOuts = new LADSPA_Data*[m_audioOutCount];
+    m_audioOutCount = md.outputs;
+    m_audioOuts = new LADSPA_Data*[m_audioOutCount]();
 
-    m_programCount = m_plugin->getProgramCount();
+    m_programCount = md.programNames.size();
     m_programs = new DSSI_Program_Descriptor[m_programCount];
     for (unsigned long i = 0; i < m_programCount; ++i) {
 	m_programs[i].Bank = 0;
 	m_programs[i].Program = i;
-	m_programs[i].Name = strdup(m_plugin->getProgramName(i).c_str());
+	m_programs[i].Name = strdup(md.programNames[i].c_str());
+    }
+
+    char *pipeline = getenv("DSSI_VST_PIPELINE");
+    if (pipeline && *pipeline && strcmp(pipeline, "0")) {
+	m_plugin->setPipelined(true);
     }
 
     snd_midi_event_new(MIDI_BUFFER_SIZE, &m_alsaDecoder);
@@ -220,6 +240,14 @@ DSSIVSTPluginInstance::~DSSIVSTPluginInstance()
 
     if (m_ok) {
 	try {
+	    int spills = m_plugin->getRingSpillCount();
+	    int overflows = m_plugin->getRingOverflowCount();
+	    if (spills || overflows) {
+		std::cerr << "DSSIVSTPluginInstance::~DSSIVSTPluginInstance: "
+			  << spills << " event transactions needed an extra "
+			  << "handshake, " << overflows << " were dropped; "
+			  << "consider raising DSSI_VST_RING_SIZE" << std::endl;
+	    }
 	    std::cerr << "DSSIVSTPluginInstance::~DSSIVSTPluginInstance: asking plugin to terminate" << std::endl;
 	    m_plugin->terminate();
 	} catch (RemotePluginClosedException) { }
@@ -230,7 +258,7 @@ DSSIVSTPluginInstance::~DSSIVSTPluginInstance()
     }
 
     delete m_plugin;
-    delete m_chunkdata;
+    delete[] m_chunkdata;
 
     if (m_alsaDecoder) {
 	snd_midi_event_free(m_alsaDecoder);
@@ -302,7 +330,7 @@ DSSIVSTPluginInstance::connectPort(unsigned long port, LADSPA_Data *location)
     if (port < 1) { // latency
 //	std::cerr << "(latency output port)" << std::endl;
 	m_latencyOut = location;
-	if (m_latencyOut) *m_latencyOut = 0;
+	if (m_latencyOut) *m_latencyOut = m_plugin->getLatency();
 	return;
     }
 }
@@ -345,8 +373,6 @@ DSSIVSTPluginInstance::run(unsigned long sampleCount)
 	    m_lastSampleCount = sampleCount;
 	}
 	
-	int modifiedCount = 0;
-	
 	for (unsigned long i = 0; i < m_controlPortCount; ++i) {
 	    
 	    if (!m_controlPorts[i]) continue;
@@ -356,11 +382,12 @@ DSSIVSTPluginInstance::run(unsigned long sampleCount)
 //			      << " for control port " << i << std::endl;
 		m_plugin->setParameter(i, *m_controlPorts[i]);
 		m_controlPortsSaved[i] =  *m_controlPorts[i];
-		if (++modifiedCount > 10) break;
 	    }
 	}
 	
 	m_plugin->process(m_audioIns, m_audioOuts);
+
+	if (m_latencyOut) *m_latencyOut = m_plugin->getLatency();
 	
     } catch (RemotePluginClosedException) {
 	m_ok = false;
@@ -472,141 +499,152 @@ DSSIVSTPluginInstance::freeFields(DSSI_Descriptor &descriptor)
 
 DSSIVSTPlugin::DSSIVSTPlugin()
 {
-    std::vector<RemoteVSTClient::PluginRecord> plugins;
-
     try {
-	RemoteVSTClient::queryPlugins(plugins);
+	RemoteVSTClient::queryPlugins(m_index);
     } catch (std::string error) {
 	std::cerr << "DSSIVSTPlugin: Error on plugin query: " << error << std::endl;
 	return;
     }
-    
-    for (unsigned int p = 0; p < plugins.size(); ++p) {
-
-	DSSI_Descriptor *descriptor = new DSSI_Descriptor;
-	LADSPA_Descriptor *ldesc = new LADSPA_Descriptor;
-	descriptor->LADSPA_Plugin = ldesc;
 
-	RemoteVSTClient::PluginRecord &rec = plugins[p];
-
-	// LADSPA labels mustn't contain spaces.  We replace them with
-	// asterisks here and restore them when used to indicate DLL name
-	// again.
-	char *label = strdup(rec.dllName.c_str());
-	for (int i = 0; label[i]; ++i) {
-	    if (label[i] == ' ') label[i] = '*';
-	}
+    m_descriptors.resize(m_index.getPluginCount(), 0);
+}
 
-	ldesc->UniqueID = 6666 + p;
-	ldesc->Label = label;
-	ldesc->Properties = LADSPA_PROPERTY_REALTIME|LADSPA_PROPERTY_HARD_RT_CAPABLE;
-	ldesc->Name = strdup(std::string(rec.pluginName + " VST").c_str());
-	ldesc->Maker = strdup(rec.vendorName.c_str());
-	ldesc->Copyright = strdup(ldesc->Maker);
-
-//	std::cerr << "Plugin name: " << ldesc->Name << std::endl;
-
-	int parameters = rec.parameters;
-	int inputs = rec.inputs;
-	int outputs = rec.outputs;
-	int portCount = parameters + inputs + outputs + 1; // 1 for latency output
-
-	LADSPA_PortDescriptor *ports = new LADSPA_PortDescriptor[portCount];
-        char **names = new char *[portCount];
-	LADSPA_PortRangeHint *hints = new LADSPA_PortRangeHint[portCount];
-
-	for (int i = 0; i < parameters; ++i) {
-	    ports[i] = LADSPA_PORT_INPUT | LADSPA_PORT_CONTROL;
-	    names[i] = strdup(rec.parameterNames[i].c_str());
-	    hints[i].LowerBound = 0.0f;
-	    hints[i].UpperBound = 1.0f;
-	    hints[i].HintDescriptor =
-		LADSPA_HINT_BOUNDED_BELOW | LADSPA_HINT_BOUNDED_ABOVE;
-	    float deflt = rec.parameterDefaults[i];
-	    if (deflt < 0.0001) {
-		hints[i].HintDescriptor |= LADSPA_HINT_DEFAULT_MINIMUM;
-	    } else if (deflt > 0.999) {
-		hints[i].HintDescriptor |= LADSPA_HINT_DEFAULT_MAXIMUM;
-	    } else if (deflt < 0.35) {
-		hints[i].HintDescriptor |= LADSPA_HINT_DEFAULT_LOW;
-	    } else if (deflt > 0.65) {
-		hints[i].HintDescriptor |= LADSPA_HINT_DEFAULT_HIGH;
-	    } else {
-		hints[i].HintDescriptor |= LADSPA_HINT_DEFAULT_MIDDLE;
-	    }
+DSSI_Descriptor *
+DSSIVSTPlugin::makeDescriptor(int p)
+{
+    DSSI_Descriptor *descriptor = new DSSI_Descriptor;
+    LADSPA_Descriptor *ldesc = new LADSPA_Descriptor;
+    descriptor->LADSPA_Plugin = ldesc;
+
+    const PluginIndex &index = m_index;
+
+    const PluginIndexPlugin &rec = index.getPlugin(p);
+    std::string dllName = index.getString(rec.dllName);
+
+    // LADSPA labels mustn't contain spaces.  We replace them with
+    // asterisks here and restore them when used to indicate DLL name
+    // again.
+    char *label = strdup(dllName.c_str());
+    for (int i = 0; label[i]; ++i) {
+	if (label[i] == ' ') label[i] = '*';
+    }
+
+    ldesc->UniqueID = 6666 + p;
+    ldesc->Label = label;
+    ldesc->Properties = LADSPA_PROPERTY_REALTIME|LADSPA_PROPERTY_HARD_RT_CAPABLE;
+    ldesc->Name = strdup((std::string(index.getString(rec.pluginName)) + " VST").c_str());
+    ldesc->Maker = strdup(index.getString(rec.vendorName));
+    ldesc->Copyright = strdup(ldesc->Maker);
+
+//    std::cerr << "Plugin name: " << ldesc->Name << std::endl;
+
+    int parameters = rec.parameters;
+    int inputs = rec.inputs;
+    int outputs = rec.outputs;
+    int portCount = parameters + inputs + outputs + 1; // 1 for latency output
+
+    LADSPA_PortDescriptor *ports = new LADSPA_PortDescriptor[portCount];
+    char **names = new char *[portCount];
+    LADSPA_PortRangeHint *hints = new LADSPA_PortRangeHint[portCount];
+
+    for (int i = 0; i < parameters; ++i) {
+	ports[i] = LADSPA_PORT_INPUT | LADSPA_PORT_CONTROL;
+	names[i] = strdup(index.getParameterName(p, i));
+	hints[i].LowerBound = 0.0f;
+	hints[i].UpperBound = 1.0f;
+	hints[i].HintDescriptor =
+	    LADSPA_HINT_BOUNDED_BELOW | LADSPA_HINT_BOUNDED_ABOVE;
+	float deflt = index.getParameterDefault(p, i);
+	if (deflt < 0.0001) {
+	    hints[i].HintDescriptor |= LADSPA_HINT_DEFAULT_MINIMUM;
+	} else if (deflt > 0.999) {
+	    hints[i].HintDescriptor |= LADSPA_HINT_DEFAULT_MAXIMUM;
+	} else if (deflt < 0.35) {
+	    hints[i].HintDescriptor |= LADSPA_HINT_DEFAULT_LOW;
+	} else if (deflt > 0.65) {
+	    hints[i].HintDescriptor |= LADSPA_HINT_DEFAULT_HIGH;
+	} else {
+	    hints[i].HintDescriptor |= LADSPA_HINT_DEFAULT_MIDDLE;
 	}
+    }
 
-	for (int i = 0; i < inputs; ++i) {
-	    int j = i + parameters;
-	    ports[j] = LADSPA_PORT_INPUT | LADSPA_PORT_AUDIO;
-	    char buf[20];
-	    snprintf(buf, 19, "in%d", i + 1);
-	    names[j] = strdup(buf);
-	    hints[j].HintDescriptor = 0;
-	}
+    for (int i = 0; i < inputs; ++i) {
+	int j = i + parameters;
+	ports[j] = LADSPA_PORT_INPUT | LADSPA_PORT_AUDIO;
+	char buf[20];
+	snprintf(buf, 19, "in%d", i + 1);
+	names[j] = strdup(buf);
+	hints[j].HintDescriptor = 0;
+    }
+
+    for (int i = 0; i < outputs; ++i) {
+	int j = i + inputs + parameters;
+	ports[j] = LADSPA_PORT_OUTPUT | LADSPA_PORT_AUDIO;
+	char buf[20];
+	snprintf(buf, 19, "out%d", i + 1);
+	names[j] = strdup(buf);
+	hints[j].HintDescriptor = 0;
+    }
+
+    ports[portCount-1] = LADSPA_PORT_OUTPUT | LADSPA_PORT_CONTROL;
+    names[portCount-1] = strdup("_latency");
+    hints[portCount-1].HintDescriptor = 0;
+
+    ldesc->PortCount = portCount;
+    ldesc->PortDescriptors = ports;
+    ldesc->PortNames = names;
+    ldesc->PortRangeHints = hints;
+    ldesc->ImplementationData = 0;
+
+    ldesc->instantiate = DSSIVSTPlugin::instantiate;
+    ldesc->connect_port = DSSIVSTPlugin::connect_port;
+    ldesc->activate = DSSIVSTPlugin::activate;
+    ldesc->run = DSSIVSTPlugin::run;
+    ldesc->run_adding = 0;
+    ldesc->set_run_adding_gain = 0;
+    ldesc->deactivate = DSSIVSTPlugin::deactivate;
+    ldesc->cleanup = DSSIVSTPlugin::cleanup;
+
+    descriptor->DSSI_API_Version = 1;
+    descriptor->configure = DSSIVSTPlugin::configure;
+    descriptor->get_program = DSSIVSTPlugin::get_program;
+    descriptor->select_program = DSSIVSTPlugin::select_program;
+    descriptor->get_midi_controller_for_port = 0;
 
-	for (int i = 0; i < outputs; ++i) {
-	    int j = i + inputs + parameters;
-	    ports[j] = LADSPA_PORT_OUTPUT | LADSPA_PORT_AUDIO;
-	    char buf[20];
-	    snprintf(buf, 19, "out%d", i + 1);
-	    names[j] = strdup(buf);
-	    hints[j].HintDescriptor = 0;
-	}
+    //Andrew Deryabin: VST chunks support
+    descriptor->set_custom_data = DSSIVSTPlugin::set_custom_data;
+    descriptor->get_custom_data = DSSIVSTPlugin::get_custom_data;
+    //Andrew Deryabin: VST chunks support: end code
 
-	ports[portCount-1] = LADSPA_PORT_OUTPUT | LADSPA_PORT_CONTROL;
-	names[portCount-1] = strdup("_latency");
-	hints[portCount-1].HintDescriptor = 0;
-
-	ldesc->PortCount = portCount;
-	ldesc->PortDescriptors = ports;
-	ldesc->PortNames = names;
-	ldesc->PortRangeHints = hints;
-	ldesc->ImplementationData = 0;
-
-	ldesc->instantiate = DSSIVSTPlugin::instantiate;
-	ldesc->connect_port = DSSIVSTPlugin::connect_port;
-	ldesc->activate = DSSIVSTPlugin::activate;
-	ldesc->run = DSSIVSTPlugin::run;
-	ldesc->run_adding = 0;
-	ldesc->set_run_adding_gain = 0;
-	ldesc->deactivate = DSSIVSTPlugin::deactivate;
-	ldesc->cleanup = DSSIVSTPlugin::cleanup;
-	
-	descriptor->DSSI_API_Version = 1;
-	descriptor->configure = DSSIVSTPlugin::configure;
-	descriptor->get_program = DSSIVSTPlugin::get_program;
-	descriptor->select_program = DSSIVSTPlugin::select_program;
-	descriptor->get_midi_controller_for_port = 0;
-
-       //Andrew Deryabin: VST chunks support
-       descriptor->set_custom_data = DSSIVSTPlugin::set_custom_data;
-       descriptor->get_custom_data = DSSIVSTPlugin::get_custom_data;
-       //Andrew Deryabin: VST chunks support: end code
-
-	if (rec.isSynth) {
-	    descriptor->run_synth = DSSIVSTPlugin::run_synth;
-	} else {
-	    descriptor->run_synth = 0;
-	}
+    if (rec.isSynth) {
+	descriptor->run_synth = DSSIVSTPlugin::run_synth;
+    } else {
+	descriptor->run_synth = 0;
+    }
 
-	descriptor->run_synth_adding = 0;
-	descriptor->run_multiple_synths = 0;
-	descriptor->run_multiple_synths_adding = 0;
+    descriptor->run_synth_adding = 0;
+    descriptor->run_multiple_synths = 0;
+    descriptor->run_multiple_synths_adding = 0;
 
-	m_descriptors.push_back(PluginPair(rec.dllName, descriptor));
-    }
+    return descriptor;
 }
     
 DSSIVSTPlugin::~DSSIVSTPlugin()
 {
-    for (PluginList::iterator i = m_descriptors.begin(); i != m_descriptors.end(); ++i) {
-	DSSIVSTPluginInstance::freeFields(*i->second);
-	delete i->second->LADSPA_Plugin;
-	delete i->second;
+    for (size_t i = 0; i < m_descriptors.size(); ++i) {
+	if (!m_descriptors[i]) continue;
+	DSSIVSTPluginInstance::freeFields(*m_descriptors[i]);
+	delete m_descriptors[i]->LADSPA_Plugin;
+	delete m_descriptors[i];
     }
 }
 
+bool
+DSSIVSTPlugin::isSynth(unsigned long index) const
+{
+    return index < m_descriptors.size() && m_index.getPlugin(index).isSynth;
+}
+
 
 DSSI_Descriptor *
 DSSIVSTPlugin::queryDescriptor(unsigned long index)
@@ -615,7 +653,10 @@ DSSIVSTPlugin::queryDescriptor(unsigned long index)
 //	std::cerr << "DSSIVSTPlugin::queryDescriptor: index is " << index
 //		  << ", returning " << m_descriptors[index].second->LADSPA_Plugin->Name
 //		  << std::endl;
-	return m_descriptors[index].second;
+	if (!m_descriptors[index]) {
+	    m_descriptors[index] = makeDescriptor(index);
+	}
+	return m_descriptors[index];
     } else {
 	return 0;
     }
@@ -628,8 +669,21 @@ DSSIVSTPlugin::instantiate(const LADSPA_Descriptor *descriptor,
     std::cerr << "DSSIVSTPlugin::instantiate(" << descriptor->Label << ")" << std::endl;
 
     try {
-	return (LADSPA_Handle)
-	    (new DSSIVSTPluginInstance(descriptor->Label, sampleRate));
+	DSSIVSTPluginInstance *instance =
+	    new DSSIVSTPluginInstance(descriptor->Label, sampleRate);
+
+	// The descriptor may come from an index made before the DLL was
+	// updated, and the host would connect ports by its old layout
+	if (instance->isOK() &&
+	    instance->getPortCount() != descriptor->PortCount) {
+	    std::cerr << "DSSIVSTPlugin::instantiate(" << descriptor->Label
+		      << "): plugin now has " << instance->getPortCount()
+		      << " ports, not " << descriptor->PortCount
+		      << "; it has changed since it was scanned" << std::endl;
+	    delete instance;
+	    return 0;
+	}
+	return (LADSPA_Handle)instance;
     } catch (std::string e) {
 	perror(e.c_str());
     } catch (RemotePluginClosedException) {
@@ -713,16 +767,12 @@ static std::vector<int> _ladspaDescriptors;
 static void
 _makeLADSPADescriptorMap()
 {
-    int i = 0;
-    const DSSI_Descriptor *dssiDescriptor = 0;
-    while ((dssiDescriptor = dssi_descriptor(i))) {
-	if (!dssiDescriptor->run_synth &&
-	    !dssiDescriptor->run_synth_adding &&
-	    !dssiDescriptor->run_multiple_synths &&
-	    !dssiDescriptor->run_multiple_synths_adding) {
+    // Asked of the index rather than the descriptors, so as not to
+    // make every descriptor up front
+    for (unsigned long i = 0; i < _plugin->getDescriptorCount(); ++i) {
+	if (!_plugin->isSynth(i)) {
 	    _ladspaDescriptors.push_back(i);
 	}
-	++i;
     }
 }
 
@@ -760,9 +810,7 @@ int DSSIVSTPlugin::set_custom_data(LADSPA_Handle Instance, void *Data, unsigned
     DSSIVSTPluginInstance *instance = ((DSSIVSTPluginInstance *)Instance);
     if(DataLength == 0 || Data == 0)
         return 0;
-    std::vector<char> chunk;
-    for(unsigned long i = 0; i < DataLength; i++)
-        chunk.push_back(((char *)Data) [i]);
+    std::vector<char> chunk((char *)Data, (char *)Data + DataLength);
     instance->m_plugin->setVSTChunk(chunk);
     return 1;
 }
@@ -772,6 +820,7 @@ int DSSIVSTPlugin::get_custom_data(LADSPA_Handle Instance, void **Data, unsigned
     DSSIVSTPluginInstance *instance = ((DSSIVSTPluginInstance *)Instance);
     std::vector<char> chunk = instance->m_plugin->getVSTChunk();
     unsigned long chunksize = chunk.size();
+    delete[] instance->m_chunkdata;
     instance->m_chunkdata = new char [chunksize];
     if(instance->m_chunkdata)
     {
@@ -0,0 +1,719 @@
+// -*- c-basic-offset: 4 -*-
+
+/*
+  dssi-vst: a DSSI plugin wrapper for VST effects and instruments
+  Copyright 2012-2013 Filipe Coelho
+  Copyright 2010-2011 Kristian Amlie
+  Copyright 2004-2010 Chris Cannam
+*/
+
+#include "offlinerender.h"
+#include "remotepluginclient.h"
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+// Frames of silence rendered after the last MIDI event when there is
+// no input file to set the length, so that notes can ring out
+static const double midiTailSeconds = 2.0;
+
+static const int WAVE_FORMAT_PCM = 1;
+static const int WAVE_FORMAT_IEEE_FLOAT = 3;
+static const int WAVE_FORMAT_EXTENSIBLE = 0xfffe;
+
+static uint32_t
+le32(const unsigned char *b)
+{
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static uint16_t
+le16(const unsigned char *b)
+{
+    return b[0] | (b[1] << 8);
+}
+
+static void
+putLe32(unsigned char *b, uint32_t v)
+{
+    b[0] = v; b[1] = v >> 8; b[2] = v >> 16; b[3] = v >> 24;
+}
+
+static void
+putLe16(unsigned char *b, uint16_t v)
+{
+    b[0] = v; b[1] = v >> 8;
+}
+
+// Reads PCM (8, 16, 24 or 32 bit) or float (32 or 64 bit) WAV
+// files, a block at a time
+class WavReader
+{
+public:
+    WavReader() : m_file(0), m_channels(0), m_rate(0), m_bits(0),
+		  m_float(false), m_frames(0), m_framesLeft(0) { }
+    ~WavReader() { if (m_file) fclose(m_file); }
+
+    bool open(std::string fileName);
+
+    int getChannels() const { return m_channels; }
+    int getSampleRate() const { return m_rate; }
+    size_t getFrames() const { return m_frames; }
+
+    // Read up to frames frames, de-interleaved into the given
+    // buffers, one per channel; returns the number read
+    size_t read(float **buffers, size_t frames);
+
+private:
+    FILE *m_file;
+    int m_channels;
+    int m_rate;
+    int m_bits;
+    bool m_float;
+    size_t m_frames;
+    size_t m_framesLeft;
+    std::vector<unsigned char> m_buffer;
+};
+
+bool
+WavReader::open(std::string fileName)
+{
+    m_file = fopen(fileName.c_str(), "rb");
+    if (!m_file) {
+	perror(fileName.c_str());
+	return false;
+    }
+
+    unsigned char header[12];
+    if (fread(header, 1, 12, m_file) != 12 ||
+	memcmp(header, "RIFF", 4) || memcmp(header + 8, "WAVE", 4)) {
+	std::cerr << "vsthost: " << fileName << " is not a WAV file" << std::endl;
+	return false;
+    }
+
+    bool haveFormat = false;
+    int format = 0;
+
+    while (1) {
+
+	unsigned char chunk[8];
+	if (fread(chunk, 1, 8, m_file) != 8) {
+	    std::cerr << "vsthost: no audio data found in " << fileName << std::endl;
+	    return false;
+	}
+	uint32_t size = le32(chunk + 4);
+
+	if (!memcmp(chunk, "fmt ", 4)) {
+
+	    unsigned char fmt[40];
+	    memset(fmt, 0, sizeof(fmt));
+	    size_t n = std::min<size_t>(size, sizeof(fmt));
+	    if (size < 16 || fread(fmt, 1, n, m_file) != n) break;
+	    format = le16(fmt);
+	    m_channels = le16(fmt + 2);
+	    m_rate = le32(fmt + 4);
+	    m_bits = le16(fmt + 14);
+	    if (format == WAVE_FORMAT_EXTENSIBLE && size >= 26) {
+		format = le16(fmt + 24); // first two bytes of sub-format GUID
+	    }
+	    haveFormat = true;
+	    if (fseek(m_file, (size - n) + (size & 1), SEEK_CUR)) break;
+
+	} else if (!memcmp(chunk, "data", 4)) {
+
+	    if (!haveFormat) break;
+	    if (m_channels < 1 ||
+		!((format == WAVE_FORMAT_PCM &&
+		   (m_bits == 8 || m_bits == 16 || m_bits == 24 || m_bits == 32)) ||
+		  (format == WAVE_FORMAT_IEEE_FLOAT &&
+		   (m_bits == 32 || m_bits == 64)))) {
+		std::cerr << "vsthost: unsupported WAV format " << format
+			  << " (" << m_bits << " bit) in " << fileName << std::endl;
+		return false;
+	    }
+	    m_float = (format == WAVE_FORMAT_IEEE_FLOAT);
+	    m_frames = m_framesLeft = size / (m_channels * (m_bits / 8));
+	    return true;
+
+	} else {
+	    if (fseek(m_file, size + (size & 1), SEEK_CUR)) break;
+	}
+    }
+
+    std::cerr << "vsthost: failed to read WAV header in " << fileName << std::endl;
+    return false;
+}
+
+size_t
+WavReader::read(float **buffers, size_t frames)
+{
+    if (frames > m_framesLeft) frames = m_framesLeft;
+    if (frames == 0) return 0;
+
+    int bytes = m_bits / 8;
+    m_buffer.resize(frames * m_channels * bytes);
+    frames = fread(&m_buffer[0], m_channels * bytes, frames, m_file);
+    m_framesLeft -= frames;
+
+    const unsigned char *p = &m_buffer[0];
+
+    for (size_t i = 0; i < frames; ++i) {
+	for (int c = 0; c < m_channels; ++c) {
+	    float v;
+	    if (m_float && m_bits == 32) {
+		uint32_t u = le32(p);
+		memcpy(&v, &u, 4);
+	    } else if (m_float) {
+		uint64_t u = le32(p) | ((uint64_t)le32(p + 4) << 32);
+		double d;
+		memcpy(&d, &u, 8);
+		v = (float)d;
+	    } else if (m_bits == 8) {
+		v = (p[0] - 128) / 128.f;
+	    } else if (m_bits == 16) {
+		v = (int16_t)le16(p) / 32768.f;
+	    } else if (m_bits == 24) {
+		v = ((int32_t)((p[0] << 8) | (p[1] << 16) | ((uint32_t)p[2] << 24)) >> 8)
+		    / 8388608.f;
+	    } else {
+		v = (int32_t)le32(p) / 2147483648.f;
+	    }
+	    buffers[c][i] = v;
+	    p += bytes;
+	}
+    }
+
+    return frames;
+}
+
+// Writes 32-bit float WAV files, filling in the sizes on close
+class WavWriter
+{
+public:
+    WavWriter() : m_file(0), m_channels(0), m_frames(0) { }
+    ~WavWriter() { if (m_file) fclose(m_file); }
+
+    bool open(std::string fileName, int channels, int rate);
+    bool write(float **buffers, size_t offset, size_t frames);
+    bool close();
+
+private:
+    FILE *m_file;
+    int m_channels;
+    size_t m_frames;
+    std::vector<unsigned char> m_buffer;
+};
+
+static const int wavHeaderSize = 58; // RIFF, fmt (18), fact, data
+
+bool
+WavWriter::open(std::string fileName, int channels, int rate)
+{
+    m_file = fopen(fileName.c_str(), "wb");
+    if (!m_file) {
+	perror(fileName.c_str());
+	return false;
+    }
+    m_channels = channels;
+
+    unsigned char h[wavHeaderSize];
+    memset(h, 0, sizeof(h));
+    memcpy(h, "RIFF", 4);
+    memcpy(h + 8, "WAVE", 4);
+    memcpy(h + 12, "fmt ", 4);
+    putLe32(h + 16, 18);
+    putLe16(h + 20, WAVE_FORMAT_IEEE_FLOAT);
+    putLe16(h + 22, channels);
+    putLe32(h + 24, rate);
+    putLe32(h + 28, rate * channels * 4);
+    putLe16(h + 32, channels * 4);
+    putLe16(h + 34, 32);
+    memcpy(h + 38, "fact", 4);
+    putLe32(h + 42, 4);
+    memcpy(h + 50, "data", 4);
+
+    if (fwrite(h, 1, sizeof(h), m_file) != sizeof(h)) {
+	perror(fileName.c_str());
+	return false;
+    }
+    return true;
+}
+
+bool
+WavWriter::write(float **buffers, size_t offset, size_t frames)
+{
+    m_buffer.resize(frames * m_channels * 4);
+    unsigned char *p = &m_buffer[0];
+
+    for (size_t i = 0; i < frames; ++i) {
+	for (int c = 0; c < m_channels; ++c) {
+	    uint32_t u;
+	    memcpy(&u, &buffers[c][offset + i], 4);
+	    putLe32(p, u);
+	    p += 4;
+	}
+    }
+
+    m_frames += frames;
+    return fwrite(&m_buffer[0], m_channels * 4, frames, m_file) == frames;
+}
+
+bool
+WavWriter::close()
+{
+    uint32_t dataSize = m_frames * m_channels * 4;
+    unsigned char b[4];
+    bool ok = true;
+
+    putLe32(b, wavHeaderSize - 8 + dataSize);
+    ok = ok && !fseek(m_file, 4, SEEK_SET) && fwrite(b, 1, 4, m_file) == 4;
+    putLe32(b, m_frames);
+    ok = ok && !fseek(m_file, 46, SEEK_SET) && fwrite(b, 1, 4, m_file) == 4;
+    putLe32(b, dataSize);
+    ok = ok && !fseek(m_file, 54, SEEK_SET) && fwrite(b, 1, 4, m_file) == 4;
+
+    ok = (fclose(m_file) == 0) && ok;
+    m_file = 0;
+    return ok;
+}
+
+struct RenderEvent {
+    size_t frame;
+    unsigned char data[3];
+};
+
+static bool
+readVarLen(const std::vector<unsigned char> &d, size_t &i, size_t end, uint32_t &v)
+{
+    v = 0;
+    for (int n = 0; n < 4; ++n) {
+	if (i >= end) return false;
+	unsigned char c = d[i++];
+	v = (v << 7) | (c & 0x7f);
+	if (!(c & 0x80)) return true;
+    }
+    return false;
+}
+
+struct TickEvent {
+    uint32_t tick;
+    int track;
+    uint32_t tempo; // for tempo changes, else 0
+    unsigned char data[3];
+};
+
+static bool
+operator<(const TickEvent &a, const TickEvent &b)
+{
+    return a.tick < b.tick;
+}
+
+// Read the channel events of a type 0 or 1 standard MIDI file, with
+// their times converted to frames through the file's tempo map
+static bool
+readMidiFile(std::string fileName, int rate, std::vector<RenderEvent> &events)
+{
+    FILE *f = fopen(fileName.c_str(), "rb");
+    if (!f) {
+	perror(fileName.c_str());
+	return false;
+    }
+
+    std::vector<unsigned char> d;
+    unsigned char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) d.insert(d.end(), buf, buf + n);
+    fclose(f);
+
+    if (d.size() < 14 || memcmp(&d[0], "MThd", 4)) {
+	std::cerr << "vsthost: " << fileName << " is not a MIDI file" << std::endl;
+	return false;
+    }
+
+    size_t pos = 8 + ((d[4] << 24) | (d[5] << 16) | (d[6] << 8) | d[7]);
+    int tracks = (d[10] << 8) | d[11];
+    int division = (d[12] << 8) | d[13];
+
+    std::vector<TickEvent> tickEvents;
+
+    for (int t = 0; t < tracks && pos + 8 <= d.size(); ++t) {
+
+	uint32_t length = (d[pos+4] << 24) | (d[pos+5] << 16) | (d[pos+6] << 8) | d[pos+7];
+	bool isTrack = !memcmp(&d[pos], "MTrk", 4);
+	size_t i = pos + 8;
+	size_t end = std::min<size_t>(i + length, d.size());
+	pos = i + length;
+	if (!isTrack) { --t; continue; }
+
+	uint32_t tick = 0;
+	unsigned char status = 0;
+
+	while (i < end) {
+
+	    uint32_t delta;
+	    if (!readVarLen(d, i, end, delta) || i >= end) break;
+	    tick += delta;
+
+	    unsigned char c = d[i];
+
+	    if (c == 0xff) { // meta
+		if (i + 2 > end) break;
+		unsigned char type = d[i+1];
+		i += 2;
+		uint32_t len;
+		if (!readVarLen(d, i, end, len) || i + len > end) break;
+		if (type == 0x51 && len == 3) {
+		    TickEvent e;
+		    e.tick = tick;
+		    e.track = t;
+		    e.tempo = (d[i] << 16) | (d[i+1] << 8) | d[i+2];
+		    tickEvents.push_back(e);
+		} else if (type == 0x2f) {
+		    break;
+		}
+		i += len;
+		continue;
+	    }
+
+	    if (c == 0xf0 || c == 0xf7) { // sysex, not passed on
+		++i;
+		uint32_t len;
+		if (!readVarLen(d, i, end, len)) break;
+		i += len;
+		continue;
+	    }
+
+	    if (c & 0x80) {
+		status = c;
+		++i;
+	    } else if (!status) {
+		break; // running status with no status
+	    }
+
+	    int dataBytes = ((status & 0xe0) == 0xc0 ? 1 : 2);
+	    if (i + dataBytes > end) break;
+
+	    TickEvent e;
+	    e.tick = tick;
+	    e.track = t;
+	    e.tempo = 0;
+	    e.data[0] = status;
+	    e.data[1] = d[i];
+	    e.data[2] = (dataBytes == 2 ? d[i+1] : 0);
+	    tickEvents.push_back(e);
+	    i += dataBytes;
+	}
+    }
+
+    // Merge the tracks, keeping the order of events within a track
+    std::stable_sort(tickEvents.begin(), tickEvents.end());
+
+    double seconds = 0.0;
+    uint32_t lastTick = 0;
+    double secondsPerTick;
+
+    if (division & 0x8000) { // SMPTE: frames per second and ticks per frame
+	int fps = -(signed char)(division >> 8);
+	if (fps == 29) secondsPerTick = 1.0 / (29.97 * (division & 0xff));
+	else secondsPerTick = 1.0 / (fps * (division & 0xff));
+    } else {
+	if (division == 0) division = 96;
+	secondsPerTick = 0.5 / division; // 120 bpm until told otherwise
+    }
+
+    for (size_t i = 0; i < tickEvents.size(); ++i) {
+
+	const TickEvent &e = tickEvents[i];
+	seconds += (e.tick - lastTick) * secondsPerTick;
+	lastTick = e.tick;
+
+	if (e.tempo) {
+	    if (!(division & 0x8000)) {
+		secondsPerTick = e.tempo / (1000000.0 * division);
+	    }
+	    continue;
+	}
+
+	RenderEvent re;
+	re.frame = (size_t)(seconds * rate + 0.5);
+	memcpy(re.data, e.data, 3);
+	events.push_back(re);
+    }
+
+    return true;
+}
+
+struct ParameterChange {
+    size_t frame;
+    int index;
+    float value;
+};
+
+static bool
+operator<(const ParameterChange &a, const ParameterChange &b)
+{
+    return a.frame < b.frame;
+}
+
+// Read an automation file of "<seconds> <parameter> <value>" lines;
+// blank lines and lines starting with # are ignored
+static bool
+readAutomationFile(std::string fileName, int rate,
+		   std::vector<ParameterChange> &changes)
+{
+    FILE *f = fopen(fileName.c_str(), "r");
+    if (!f) {
+	perror(fileName.c_str());
+	return false;
+    }
+
+    char line[256];
+    int lineNo = 0;
+    bool ok = true;
+
+    while (fgets(line, sizeof(line), f)) {
+	++lineNo;
+	char *p = line;
+	while (*p == ' ' || *p == '\t') ++p;
+	if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') continue;
+
+	double seconds;
+	int index;
+	float value;
+	if (sscanf(p, "%lf %d %f", &seconds, &index, &value) != 3 ||
+	    seconds < 0.0 || index < 0) {
+	    std::cerr << "vsthost: " << fileName << ":" << lineNo
+		      << ": expected <seconds> <parameter> <value>" << std::endl;
+	    ok = false;
+	    break;
+	}
+
+	ParameterChange c;
+	c.frame = (size_t)(seconds * rate + 0.5);
+	c.index = index;
+	c.value = value;
+	changes.push_back(c);
+    }
+
+    fclose(f);
+
+    // stable, so that changes at the same frame keep the file's order
+    std::stable_sort(changes.begin(), changes.end());
+    return ok;
+}
+
+static double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+bool
+renderOffline(RemotePluginClient *plugin,
+	      std::string inFile, std::string outFile,
+	      int blockSize, std::string midiFile,
+	      std::string automationFile, bool copyBuffers)
+{
+    WavReader reader;
+    int rate = 48000;
+    size_t length = 0;
+
+    if (inFile != "") {
+	if (!reader.open(inFile)) return false;
+	rate = reader.getSampleRate();
+	length = reader.getFrames();
+    }
+
+    std::vector<RenderEvent> events;
+    if (midiFile != "") {
+	if (!readMidiFile(midiFile, rate, events)) return false;
+	if (inFile == "" && !events.empty()) {
+	    length = events.back().frame + size_t(midiTailSeconds * rate);
+	}
+    }
+
+    std::vector<ParameterChange> changes;
+    if (automationFile != "") {
+	if (!readAutomationFile(automationFile, rate, changes)) return false;
+    }
+
+    if (length == 0) {
+	std::cerr << "vsthost: nothing to render" << std::endl;
+	return false;
+    }
+
+    int inputs = plugin->getInputCount();
+    int outputs = plugin->getOutputCount();
+    int parameters = plugin->getParameterCount();
+
+    for (size_t i = 0; i < changes.size(); ++i) {
+	if (changes[i].index >= parameters) {
+	    std::cerr << "vsthost: automation for parameter "
+		      << changes[i].index << ", but the plugin has only "
+		      << parameters << std::endl;
+	    return false;
+	}
+    }
+
+    if (outputs < 1) {
+	std::cerr << "vsthost: plugin has no audio outputs" << std::endl;
+	return false;
+    }
+
+    plugin->setSampleRate(rate);
+    plugin->setBufferSize(blockSize);
+    plugin->setOffline(true);
+
+    size_t latency = plugin->getLatency();
+
+    WavWriter writer;
+    if (!writer.open(outFile, outputs, rate)) return false;
+
+    // Render straight into and out of the shared memory buffers, so
+    // that process has nothing to copy
+    std::vector<float *> inBuffers(inputs + 1), outBuffers(outputs + 1);
+    std::vector<std::vector<float> > ownBuffers(inputs + outputs);
+    for (int i = 0; i < inputs + outputs; ++i) {
+	float *buffer = 0;
+	if (!copyBuffers) {
+	    buffer = (i < inputs ? plugin->getInputBuffer(i) :
+		      plugin->getOutputBuffer(i - inputs));
+	}
+	if (!buffer) {
+	    ownBuffers[i].resize(blockSize);
+	    buffer = &ownBuffers[i][0];
+	}
+	if (i < inputs) inBuffers[i] = buffer;
+	else outBuffers[i - inputs] = buffer;
+    }
+
+    // Input channels beyond those in the file get the file's last
+    // channel if it is mono, or silence
+    int fileChannels = (inFile != "" ? reader.getChannels() : 0);
+    std::vector<std::vector<float> > fileData(fileChannels);
+    std::vector<float *> fileBuffers(fileChannels + 1);
+    for (int c = 0; c < fileChannels; ++c) {
+	fileData[c].resize(blockSize);
+	fileBuffers[c] = &fileData[c][0];
+    }
+
+    std::vector<unsigned char> midiData;
+    std::vector<int> midiOffsets;
+    size_t nextEvent = 0;
+    size_t nextChange = 0;
+
+    // The plugin's output lags its input by its latency, so run on
+    // that far past the end and drop that much from the start
+    size_t total = length + latency;
+    size_t written = 0;
+    size_t blocks = 0;
+
+    std::cerr << "vsthost: rendering " << double(length) / rate
+	      << " seconds at " << rate << " Hz in blocks of " << blockSize
+	      << " frames" << std::endl;
+
+    double start = now();
+
+    try {
+	for (size_t pos = 0; pos < total; pos += blockSize) {
+
+	    size_t got = (fileChannels > 0 ?
+			  reader.read(&fileBuffers[0], blockSize) : 0);
+
+	    for (int i = 0; i < inputs; ++i) {
+		float *in = inBuffers[i];
+		if (i < fileChannels || fileChannels == 1) {
+		    int c = std::min(i, fileChannels - 1);
+		    memcpy(in, fileBuffers[c], got * sizeof(float));
+		    memset(in + got, 0, (blockSize - got) * sizeof(float));
+		} else {
+		    memset(in, 0, blockSize * sizeof(float));
+		}
+	    }
+
+	    midiData.clear();
+	    midiOffsets.clear();
+
+	    while (nextEvent < events.size() &&
+		   events[nextEvent].frame < pos + blockSize) {
+		const RenderEvent &e = events[nextEvent++];
+		if ((e.data[0] & 0xf0) == 0xc0) {
+		    // As in real time, from the start of the block
+		    plugin->setCurrentProgram(e.data[1]);
+		    continue;
+		}
+		midiData.insert(midiData.end(), e.data, e.data + 3);
+		midiOffsets.push_back(e.frame > pos ? e.frame - pos : 0);
+	    }
+
+	    if (!midiOffsets.empty()) {
+		plugin->sendMIDIData(&midiData[0], &midiOffsets[0],
+				     midiOffsets.size());
+	    }
+
+	    // The server splits the block at each change's frame
+	    while (nextChange < changes.size() &&
+		   changes[nextChange].frame < pos + blockSize) {
+		const ParameterChange &c = changes[nextChange++];
+		plugin->setParameter(c.index, c.value,
+				     c.frame > pos ? int(c.frame - pos) : 0);
+	    }
+
+	    plugin->process(&inBuffers[0], &outBuffers[0]);
+	    ++blocks;
+
+	    size_t blockStart = 0, blockEnd = blockSize;
+	    if (pos < latency) blockStart = std::min<size_t>(latency - pos, blockSize);
+	    if (pos + blockEnd > total) blockEnd = total - pos;
+
+	    if (blockEnd > blockStart) {
+		if (!writer.write(&outBuffers[0], blockStart, blockEnd - blockStart)) {
+		    perror(outFile.c_str());
+		    return false;
+		}
+		written += blockEnd - blockStart;
+	    }
+	}
+    } catch (RemotePluginClosedException) {
+	std::cerr << "vsthost: plugin server exited during render" << std::endl;
+	return false;
+    }
+
+    double elapsed = now() - start;
+
+    if (!writer.close()) {
+	perror(outFile.c_str());
+	return false;
+    }
+
+    double seconds = double(written) / rate;
+    std::cerr << "vsthost: rendered " << seconds << " seconds in "
+	      << elapsed << " seconds";
+    if (elapsed > 0.0) {
+	std::cerr << " (" << seconds / elapsed << "x real time)";
+    }
+    std::cerr << std::endl;
+
+    // With a plugin that does no work, this is the cost of the
+    // process handshake
+    if (blocks > 0) {
+	std::cerr << "vsthost: " << blocks << " blocks, "
+		  << elapsed * 1000000.0 / blocks << " us per block"
+		  << std::endl;
+    }
+
+    unsigned long long copied = 0, saved = 0;
+    plugin->getCopyStatistics(copied, saved);
+    std::cerr << "vsthost: process copied " << copied
+	      << " bytes of audio to and from shared memory, and skipped "
+	      << saved << std::endl;
+
+    return true;
+}
@@ -0,0 +1,38 @@
+// -*- c-basic-offset: 4 -*-
+
+/*
+  dssi-vst: a DSSI plugin wrapper for VST effects and instruments
+  Copyright 2012-2013 Filipe Coelho
+  Copyright 2010-2011 Kristian Amlie
+  Copyright 2004-2010 Chris Cannam
+*/
+
+#ifndef _OFFLINE_RENDER_H_
+#define _OFFLINE_RENDER_H_
+
+#include <string>
+
+class RemotePluginClient;
+
+// Run a WAV file (and/or a standard MIDI file, for synths) through
+// the plugin and write the result to outFile as 32-bit float WAV, as
+// fast as the server can go rather than in real time.  inFile may be
+// empty, in which case the length comes from the MIDI file and the
+// sample rate is 48000.  The output is the length of the input, with
+// the plugin's latency compensated for.  Prints the throughput as a
+// multiple of real time, and returns false on failure.
+//
+// automationFile, if not empty, lists parameter changes one per line
+// as "<seconds> <parameter> <value>"; they are applied at their exact
+// frames however large the block size.
+//
+// The audio is rendered straight into and out of the plugin's shared
+// memory buffers, unless copyBuffers is set, when it goes through
+// buffers of our own that process copies; the bytes copied and the
+// bytes not copied are printed either way, for comparison.
+bool renderOffline(RemotePluginClient *plugin,
+		   std::string inFile, std::string outFile,
+		   int blockSize, std::string midiFile,
+		   std::string automationFile, bool copyBuffers);
+
+#endif
@@ -13,7 +13,9 @@
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <errno.h>
 #include <string.h>
 
@@ -77,3 +79,80 @@ int shm_mkstemp(char *fileBase)
         }
     }
 }
+
+bool
+getDllStamp(std::string dllPath, DllStamp &stamp)
+{
+    struct stat st;
+    if (stat(dllPath.c_str(), &st)) return false;
+
+    stamp.size = st.st_size;
+    stamp.mtime = st.st_mtim.tv_sec;
+    stamp.mtimeNsec = st.st_mtim.tv_nsec;
+    stamp.hash = 0;
+
+    char *env = getenv("DSSI_VST_CACHE_HASH");
+    if (!env || !*env || !strcmp(env, "0")) return true;
+
+    int fd = open(dllPath.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    // 64-bit FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    char buffer[65536];
+    ssize_t n;
+
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+	for (ssize_t i = 0; i < n; ++i) {
+	    hash = (hash ^ (unsigned char)buffer[i]) * 1099511628211ULL;
+	}
+    }
+
+    close(fd);
+    if (n < 0) return false;
+
+    stamp.hash = (hash ? hash : 1);
+    return true;
+}
+
+void
+appendCacheHeader(std::vector<char> &header, int version,
+		  const DllStamp &stamp, std::string dllPath)
+{
+    int length = dllPath.length();
+    header.insert(header.end(), (const char *)&version,
+		  (const char *)&version + sizeof(int));
+    header.insert(header.end(), (const char *)&stamp,
+		  (const char *)&stamp + sizeof(DllStamp));
+    header.insert(header.end(), (const char *)&length,
+		  (const char *)&length + sizeof(int));
+    header.insert(header.end(), dllPath.begin(), dllPath.end());
+}
+
+bool
+parseCacheHeader(int fd, int version, DllStamp &stamp, std::string &dllPath)
+{
+    int testVersion = 0, length = 0;
+    if (read(fd, &testVersion, sizeof(int)) != sizeof(int) ||
+	testVersion != version ||
+	read(fd, &stamp, sizeof(DllStamp)) != sizeof(DllStamp) ||
+	read(fd, &length, sizeof(int)) != sizeof(int) ||
+	length <= 0 || length > 4096) {
+	return false;
+    }
+
+    std::vector<char> path(length);
+    if (read(fd, &path[0], length) != length) return false;
+
+    dllPath = std::string(&path[0], length);
+    return true;
+}
+
+bool
+isSameDll(const DllStamp &cached, const DllStamp &current)
+{
+    return (cached.size == current.size &&
+	    cached.mtime == current.mtime &&
+	    cached.mtimeNsec == current.mtimeNsec &&
+	    (current.hash == 0 || cached.hash == current.hash));
+}
@@ -13,6 +13,7 @@
 
 #include <string>
 #include <vector>
+#include <stdint.h>
 
 class Paths
 {
@@ -24,4 +25,27 @@ public:
 
 int shm_mkstemp(char *fileBase);
 
+// Identifies the DLL a scanner cache file was made from; it follows
+// the version number at the start of the file.  The hash of the DLL's
+// contents is only taken, and checked, if DSSI_VST_CACHE_HASH is set,
+// as that means reading every DLL; otherwise it is zero.
+struct DllStamp {
+    int64_t size;
+    int64_t mtime;
+    int64_t mtimeNsec;
+    uint64_t hash;
+};
+
+bool getDllStamp(std::string dllPath, DllStamp &stamp);
+bool isSameDll(const DllStamp &cached, const DllStamp &current);
+
+// A cache file starts with the version number, the DllStamp, and the
+// full path of the DLL it was made from, as an int length followed by
+// the characters.  parseCacheHeader reads them from fd, returning
+// false if the file is short or of another version.
+void appendCacheHeader(std::vector<char> &header, int version,
+		       const DllStamp &stamp, std::string dllPath);
+bool parseCacheHeader(int fd, int version, DllStamp &stamp,
+		      std::string &dllPath);
+
 #endif
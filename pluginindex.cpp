@@ -0,0 +1,268 @@
+// -*- c-basic-offset: 4 -*-
+
+/*
+  dssi-vst: a DSSI plugin wrapper for VST effects and instruments
+  Copyright 2012-2013 Filipe Coelho
+  Copyright 2010-2011 Kristian Amlie
+  Copyright 2004-2010 Chris Cannam
+*/
+
+#include "pluginindex.h"
+#include "remoteplugin.h"
+
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+PluginIndex::PluginIndex() :
+    m_base(0),
+    m_size(0),
+    m_mapped(0),
+    m_header(0),
+    m_dlls(0),
+    m_plugins(0)
+{
+}
+
+PluginIndex::~PluginIndex()
+{
+    clear();
+}
+
+void
+PluginIndex::clear()
+{
+    if (m_mapped) munmap(m_mapped, m_size);
+    m_mapped = 0;
+    m_image.clear();
+    m_base = 0;
+    m_size = 0;
+    m_header = 0;
+    m_dlls = 0;
+    m_plugins = 0;
+}
+
+bool
+PluginIndex::load(std::string fileName)
+{
+    clear();
+
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(PluginIndexHeader)) {
+	close(fd);
+	return false;
+    }
+
+    void *mapped = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (mapped == MAP_FAILED) {
+	perror(fileName.c_str());
+	return false;
+    }
+
+    m_mapped = mapped;
+    m_size = st.st_size;
+
+    if (!attach((const char *)mapped, st.st_size)) {
+	std::cerr << "PluginIndex: ignoring invalid index " << fileName << std::endl;
+	clear();
+	return false;
+    }
+
+    return true;
+}
+
+void
+PluginIndex::set(const std::vector<char> &image)
+{
+    clear();
+    m_image = image;
+    if (!m_image.empty() && !attach(&m_image[0], m_image.size())) clear();
+}
+
+bool
+PluginIndex::attach(const char *base, size_t size)
+{
+    // Check only what the accessors can't: the tables and arrays
+    // must lie within the file.  Strings are checked as they are
+    // used, and are terminated by the NUL at the end of the file.
+    const PluginIndexHeader *header = (const PluginIndexHeader *)base;
+
+    if (size < sizeof(PluginIndexHeader) ||
+	memcmp(header->magic, PLUGIN_INDEX_MAGIC, 8) ||
+	header->version != int(RemotePluginVersion * 1000) ||
+	header->size != size || base[size - 1] != '\0' ||
+	header->dllCount < 0 || header->pluginCount < 0 ||
+	header->dllTable > size ||
+	header->pluginTable > size ||
+	(size - header->dllTable) / sizeof(PluginIndexDll) <
+	(size_t)header->dllCount ||
+	(size - header->pluginTable) / sizeof(PluginIndexPlugin) <
+	(size_t)header->pluginCount) {
+	return false;
+    }
+
+    const PluginIndexPlugin *plugins =
+	(const PluginIndexPlugin *)(base + header->pluginTable);
+
+    for (int i = 0; i < header->pluginCount; ++i) {
+	const PluginIndexPlugin &p = plugins[i];
+	if (p.parameters < 0 || p.programs < 0 ||
+	    p.parameterNames > size || p.parameterDefaults > size ||
+	    p.programNames > size ||
+	    (size - p.parameterNames) / 4 < (size_t)p.parameters ||
+	    (size - p.parameterDefaults) / 4 < (size_t)p.parameters ||
+	    (size - p.programNames) / 4 < (size_t)p.programs) {
+	    return false;
+	}
+    }
+
+    m_base = base;
+    m_size = size;
+    m_header = header;
+    m_dlls = (const PluginIndexDll *)(base + header->dllTable);
+    m_plugins = plugins;
+    return true;
+}
+
+static uint32_t
+align(std::vector<char> &image, size_t alignment)
+{
+    while (image.size() % alignment) image.push_back(0);
+    return image.size();
+}
+
+static uint32_t
+addString(std::vector<char> &image, const std::string &s)
+{
+    uint32_t offset = image.size();
+    image.insert(image.end(), s.c_str(), s.c_str() + s.length() + 1);
+    return offset;
+}
+
+static uint32_t
+addData(std::vector<char> &image, const void *data, size_t size)
+{
+    uint32_t offset = align(image, 4);
+    image.insert(image.end(), (const char *)data, (const char *)data + size);
+    return offset;
+}
+
+std::vector<char>
+PluginIndex::build(const std::vector<Dll> &dlls,
+		   const std::vector<RemoteVSTClient::PluginRecord> &plugins)
+{
+    PluginIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PLUGIN_INDEX_MAGIC, 8);
+    header.version = int(RemotePluginVersion * 1000);
+    header.dllCount = dlls.size();
+    header.pluginCount = plugins.size();
+    header.dllTable = sizeof(header);
+    header.pluginTable = header.dllTable + dlls.size() * sizeof(PluginIndexDll);
+
+    // The tables are filled in once the pool is complete, as the
+    // pool grows behind them
+    std::vector<char> image(header.pluginTable +
+			    plugins.size() * sizeof(PluginIndexPlugin), 0);
+
+    std::vector<PluginIndexDll> dllTable(dlls.size());
+    for (size_t i = 0; i < dlls.size(); ++i) {
+	memset(&dllTable[i], 0, sizeof(PluginIndexDll));
+	dllTable[i].path = addString(image, dlls[i].path);
+	dllTable[i].stamp = dlls[i].stamp;
+    }
+
+    std::vector<PluginIndexPlugin> pluginTable(plugins.size());
+    std::vector<uint32_t> offsets;
+
+    for (size_t i = 0; i < plugins.size(); ++i) {
+
+	const RemoteVSTClient::PluginRecord &rec = plugins[i];
+	PluginIndexPlugin &p = pluginTable[i];
+	memset(&p, 0, sizeof(p));
+
+	p.dllName = addString(image, rec.dllName);
+	p.pluginName = addString(image, rec.pluginName);
+	p.vendorName = addString(image, rec.vendorName);
+	p.isSynth = rec.isSynth;
+	p.hasGUI = rec.hasGUI;
+	p.inputs = rec.inputs;
+	p.outputs = rec.outputs;
+	p.parameters = rec.parameterNames.size();
+	p.programs = rec.programNames.size();
+
+	offsets.clear();
+	for (int j = 0; j < p.parameters; ++j) {
+	    offsets.push_back(addString(image, rec.parameterNames[j]));
+	}
+	p.parameterNames = addData(image, offsets.empty() ? 0 : &offsets[0],
+				   offsets.size() * 4);
+	p.parameterDefaults = addData(image, rec.parameterDefaults.empty() ? 0 :
+				      &rec.parameterDefaults[0],
+				      p.parameters * 4);
+
+	offsets.clear();
+	for (int j = 0; j < p.programs; ++j) {
+	    offsets.push_back(addString(image, rec.programNames[j]));
+	}
+	p.programNames = addData(image, offsets.empty() ? 0 : &offsets[0],
+				 offsets.size() * 4);
+    }
+
+    image.push_back('\0');
+    header.size = image.size();
+
+    memcpy(&image[0], &header, sizeof(header));
+    if (!dllTable.empty()) {
+	memcpy(&image[header.dllTable], &dllTable[0],
+	       dllTable.size() * sizeof(PluginIndexDll));
+    }
+    if (!pluginTable.empty()) {
+	memcpy(&image[header.pluginTable], &pluginTable[0],
+	       pluginTable.size() * sizeof(PluginIndexPlugin));
+    }
+
+    return image;
+}
+
+bool
+PluginIndex::save(std::string fileName, const std::vector<char> &image)
+{
+    char suffix[30];
+    sprintf(suffix, ".tmp%d", (int)getpid());
+    std::string tmpFileName = fileName + suffix;
+
+    int fd = open(tmpFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+	perror(tmpFileName.c_str());
+	return false;
+    }
+
+    size_t written = 0;
+    while (written < image.size()) {
+	ssize_t w = write(fd, &image[written], image.size() - written);
+	if (w < 0 && errno == EINTR) continue;
+	if (w <= 0) break;
+	written += w;
+    }
+
+    if (close(fd) || written < image.size() ||
+	rename(tmpFileName.c_str(), fileName.c_str())) {
+	perror(fileName.c_str());
+	unlink(tmpFileName.c_str());
+	return false;
+    }
+
+    return true;
+}
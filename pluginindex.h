@@ -0,0 +1,127 @@
+// -*- c-basic-offset: 4 -*-
+
+/*
+  dssi-vst: a DSSI plugin wrapper for VST effects and instruments
+  Copyright 2012-2013 Filipe Coelho
+  Copyright 2010-2011 Kristian Amlie
+  Copyright 2004-2010 Chris Cannam
+*/
+
+#ifndef _PLUGIN_INDEX_H_
+#define _PLUGIN_INDEX_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "paths.h"
+#include "remotevstclient.h"
+
+// The scan results for every plugin in one file, laid out to be used
+// straight from memory.  The file is a header, a table of the DLLs
+// that were scanned (so that the index can be checked against the
+// VST path without opening anything else), a table of plugins, and
+// a pool of strings and arrays that the tables refer to by offset
+// from the start of the file.  The pool ends with a NUL, so a string
+// at any offset within the file is terminated.
+
+#define PLUGIN_INDEX_MAGIC "DSSIVSTI"
+
+struct PluginIndexHeader
+{
+    char magic[8];
+    int32_t version;      // int(RemotePluginVersion * 1000)
+    uint32_t size;        // of the whole file
+    int32_t dllCount;
+    int32_t pluginCount;
+    uint32_t dllTable;    // offset of PluginIndexDll[dllCount]
+    uint32_t pluginTable; // offset of PluginIndexPlugin[pluginCount]
+};
+
+struct PluginIndexDll
+{
+    uint32_t path;        // string
+    uint32_t reserved;
+    DllStamp stamp;       // as in the DLL's cache file
+};
+
+struct PluginIndexPlugin
+{
+    uint32_t dllName;     // string
+    uint32_t pluginName;  // string
+    uint32_t vendorName;  // string
+    int32_t isSynth;
+    int32_t hasGUI;
+    int32_t inputs;
+    int32_t outputs;
+    int32_t parameters;
+    int32_t programs;
+    uint32_t parameterNames;    // uint32_t[parameters], of strings
+    uint32_t parameterDefaults; // float[parameters]
+    uint32_t programNames;      // uint32_t[programs], of strings
+    uint32_t reserved[2];
+};
+
+class PluginIndex
+{
+public:
+    PluginIndex();
+    ~PluginIndex();
+
+    struct Dll {
+	std::string path;
+	DllStamp stamp;
+    };
+
+    // Map an index file, returning false if it is missing or isn't
+    // a valid index for this version
+    bool load(std::string fileName);
+
+    // Use an index image built in memory instead
+    void set(const std::vector<char> &image);
+
+    static std::vector<char> build(const std::vector<Dll> &dlls,
+				   const std::vector<RemoteVSTClient::PluginRecord> &plugins);
+
+    // Write an image to a temporary file and rename it into place,
+    // so that a reader never sees a partial index
+    static bool save(std::string fileName, const std::vector<char> &image);
+
+    int getDllCount() const { return m_header ? m_header->dllCount : 0; }
+    const char *getDllPath(int dll) const { return getString(m_dlls[dll].path); }
+    const DllStamp &getDllStamp(int dll) const { return m_dlls[dll].stamp; }
+
+    int getPluginCount() const { return m_header ? m_header->pluginCount : 0; }
+    const PluginIndexPlugin &getPlugin(int plugin) const { return m_plugins[plugin]; }
+
+    const char *getString(uint32_t offset) const {
+	return (offset < m_size ? m_base + offset : "");
+    }
+    const char *getParameterName(int plugin, int parameter) const {
+	return getString(((const uint32_t *)(m_base + m_plugins[plugin].parameterNames))[parameter]);
+    }
+    float getParameterDefault(int plugin, int parameter) const {
+	return ((const float *)(m_base + m_plugins[plugin].parameterDefaults))[parameter];
+    }
+    const char *getProgramName(int plugin, int program) const {
+	return getString(((const uint32_t *)(m_base + m_plugins[plugin].programNames))[program]);
+    }
+
+private:
+    PluginIndex(const PluginIndex &); // not provided
+    PluginIndex &operator=(const PluginIndex &); // not provided
+
+    void clear();
+    bool attach(const char *base, size_t size);
+
+    const char *m_base;
+    size_t m_size;
+    void *m_mapped;
+    std::vector<char> m_image;
+
+    const PluginIndexHeader *m_header;
+    const PluginIndexDll *m_dlls;
+    const PluginIndexPlugin *m_plugins;
+};
+
+#endif
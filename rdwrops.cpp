@@ -15,22 +15,120 @@
 #include <unistd.h>
 #include <string.h>
 #include <zlib.h>
+#include <time.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <cstdio>
 #include <iostream>
 
 //#define DEBUG_RDWR 1
 
+// Per-call-site accounting for blocking FIFO reads, enabled by
+// setting DSSI_VST_RDWR_STATS in the environment and reported to
+// stderr on exit (or whenever rdwr_dumpStats is called).
+
+#define RDWR_STATS_SITES 256
+
+struct RdwrSiteStats
+{
+    const char *file;
+    int line;
+    unsigned long count;
+    double totalMs;
+    double maxMs;
+};
+
+static RdwrSiteStats rdwr_stats[RDWR_STATS_SITES];
+static pthread_mutex_t rdwr_statsMutex = PTHREAD_MUTEX_INITIALIZER;
+static int rdwr_statsEnabled = -1;
+
+static double
+rdwr_nowMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static bool
+rdwr_statsActive()
+{
+    if (rdwr_statsEnabled < 0) {
+	const char *e = getenv("DSSI_VST_RDWR_STATS");
+	rdwr_statsEnabled = (e && *e && strcmp(e, "0")) ? 1 : 0;
+	if (rdwr_statsEnabled) atexit(rdwr_dumpStats);
+    }
+    return rdwr_statsEnabled;
+}
+
+static void
+rdwr_recordStats(const char *file, int line, double ms)
+{
+    pthread_mutex_lock(&rdwr_statsMutex);
+
+    // __FILE__ strings are literals, so the pointer will do as a key
+    unsigned int h = ((uintptr_t)file / sizeof(void *) + line * 31u) % RDWR_STATS_SITES;
+    for (int i = 0; i < RDWR_STATS_SITES; ++i) {
+	RdwrSiteStats &st = rdwr_stats[(h + i) % RDWR_STATS_SITES];
+	if (!st.file) {
+	    st.file = file;
+	    st.line = line;
+	}
+	if (st.file == file && st.line == line) {
+	    ++st.count;
+	    st.totalMs += ms;
+	    if (ms > st.maxMs) st.maxMs = ms;
+	    break;
+	}
+    }
+
+    pthread_mutex_unlock(&rdwr_statsMutex);
+}
+
+void
+rdwr_dumpStats()
+{
+    if (!rdwr_statsActive()) return;
+
+    pthread_mutex_lock(&rdwr_statsMutex);
+
+    fprintf(stderr, "rdwr: FIFO read latency by call site (count, mean ms, max ms):\n");
+    for (int i = 0; i < RDWR_STATS_SITES; ++i) {
+	RdwrSiteStats &st = rdwr_stats[i];
+	if (!st.file) continue;
+	fprintf(stderr, "  %s:%d\t%lu\t%.3f\t%.3f\n", st.file, st.line,
+		st.count, st.totalMs / st.count, st.maxMs);
+    }
+
+    pthread_mutex_unlock(&rdwr_statsMutex);
+}
+
 void
-rdwr_tryRead(int fd, void *buf, size_t count, const char *file, int line)
+rdwr_tryRead(int fd, void *buf, size_t count, const char *file, int line,
+	     int timeout)
 {
-    ssize_t r = 0;
+    bool stats = rdwr_statsActive();
+    double start = 0, deadline = 0;
 
-    while ((r = read(fd, buf, count)) < (ssize_t)count) {
+    if (stats || timeout >= 0) {
+	start = rdwr_nowMs();
+	deadline = start + timeout;
+    }
+
+    while (count > 0) {
+
+	ssize_t r = read(fd, buf, count);
 
 	if (r == 0) {
 	    // end of file
 	    throw RemotePluginClosedException();
 	} else if (r < 0) {
+	    if (errno == EINTR) continue;
 	    if (errno != EAGAIN) {
 		char message[100];
 		sprintf(message, "Read failed on fd %d at %s:%d", fd, file, line);
@@ -43,16 +141,42 @@ rdwr_tryRead(int fd, void *buf, size_t count, const char *file, int line)
 	buf = (void *)(((char *)buf) + r);
 	count -= r;
 
-	if (count > 0) {
-	    usleep(20000);
+	if (count == 0) break;
+
+	// Only part of what we want is here (or none of it, on a
+	// non-blocking fd): wait for the rest to arrive
+
+	int remaining = -1;
+	if (timeout >= 0) {
+	    remaining = (int)(deadline - rdwr_nowMs());
+	    if (remaining < 0) remaining = 0;
 	}
+
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	int p = poll(&pfd, 1, remaining);
+	if (p < 0 && errno != EINTR) {
+	    char message[100];
+	    sprintf(message, "Poll failed on fd %d at %s:%d", fd, file, line);
+	    perror(message);
+	    throw RemotePluginClosedException();
+	}
+	if (p == 0) {
+	    fprintf(stderr, "Read timed out after %d ms on fd %d at %s:%d\n",
+		    timeout, fd, file, line);
+	    throw RemotePluginClosedException();
+	}
+	// POLLHUP or POLLERR will be picked up by the next read
     }
 
-#ifdef DEBUG_RDWR
-    if (r >= count) {
-	fprintf(stderr, "read succeeded at %s:%d (%d bytes)\n",
-		file, line, r);
+    if (stats) {
+	rdwr_recordStats(file, line, rdwr_nowMs() - start);
     }
+
+#ifdef DEBUG_RDWR
+    fprintf(stderr, "read succeeded at %s:%d\n", file, line);
 #endif
 }
 
@@ -84,70 +208,152 @@ void
 rdwr_tryRead(RingBuffer *ringbuf, void *buf, size_t count, const char *file, int line)
 {
     char *charbuf = static_cast<char *>(buf);
-    size_t tail = ringbuf->tail;
-    size_t head = ringbuf->head;
-    size_t wrap = 0;
+    uint32_t tail = ringbuf->tail;
+    uint32_t head = __atomic_load_n(&ringbuf->head, __ATOMIC_ACQUIRE);
 
-    if (head <= tail) {
-        wrap = SHM_RING_BUFFER_SIZE;
-    }
-    if (head - tail + wrap < count) {
+    if (head - tail < count) {
         throw RemotePluginClosedException();
     }
-    size_t readto = tail + count;
-    if (readto >= SHM_RING_BUFFER_SIZE) {
-        readto -= SHM_RING_BUFFER_SIZE;
-        size_t firstpart = SHM_RING_BUFFER_SIZE - tail;
-        memcpy(charbuf, ringbuf->buf + tail, firstpart);
-        memcpy(charbuf + firstpart, ringbuf->buf, readto);
+
+    size_t offset = tail & (ringbuf->size - 1);
+    size_t firstpart = ringbuf->size - offset;
+    if (firstpart >= count) {
+        memcpy(charbuf, ringbuf->buf + offset, count);
     } else {
-        memcpy(charbuf, ringbuf->buf + tail, count);
+        memcpy(charbuf, ringbuf->buf + offset, firstpart);
+        memcpy(charbuf + firstpart, ringbuf->buf, count - firstpart);
     }
-    ringbuf->tail = readto;
+
+    __atomic_store_n(&ringbuf->tail, tail + count, __ATOMIC_RELEASE);
 }
 
 void
 rdwr_tryWrite(RingBuffer *ringbuf, const void *buf, size_t count, const char *file, int line)
 {
     const char *charbuf = static_cast<const char *>(buf);
-    size_t written = ringbuf->written;
-    size_t tail = ringbuf->tail;
-    size_t wrap = 0;
-    if (tail <= written) {
-        wrap = SHM_RING_BUFFER_SIZE;
-    }
-    if (tail - written + wrap < count) {
-        std::cerr << "Operation ring buffer full! Dropping events." << std::endl;
+    uint32_t written = ringbuf->written;
+    uint32_t tail = __atomic_load_n(&ringbuf->tail, __ATOMIC_ACQUIRE);
+
+    if (ringbuf->invalidateCommit) {
+        return; // this transaction is already being dropped
+    }
+    if (ringbuf->size - (written - tail) < count) {
+        // The caller finds out from rdwr_commitWrite
         ringbuf->invalidateCommit = true;
         return;
     }
 
-    size_t writeto = written + count;
-    if (writeto >= SHM_RING_BUFFER_SIZE) {
-        writeto -= SHM_RING_BUFFER_SIZE;
-        size_t firstpart = SHM_RING_BUFFER_SIZE - written;
-        memcpy(ringbuf->buf + written, charbuf, firstpart);
-        memcpy(ringbuf->buf, charbuf + firstpart, writeto);
+    size_t offset = written & (ringbuf->size - 1);
+    size_t firstpart = ringbuf->size - offset;
+    if (firstpart >= count) {
+        memcpy(ringbuf->buf + offset, charbuf, count);
     } else {
-        memcpy(ringbuf->buf + written, charbuf, count);
+        memcpy(ringbuf->buf + offset, charbuf, firstpart);
+        memcpy(ringbuf->buf, charbuf + firstpart, count - firstpart);
     }
-    ringbuf->written = writeto;
+    ringbuf->written = written + count;
 }
 
-void
+bool
 rdwr_commitWrite(RingBuffer *ringbuf, const char *file, int line)
 {
     if (ringbuf->invalidateCommit) {
         ringbuf->written = ringbuf->head;
         ringbuf->invalidateCommit = false;
-    } else {
-        ringbuf->head = ringbuf->written;
+        return false;
     }
+    __atomic_store_n(&ringbuf->head, ringbuf->written, __ATOMIC_RELEASE);
+    return true;
 }
 
 bool dataAvailable(RingBuffer *ringbuf)
 {
-    return ringbuf->tail != ringbuf->head;
+    return ringbuf->tail != __atomic_load_n(&ringbuf->head, __ATOMIC_ACQUIRE);
+}
+
+bool
+rdwr_futexWait(int32_t *word, int32_t val, int timeout)
+{
+    struct timespec ts, *tsp = 0;
+
+    if (timeout >= 0) {
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000;
+	tsp = &ts;
+    }
+
+    // Not FUTEX_PRIVATE_FLAG: the word lives in memory shared between
+    // processes.
+    while (__atomic_load_n(word, __ATOMIC_ACQUIRE) == val) {
+	if (syscall(SYS_futex, word, FUTEX_WAIT, val, tsp, 0, 0) < 0) {
+	    if (errno == ETIMEDOUT) return false;
+	    if (errno != EAGAIN && errno != EINTR) {
+		perror("futex wait failed");
+		throw RemotePluginClosedException();
+	    }
+	}
+    }
+
+    return true;
+}
+
+void
+rdwr_futexWake(int32_t *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, 0, 0, 0);
+}
+
+static inline void
+rdwr_cpuRelax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+bool
+rdwr_spinWait(int32_t *word, int32_t val, int policy, int *spinLimit,
+	      int timeout, ShmWaiter *waiter)
+{
+    if (policy != ShmWaitBlock) {
+
+	int limit = (policy == ShmWaitSpin ? RDWR_SPIN_MAX : *spinLimit);
+
+	for (int i = 0; i < limit; ++i) {
+	    if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != val) {
+		++waiter->spinHits;
+		if (policy == ShmWaitAdaptive && i * 2 > *spinLimit) {
+		    *spinLimit = (i * 2 < RDWR_SPIN_MAX ? i * 2 : RDWR_SPIN_MAX);
+		}
+		return true;
+	    }
+	    rdwr_cpuRelax();
+	}
+
+	++waiter->spinMisses;
+	if (policy == ShmWaitAdaptive && *spinLimit > RDWR_SPIN_MIN) {
+	    *spinLimit /= 2;
+	}
+    }
+
+    __atomic_store_n(&waiter->sleeping, 1, __ATOMIC_SEQ_CST);
+    bool rv = false;
+    try {
+	rv = rdwr_futexWait(word, val, timeout);
+    } catch (...) {
+	__atomic_store_n(&waiter->sleeping, 0, __ATOMIC_RELEASE);
+	throw;
+    }
+    __atomic_store_n(&waiter->sleeping, 0, __ATOMIC_RELEASE);
+    return rv;
+}
+
+void
+rdwr_spinWake(int32_t *word, ShmWaiter *waiter)
+{
+    if (__atomic_load_n(&waiter->sleeping, __ATOMIC_SEQ_CST)) {
+	rdwr_futexWake(word);
+    }
 }
 
 template <typename T> void
@@ -209,97 +415,252 @@ rdwr_readFloat(T fd, const char *file, int line)
     return f;
 }
 
-template <typename T> unsigned char *
-rdwr_readMIDIData(T fd, int **frameoffsets, int &events, const char *file, int line)
+template <typename T> int
+rdwr_readMIDIData(T fd, unsigned char *data, int *frameoffsets, const char *file, int line)
 {
-    static unsigned char buf[MIDI_BUFFER_SIZE * 3];
-    static int frameoffbuf[MIDI_BUFFER_SIZE];
-
+    int events = 0;
     rdwr_tryRead(fd, &events, sizeof(int), file, line);
-    rdwr_tryRead(fd, buf, events * 3, file, line);
-    rdwr_tryRead(fd, frameoffbuf, events * sizeof(int), file, line);
 
-    if (frameoffsets) *frameoffsets = frameoffbuf;
-    return buf;
+    if (events < 0 || events > MIDI_BUFFER_SIZE) {
+	std::cerr << "ERROR: Bad MIDI event count " << events
+		  << " at " << file << ":" << line << std::endl;
+	throw RemotePluginClosedException();
+    }
+
+    rdwr_tryRead(fd, data, events * 3, file, line);
+    rdwr_tryRead(fd, frameoffsets, events * sizeof(int), file, line);
+
+    return events;
 }
 
-//Deryabin Andrew: vst chunks support
-template <typename T> void
-rdwr_writeRaw(T fd, std::vector<char> rawdata, const char *file, int line)
+// Chunk transfer through a temporary shared-memory segment: only the
+// segment name, codec and lengths go through the FIFO.
+
+void
+rdwr_writeChunk(int fd, int shmFd, const char *shmName,
+		const std::vector<char> &chunk, int codec,
+		const char *file, int line)
 {
-    unsigned long complen = compressBound(rawdata.size());
-    char *compressed = new char [complen];
-    if(!compressed)
-    {
-        fprintf(stderr, "Failed to allocate %lu bytes of memory at %s:%d\n", complen, file, line);
-        throw RemotePluginClosedException();
+    size_t len = chunk.size();
+    size_t stored = 0;
+
+    if (codec != RemotePluginChunkZlib) codec = RemotePluginChunkRaw;
+
+    if (len > 0) {
+
+	size_t bound = (codec == RemotePluginChunkZlib ? compressBound(len) : len);
+
+	if (ftruncate(shmFd, bound) < 0) {
+	    char message[100];
+	    sprintf(message, "Failed to size chunk segment at %s:%d", file, line);
+	    perror(message);
+	    throw RemotePluginClosedException();
+	}
+
+	char *p = (char *)mmap(0, bound, PROT_READ | PROT_WRITE, MAP_SHARED, shmFd, 0);
+	if (p == MAP_FAILED) {
+	    char message[100];
+	    sprintf(message, "Failed to map chunk segment at %s:%d", file, line);
+	    perror(message);
+	    throw RemotePluginClosedException();
+	}
+
+	if (codec == RemotePluginChunkZlib) {
+	    uLongf clen = bound;
+	    if (compress2((Bytef *)p, &clen, (const Bytef *)&chunk[0], len,
+			  Z_BEST_SPEED) == Z_OK && clen < len) {
+		stored = clen;
+	    } else {
+		// incompressible, or compression failed: send it as it is
+		codec = RemotePluginChunkRaw;
+	    }
+	}
+	if (codec == RemotePluginChunkRaw) {
+	    memcpy(p, &chunk[0], len);
+	    stored = len;
+	}
+
+	munmap(p, bound);
+	if (stored < bound) ftruncate(shmFd, stored);
+
+    } else {
+	shm_unlink(shmName);
     }
 
-    std::vector<char>::pointer ptr = &rawdata [0];
+    rdwr_writeString(fd, std::string(len > 0 ? shmName : ""), file, line);
+    rdwr_writeInt(fd, codec, file, line);
+    rdwr_writeInt(fd, stored, file, line);
+    rdwr_writeInt(fd, len, file, line);
+}
 
-    if(compress2((Bytef *)compressed, &complen, (Bytef *)ptr, rawdata.size(), 9) != Z_OK)
-    {
-        delete compressed;
-        fprintf(stderr, "Failed to compress source buffer at %s:%d\n", file, line);
-        throw RemotePluginClosedException();
+bool
+rdwr_readChunk(int fd, std::vector<char> &chunk, const char *file, int line)
+{
+    std::string name = rdwr_readString(fd, file, line);
+    int codec = rdwr_readInt(fd, file, line);
+    int stored = rdwr_readInt(fd, file, line);
+    int len = rdwr_readInt(fd, file, line);
+
+    chunk.clear();
+    if (name == "" || len <= 0 || stored <= 0) return true;
+
+    int shmFd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (shmFd < 0) {
+	char message[100];
+	sprintf(message, "Failed to open chunk segment at %s:%d", file, line);
+	perror(message);
+	return false;
     }
 
-    fprintf(stderr, "compressed source buffer. size=%lu bytes\n", complen);
+    // The reader always removes the segment; our mapping outlives it
+    shm_unlink(name.c_str());
+    char *p = (char *)mmap(0, stored, PROT_READ, MAP_SHARED, shmFd, 0);
+    close(shmFd);
 
-    int len = complen;
-    rdwr_tryWrite(fd, &len, sizeof(int), file, line);
-    len = rawdata.size();
-    rdwr_tryWrite(fd, &len, sizeof(int), file, line);    
-    rdwr_tryWrite(fd, compressed, complen, file, line);
+    if (p == MAP_FAILED) {
+	char message[100];
+	sprintf(message, "Failed to map chunk segment at %s:%d", file, line);
+	perror(message);
+	return false;
+    }
+
+    bool ok = true;
+    chunk.resize(len);
+
+    if (codec == RemotePluginChunkRaw && stored == len) {
+	memcpy(&chunk[0], p, len);
+    } else if (codec == RemotePluginChunkZlib) {
+	uLongf dlen = len;
+	ok = (uncompress((Bytef *)&chunk[0], &dlen, (const Bytef *)p, stored) == Z_OK &&
+	      dlen == (uLongf)len);
+    } else {
+	ok = false;
+    }
 
-    delete [] compressed;
+    munmap(p, stored);
+
+    if (!ok) {
+	fprintf(stderr, "Failed to decode chunk (codec %d, %d bytes) at %s:%d\n",
+		codec, stored, file, line);
+	chunk.clear();
+    }
+    return ok;
 }
 
-template <typename T> std::vector<char>
-rdwr_readRaw(T fd, const char *file, int line)
+static void
+rdwr_appendInt(std::vector<char> &buf, int i)
 {
-    int complen, len;
-    static char *rawbuf = 0;
-    static int bufLen = 0;
-    rdwr_tryRead(fd, &complen, sizeof(int), file, line);
-    rdwr_tryRead(fd, &len, sizeof(int), file, line);
-    if (complen > bufLen) {
-    delete rawbuf;
-    rawbuf = new char[complen];
-    bufLen = complen;
-    }
-    rdwr_tryRead(fd, rawbuf, complen, file, line);
+    buf.insert(buf.end(), (char *)&i, (char *)&i + sizeof(int));
+}
 
-    char *uncompressed = new char [len];
+static void
+rdwr_appendString(std::vector<char> &buf, const std::string &str)
+{
+    rdwr_appendInt(buf, str.length());
+    buf.insert(buf.end(), str.begin(), str.end());
+}
 
-    if(!uncompressed)
-    {
-        fprintf(stderr, "Failed to allocate %d bytes of memory at %s:%d\n", len, file, line);
-        throw RemotePluginClosedException();
+static int
+rdwr_extractInt(const std::vector<char> &buf, size_t &pos,
+		const char *file, int line)
+{
+    int i;
+    if (pos + sizeof(int) > buf.size()) {
+	fprintf(stderr, "Truncated metadata at %s:%d\n", file, line);
+	throw RemotePluginClosedException();
     }
+    memcpy(&i, &buf[pos], sizeof(int));
+    pos += sizeof(int);
+    return i;
+}
 
-    unsigned long destlen = len;
+static std::string
+rdwr_extractString(const std::vector<char> &buf, size_t &pos,
+		   const char *file, int line)
+{
+    int len = rdwr_extractInt(buf, pos, file, line);
+    if (len < 0 || pos + len > buf.size()) {
+	fprintf(stderr, "Truncated metadata at %s:%d\n", file, line);
+	throw RemotePluginClosedException();
+    }
+    std::string str(&buf[0] + pos, len);
+    pos += len;
+    return str;
+}
+
+void
+rdwr_writeMetadata(int fd, const RemotePluginMetadata &md, const char *file, int line)
+{
+    std::vector<char> buf;
+    buf.reserve(4096);
+
+    // Length prefix, filled in below
+    rdwr_appendInt(buf, 0);
+
+    rdwr_appendString(buf, md.name);
+    rdwr_appendString(buf, md.maker);
+    rdwr_appendInt(buf, md.inputs);
+    rdwr_appendInt(buf, md.outputs);
+    rdwr_appendInt(buf, md.flags);
+
+    rdwr_appendInt(buf, md.parameterNames.size());
+    for (size_t i = 0; i < md.parameterNames.size(); ++i) {
+	rdwr_appendString(buf, md.parameterNames[i]);
+	float f = (i < md.parameterDefaults.size() ? md.parameterDefaults[i] : 0.f);
+	buf.insert(buf.end(), (char *)&f, (char *)&f + sizeof(float));
+    }
 
-    if(uncompress((Bytef *)uncompressed, &destlen, (Bytef *)rawbuf, complen) != Z_OK)
-    {
-        delete uncompressed;
-        fprintf(stderr, "Failed to uncompress source buffer at %s:%d\n", file, line);
-        throw RemotePluginClosedException();   
+    rdwr_appendInt(buf, md.programNames.size());
+    for (size_t i = 0; i < md.programNames.size(); ++i) {
+	rdwr_appendString(buf, md.programNames[i]);
     }
 
-    fprintf(stderr, "uncompressed source buffer. size=%lu bytes, complen=%d\n", destlen, complen);
+    int len = buf.size() - sizeof(int);
+    memcpy(&buf[0], &len, sizeof(int));
+    rdwr_tryWrite(fd, &buf[0], buf.size(), file, line);
+}
 
-    std::vector<char> rawout;
-    for(unsigned long i = 0; i < destlen; i++)
-    {
-        rawout.push_back(uncompressed [i]);
+void
+rdwr_readMetadata(int fd, RemotePluginMetadata &md, const char *file, int line)
+{
+    int len = 0;
+    rdwr_tryRead(fd, &len, sizeof(int), file, line);
+    if (len < 0) {
+	fprintf(stderr, "Bad metadata length %d at %s:%d\n", len, file, line);
+	throw RemotePluginClosedException();
     }
 
-    delete uncompressed;
+    std::vector<char> buf(len);
+    if (len > 0) rdwr_tryRead(fd, &buf[0], len, file, line);
+
+    size_t pos = 0;
+    md.name = rdwr_extractString(buf, pos, file, line);
+    md.maker = rdwr_extractString(buf, pos, file, line);
+    md.inputs = rdwr_extractInt(buf, pos, file, line);
+    md.outputs = rdwr_extractInt(buf, pos, file, line);
+    md.flags = rdwr_extractInt(buf, pos, file, line);
+
+    int n = rdwr_extractInt(buf, pos, file, line);
+    md.parameterNames.clear();
+    md.parameterDefaults.clear();
+    for (int i = 0; i < n; ++i) {
+	md.parameterNames.push_back(rdwr_extractString(buf, pos, file, line));
+	float f;
+	if (pos + sizeof(float) > buf.size()) {
+	    fprintf(stderr, "Truncated metadata at %s:%d\n", file, line);
+	    throw RemotePluginClosedException();
+	}
+	memcpy(&f, &buf[pos], sizeof(float));
+	pos += sizeof(float);
+	md.parameterDefaults.push_back(f);
+    }
 
-    return rawout;
+    n = rdwr_extractInt(buf, pos, file, line);
+    md.programNames.clear();
+    for (int i = 0; i < n; ++i) {
+	md.programNames.push_back(rdwr_extractString(buf, pos, file, line));
+    }
 }
-//Deryabin Andrew: vst chunks support: end code
 
 template
 void rdwr_writeOpcode(int fd, RemotePluginOpcode opcode, const char *file, int line);
@@ -316,11 +677,7 @@ void rdwr_writeFloat(int fd, float f, const char *file, int line);
 template
 float rdwr_readFloat(int fd, const char *file, int line);
 template
-unsigned char *rdwr_readMIDIData(int fd, int **frameoffsets, int &events, const char *file, int line);
-template
-void rdwr_writeRaw(int fd, std::vector<char> rawdata, const char *file, int line);
-template
-std::vector<char> rdwr_readRaw(int fd, const char *file, int line);
+int rdwr_readMIDIData(int fd, unsigned char *data, int *frameoffsets, const char *file, int line);
 
 template
 void rdwr_writeOpcode(RingBuffer *ringbuf, RemotePluginOpcode opcode, const char *file, int line);
@@ -337,8 +694,4 @@ void rdwr_writeFloat(RingBuffer *ringbuf, float f, const char *file, int line);
 template
 float rdwr_readFloat(RingBuffer *ringbuf, const char *file, int line);
 template
-unsigned char *rdwr_readMIDIData(RingBuffer *ringbuf, int **frameoffsets, int &events, const char *file, int line);
-template
-void rdwr_writeRaw(RingBuffer *ringbuf, std::vector<char> rawdata, const char *file, int line);
-template
-std::vector<char> rdwr_readRaw(RingBuffer *ringbuf, const char *file, int line);
+int rdwr_readMIDIData(RingBuffer *ringbuf, unsigned char *data, int *frameoffsets, const char *file, int line);
@@ -15,21 +15,124 @@
 #include "remoteplugin.h"
 
 #include <semaphore.h>
+#include <stdint.h>
 
 // Should be divisible by three
 #define MIDI_BUFFER_SIZE 1023
 
+// Default and limits for the ring size, which the client picks at
+// construction time.  The size must be a power of two.
 #define SHM_RING_BUFFER_SIZE 2048
+#define SHM_RING_BUFFER_MAX_SIZE (1 << 20)
 
+#define SHM_CACHE_LINE_SIZE 64
+
+// Single-producer, single-consumer ring: the client writes, the
+// server reads.  head, written and tail are free-running counters
+// masked into buf.  Each side stores only to its own cache line and
+// publishes its index with release semantics, so the ring is safe
+// without a syscall acting as a barrier between the two processes.
+// The ring data follows the header, so a RingBuffer must always be
+// the last thing in its shared memory segment.
 struct RingBuffer
 {
-    int head;
-    int tail;
-    int written;
-    bool invalidateCommit;
-    char buf[SHM_RING_BUFFER_SIZE];
+    // Producer side
+    uint32_t head;     // committed write position, visible to reader
+    uint32_t written;  // write position within the open transaction
+    int32_t invalidateCommit;
+    uint32_t size;     // bytes in buf, fixed when the ring is created
+    uint32_t spills;   // transactions carried over an extra handshake
+    uint32_t overflows; // transactions dropped as too large to ever fit
+    char producerPad[SHM_CACHE_LINE_SIZE - 6 * sizeof(int32_t)];
+
+    // Consumer side
+    uint32_t tail;
+    char consumerPad[SHM_CACHE_LINE_SIZE - sizeof(uint32_t)];
+
+    char buf[];
+} __attribute__((aligned(SHM_CACHE_LINE_SIZE)));
+
+// How the client and server wake each other for each process call.
+// The pipes are always created and remain the fallback; the futex
+// mode instead bumps the runServer/runClient sequence counters below
+// and sleeps on them directly, saving a write and a read on each side
+// per block.
+enum ShmSignalMode {
+    ShmSignalPipe = 0,
+    ShmSignalFutex = 1
+};
+
+// How each side waits on the other's sequence counter in futex mode:
+// sleep straight away, spin for a fixed bound first, or spin for a
+// bound that grows when spinning pays off and shrinks when it doesn't.
+enum ShmWaitPolicy {
+    ShmWaitBlock = 0,
+    ShmWaitSpin = 1,
+    ShmWaitAdaptive = 2
+};
+
+// Per-side wait state.  sleeping tells the other side whether a futex
+// wake is needed at all; the counters record whether the awaited
+// sequence number arrived while spinning (hit) or not (miss).
+struct ShmWaiter
+{
+    int32_t sleeping;
+    uint32_t spinHits;
+    uint32_t spinMisses;
+    int32_t reserved;
+};
+
+// Parameter values shared between host and server, so that neither
+// setting nor reading a parameter needs a round trip.  The host
+// writes hostValue and, if the entry was not already dirty, queues
+// its index; the server drains the queue at the top of each process
+// call and publishes the plugin's own values in pluginValue.
+struct ShmParameter
+{
+    float hostValue;
+    float pluginValue;
+    int32_t dirty;
+};
+
+struct ShmParameterTable
+{
+    int32_t count;
+    uint32_t queueSize; // power of two, at least count
+    char headerPad[SHM_CACHE_LINE_SIZE - 2 * 4];
+    uint32_t queueHead; // written by the host
+    char headPad[SHM_CACHE_LINE_SIZE - 4];
+    uint32_t queueTail; // written by the server
+    char tailPad[SHM_CACHE_LINE_SIZE - 4];
+    // followed by ShmParameter[count] and int32_t queue[queueSize]
 };
 
+inline uint32_t
+shmParameterQueueSize(int count)
+{
+    uint32_t sz = 1;
+    while (sz < (uint32_t)count) sz <<= 1;
+    return sz;
+}
+
+inline size_t
+shmParameterTableSize(int count)
+{
+    return sizeof(ShmParameterTable) + count * sizeof(ShmParameter) +
+	shmParameterQueueSize(count) * sizeof(int32_t);
+}
+
+inline ShmParameter *
+shmParameters(ShmParameterTable *table)
+{
+    return (ShmParameter *)(table + 1);
+}
+
+inline int32_t *
+shmParameterQueue(ShmParameterTable *table)
+{
+    return (int32_t *)(shmParameters(table) + table->count);
+}
+
 struct ShmControl
 {
     // Pipe will be used by both 64- and 32- bit, so store as the former.
@@ -37,16 +140,44 @@ struct ShmControl
     int64_t runServerWrite;
     int64_t runClientRead;
     int64_t runClientWrite;
-    RingBuffer ringBuffer;
+    int32_t signalMode;
+    int32_t runServer; // sequence number, bumped by the client
+    int32_t runClient; // sequence number, set by the server when done
+    int32_t waitPolicy;
+    int32_t latency; // plugin's own latency in frames, set by the server
+    int32_t reserved;
+    ShmWaiter clientWait;
+    ShmWaiter serverWait;
+    RingBuffer ringBuffer; // variable size, must come last
 };
 
-void rdwr_tryRead(int fd, void *buf, size_t count, const char *file, int line);
+// A negative timeout (ms) waits for as long as it takes; otherwise the
+// read throws RemotePluginClosedException if it has not completed
+// within that time
+void rdwr_tryRead(int fd, void *buf, size_t count, const char *file, int line,
+		  int timeout = -1);
+void rdwr_dumpStats();
 void rdwr_tryWrite(int fd, const void *buf, size_t count, const char *file, int line);
 void rdwr_tryRead(RingBuffer *ringbuf, void *buf, size_t count, const char *file, int line);
 void rdwr_tryWrite(RingBuffer *ringbuf, const void *buf, size_t count, const char *file, int line);
-void rdwr_commitWrite(RingBuffer *ringbuf, const char *file, int line);
+bool rdwr_commitWrite(RingBuffer *ringbuf, const char *file, int line);
 bool dataAvailable(RingBuffer *ringbuf);
 
+// Sleep while *word still equals val, for at most timeout ms (or
+// indefinitely if timeout is negative).  Returns false on timeout.
+bool rdwr_futexWait(int32_t *word, int32_t val, int timeout);
+void rdwr_futexWake(int32_t *word);
+
+// As rdwr_futexWait, but spin first according to policy.  spinLimit
+// is the caller's own (unshared) spin bound, tuned in adaptive mode.
+// The side changing *word must store it with sequential consistency
+// and then call rdwr_spinWake with the waiter's ShmWaiter.
+#define RDWR_SPIN_MIN 16
+#define RDWR_SPIN_MAX 16384
+bool rdwr_spinWait(int32_t *word, int32_t val, int policy, int *spinLimit,
+		   int timeout, ShmWaiter *waiter);
+void rdwr_spinWake(int32_t *word, ShmWaiter *waiter);
+
 template <typename T>
 void rdwr_writeOpcode(T fd, RemotePluginOpcode opcode, const char *file, int line);
 template <typename T>
@@ -61,14 +192,28 @@ template <typename T>
 void rdwr_writeFloat(T fd, float f, const char *file, int line);
 template <typename T>
 float rdwr_readFloat(T fd, const char *file, int line);
+// Reads a block's MIDI events into data (MIDI_BUFFER_SIZE * 3 bytes)
+// and frameoffsets (MIDI_BUFFER_SIZE ints), supplied by the caller,
+// and returns how many there are
 template <typename T>
-unsigned char *rdwr_readMIDIData(T fd, int **frameoffsets, int &events, const char *file, int line);
-template <typename T>
-void rdwr_writeRaw(T fd, std::vector<char> rawdata, const char *file, int line);
-template <typename T>
-std::vector<char> rdwr_readRaw(T fd, const char *file, int line);
+int rdwr_readMIDIData(T fd, unsigned char *data, int *frameoffsets, const char *file, int line);
+
+// VST chunks travel in a temporary shared-memory segment, which the
+// writer creates (shmFd/shmName, from shm_mkstemp) and the reader
+// unlinks; only its name and size go down the FIFO.  codec is a
+// preference: the writer falls back to raw if compressing doesn't
+// help.  readChunk returns false if the chunk could not be decoded.
+void rdwr_writeChunk(int fd, int shmFd, const char *shmName,
+		     const std::vector<char> &chunk, int codec,
+		     const char *file, int line);
+bool rdwr_readChunk(int fd, std::vector<char> &chunk, const char *file, int line);
+
+// Sent as a single length-prefixed block
+void rdwr_writeMetadata(int fd, const RemotePluginMetadata &md, const char *file, int line);
+void rdwr_readMetadata(int fd, RemotePluginMetadata &md, const char *file, int line);
 
 #define tryRead(a, b, c) rdwr_tryRead(a, b, c, __FILE__, __LINE__)
+#define tryReadTimeout(a, b, c, t) rdwr_tryRead(a, b, c, __FILE__, __LINE__, t)
 #define tryWrite(a, b, c) rdwr_tryWrite(a, b, c, __FILE__, __LINE__)
 #define writeOpcode(a, b) rdwr_writeOpcode(a, b, __FILE__, __LINE__)
 #define writeString(a, b) rdwr_writeString(a, b, __FILE__, __LINE__)
@@ -78,12 +223,14 @@ std::vector<char> rdwr_readRaw(T fd, const char *file, int line);
 #define writeFloat(a, b) rdwr_writeFloat(a, b, __FILE__, __LINE__)
 #define readFloat(a) rdwr_readFloat(a, __FILE__, __LINE__)
 #define readMIDIData(a, b, c) rdwr_readMIDIData(a, b, c, __FILE__, __LINE__)
+#define writeMetadata(a, b) rdwr_writeMetadata(a, b, __FILE__, __LINE__)
+#define readMetadata(a, b) rdwr_readMetadata(a, b, __FILE__, __LINE__)
 #define commitWrite(a) rdwr_commitWrite(a, __FILE__, __LINE__)
 #define purgeRead(a) rdwr_purgeRead(a, __FILE__, __LINE__)
 
 //Deryabin Andrew: chunks support
-#define writeRaw(a, b) rdwr_writeRaw(a, b, __FILE__, __LINE__)
-#define readRaw(a) rdwr_readRaw(a, __FILE__, __LINE__)
+#define writeChunk(a, b, c, d, e) rdwr_writeChunk(a, b, c, d, e, __FILE__, __LINE__)
+#define readChunk(a, b) rdwr_readChunk(a, b, __FILE__, __LINE__)
 //Deryabin Andrew: vst chunks support: end code
 
 #endif
@@ -10,7 +10,19 @@
 #ifndef REMOTE_PLUGIN_H
 #define REMOTE_PLUGIN_H
 
-static const float RemotePluginVersion = 0.986;
+#include <string>
+#include <vector>
+
+// Bump this with every change to the opcodes, their arguments, or
+// the layout of the shared memory or cache files: a client refuses a
+// server of any other version, and cached scans of another version
+// are thrown away.
+static const float RemotePluginVersion = 0.989;
+
+// A shared server (dssi-vst-server -s <fifo>) reads requests for new
+// instances from its listen FIFO as fixed-size records, so that
+// requests from several hosts at once can't interleave
+static const int RemotePluginServerRequestSize = 512;
 
 enum RemotePluginDebugLevel {
     RemotePluginDebugNone,
@@ -24,11 +36,13 @@ enum RemotePluginOpcode {
     RemotePluginGetVersion = 0,
     RemotePluginGetName,
     RemotePluginGetMaker,
+    RemotePluginGetMetadata,
 
     RemotePluginSetBufferSize = 100,
     RemotePluginSetSampleRate,
     RemotePluginReset,
     RemotePluginTerminate,
+    RemotePluginSetOffline,
 
     RemotePluginGetInputCount = 200,
     RemotePluginGetOutputCount,
@@ -39,6 +53,8 @@ enum RemotePluginOpcode {
     RemotePluginGetParameter,
     RemotePluginGetParameterDefault,
     RemotePluginGetParameters,
+    RemotePluginSetParameterAt,
+    RemotePluginSetParameterTable,
 
     RemotePluginGetProgramCount = 350,
     RemotePluginGetProgramName,
@@ -65,6 +81,29 @@ enum RemotePluginOpcode {
 
 };
 
+enum RemotePluginChunkCodec {
+    RemotePluginChunkRaw = 0,
+    RemotePluginChunkZlib = 1
+};
+
+enum RemotePluginMetadataFlags {
+    RemotePluginMetadataHasMIDIInput = 1
+};
+
+// Everything a client usually wants to know about a plugin when it
+// starts up, fetched in one RemotePluginGetMetadata round trip
+struct RemotePluginMetadata
+{
+    std::string name;
+    std::string maker;
+    int inputs;
+    int outputs;
+    int flags; // RemotePluginMetadataFlags
+    std::vector<std::string> parameterNames;
+    std::vector<float> parameterDefaults;
+    std::vector<std::string> programNames;
+};
+
 class RemotePluginClosedException { };
 
 #endif
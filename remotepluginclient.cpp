@@ -14,6 +14,7 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/poll.h>
 #include <fcntl.h>
 #include <time.h>
 #include <unistd.h>
@@ -37,9 +38,24 @@ RemotePluginClient::RemotePluginClient() :
     m_shm(0),
     m_shmSize(0),
     m_shmControl(0),
+    m_shmControlSize(0),
     m_bufferSize(-1),
     m_numInputs(-1),
-    m_numOutputs(-1)
+    m_numOutputs(-1),
+    m_spinLimit(RDWR_SPIN_MIN),
+    m_bytesCopied(0),
+    m_bytesSaved(0),
+    m_pipelined(false),
+    m_pipelineRegion(0),
+    m_pipelinePending(false),
+    m_pipelineSeq(0),
+    m_processStarted(false),
+    m_processSeq(0),
+    m_outputRegion(0),
+    m_outputValid(false),
+    m_chunkCodec(RemotePluginChunkRaw),
+    m_paramTable(0),
+    m_paramTableSize(0)
 {
     char tmpFileBase[60];
 
@@ -80,14 +96,28 @@ RemotePluginClient::RemotePluginClient() :
 	throw((std::string)"Failed to open or create shared memory file");
     }
     m_shmControlFileName = strdup(tmpFileBase);
-    ftruncate(m_shmControlFd, sizeof(ShmControl));
-    m_shmControl = static_cast<ShmControl *>(mmap(0, sizeof(ShmControl), PROT_READ | PROT_WRITE, MAP_SHARED, m_shmControlFd, 0));
-    if (!m_shmControl) {
+
+    // The process ring follows the control block in the same segment
+    size_t ringSize = SHM_RING_BUFFER_SIZE;
+    char *ringEnv = getenv("DSSI_VST_RING_SIZE");
+    if (ringEnv) {
+	size_t requested = atol(ringEnv);
+	while (ringSize < requested && ringSize < SHM_RING_BUFFER_MAX_SIZE) {
+	    ringSize <<= 1;
+	}
+    }
+    m_shmControlSize = sizeof(ShmControl) + ringSize;
+
+    ftruncate(m_shmControlFd, m_shmControlSize);
+    m_shmControl = static_cast<ShmControl *>(mmap(0, m_shmControlSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_shmControlFd, 0));
+    if (m_shmControl == MAP_FAILED) {
+        m_shmControl = 0;
         cleanup();
         throw((std::string)"Failed to mmap shared memory file");
     }
 
-    memset(m_shmControl, 0, sizeof(ShmControl));
+    memset(m_shmControl, 0, m_shmControlSize);
+    m_shmControl->ringBuffer.size = ringSize;
     int pipeFds[2];
     if (pipe(pipeFds) != 0) {
         throw((std::string)"Failed to initialize communication pipe");
@@ -100,6 +130,28 @@ RemotePluginClient::RemotePluginClient() :
     m_shmControl->runClientRead = pipeFds[0];
     m_shmControl->runClientWrite = pipeFds[1];
 
+    // Futex signalling unless asked to stick with the pipes
+    char *signal = getenv("DSSI_VST_SIGNAL");
+    if (signal && !strcmp(signal, "pipe")) {
+	m_shmControl->signalMode = ShmSignalPipe;
+    } else {
+	m_shmControl->signalMode = ShmSignalFutex;
+    }
+
+    char *codec = getenv("DSSI_VST_CHUNK_CODEC");
+    if (codec && !strcmp(codec, "zlib")) {
+	m_chunkCodec = RemotePluginChunkZlib;
+    }
+
+    char *wait = getenv("DSSI_VST_WAIT");
+    if (wait && !strcmp(wait, "block")) {
+	m_shmControl->waitPolicy = ShmWaitBlock;
+    } else if (wait && !strcmp(wait, "spin")) {
+	m_shmControl->waitPolicy = ShmWaitSpin;
+    } else {
+	m_shmControl->waitPolicy = ShmWaitAdaptive;
+    }
+
     sprintf(tmpFileBase, "/dssi-vst-rplugin_shm_XXXXXX");
     m_shmFd = shm_mkstemp(tmpFileBase);
     if (m_shmFd < 0) {
@@ -117,34 +169,50 @@ RemotePluginClient::~RemotePluginClient()
 void
 RemotePluginClient::syncStartup()
 {
-    // The first (write) fd we open in a nonblocking call, with a
-    // short retry loop so we can easily give up if the other end
-    // doesn't appear to be responding.  We want a nonblocking FIFO
-    // for this anyway.
-
-    bool connected = false;
-    int timeout = 40;
+    // The response FIFO we can open straight away without blocking,
+    // and then wait for the server's startup report to arrive on it:
+    // the server opens its end of the request FIFO before sending
+    // that, so we can then open ours without retrying.
 
-    for (int attempt = 0; attempt < timeout; ++attempt) {
+    int timeout = 40; // sec
 
-	if ((m_controlRequestFd =
-	     open(m_controlRequestFileName, O_WRONLY | O_NONBLOCK)) >= 0) {
-	    connected = true;
-	    break;
-	} else if (errno != ENXIO) {
-	    // an actual error occurred
-	    break;
-	}
+    if ((m_controlResponseFd =
+	 open(m_controlResponseFileName, O_RDONLY | O_NONBLOCK)) < 0) {
+	cleanup();
+	throw((std::string)"Failed to open control FIFO");
+    }
 
-	sleep(1);
+    struct pollfd pfd;
+    pfd.fd = m_controlResponseFd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    struct timeval deadline;
+    gettimeofday(&deadline, 0);
+    deadline.tv_sec += timeout;
+
+    int rv = 0;
+    while (1) {
+	struct timeval now;
+	gettimeofday(&now, 0);
+	int remaining = (deadline.tv_sec - now.tv_sec) * 1000 +
+	    (deadline.tv_usec - now.tv_usec) / 1000;
+	if (remaining < 0) remaining = 0;
+	rv = poll(&pfd, 1, remaining);
+	if (rv >= 0 || errno != EINTR) break;
     }
 
-    if (!connected) {
+    if (rv <= 0 || !(pfd.revents & POLLIN)) {
 	cleanup();
 	throw((std::string)"Plugin server timed out on startup");
     }
 
-    if ((m_controlResponseFd = open(m_controlResponseFileName, O_RDONLY)) < 0) {
+    fcntl(m_controlResponseFd, F_SETFL,
+	  fcntl(m_controlResponseFd, F_GETFL) & ~O_NONBLOCK);
+
+    // We want a nonblocking FIFO for requests anyway
+    if ((m_controlRequestFd =
+	 open(m_controlRequestFileName, O_WRONLY | O_NONBLOCK)) < 0) {
 	cleanup();
 	throw((std::string)"Failed to open control FIFO");
     }
@@ -155,6 +223,16 @@ RemotePluginClient::syncStartup()
 	cleanup();
 	throw((std::string)"Remote plugin did not start correctly");
     }
+
+    // The version request is the one message every server version
+    // understands, so ask it before anything that might be misparsed
+    float version = getVersion();
+    if (int(version * 1000) != int(RemotePluginVersion * 1000)) {
+	std::cerr << "RemotePluginClient: server is version " << version
+		  << ", expected " << RemotePluginVersion << std::endl;
+	cleanup();
+	throw((std::string)"Plugin server is a different version");
+    }
 }
 
 void
@@ -164,6 +242,10 @@ RemotePluginClient::cleanup()
 	munmap(m_shm, m_shmSize);
 	m_shm = 0;
     }
+    if (m_paramTable) {
+	munmap(m_paramTable, m_paramTableSize);
+	m_paramTable = 0;
+    }
     if (m_shmControl) {
         if (m_shmControl->runServerRead)
             close(m_shmControl->runServerRead);
@@ -173,7 +255,7 @@ RemotePluginClient::cleanup()
             close(m_shmControl->runClientRead);
         if (m_shmControl->runClientWrite)
             close(m_shmControl->runClientWrite);
-        munmap(m_shmControl, sizeof(ShmControl));
+        munmap(m_shmControl, m_shmControlSize);
         m_shmControl = 0;
     }
     if (m_controlRequestFd >= 0) {
@@ -230,7 +312,9 @@ void
 RemotePluginClient::sizeShm()
 {
     if (m_numInputs < 0 || m_numOutputs < 0 || m_bufferSize < 0) return;
-    size_t sz = (m_numInputs + m_numOutputs) * m_bufferSize * sizeof(float);
+    // One region of input and output channels, or two when pipelined
+    size_t sz = (m_pipelined ? 2 : 1) *
+	(m_numInputs + m_numOutputs) * m_bufferSize * sizeof(float);
 
     ftruncate(m_shmFd, sz);
 
@@ -239,6 +323,7 @@ RemotePluginClient::sizeShm()
     } else {
 	m_shm = (char *)mmap(0, sz, PROT_READ | PROT_WRITE, MAP_SHARED, m_shmFd, 0);
     }
+    if (m_shm == MAP_FAILED) m_shm = 0;
     if (!m_shm) {
 	std::cerr << "RemotePluginClient::sizeShm: ERROR: mmap or mremap failed for " << sz
 		  << " bytes from fd " << m_shmFd << "!" << std::endl;
@@ -253,7 +338,6 @@ RemotePluginClient::sizeShm()
 float
 RemotePluginClient::getVersion()
 {
-//!!! client code needs to be testing this
     writeOpcode(m_controlRequestFd, RemotePluginGetVersion);
     return readFloat(m_controlResponseFd);
 }
@@ -276,26 +360,40 @@ void
 RemotePluginClient::setBufferSize(int s)
 {
     if (s == m_bufferSize) return;
+    flushPipeline();
     m_bufferSize = s;
     sizeShm();
-    writeOpcode(&m_shmControl->ringBuffer, RemotePluginSetBufferSize);
-    writeInt(&m_shmControl->ringBuffer, s);
-    commitWrite(&m_shmControl->ringBuffer);
+    do {
+	writeOpcode(&m_shmControl->ringBuffer, RemotePluginSetBufferSize);
+	writeInt(&m_shmControl->ringBuffer, s);
+    } while (!commitRing());
     waitForServer();
 }
 
 void
 RemotePluginClient::setSampleRate(int s)
 {
-    writeOpcode(&m_shmControl->ringBuffer, RemotePluginSetSampleRate);
-    writeInt(&m_shmControl->ringBuffer, s);
-    commitWrite(&m_shmControl->ringBuffer);
+    do {
+	writeOpcode(&m_shmControl->ringBuffer, RemotePluginSetSampleRate);
+	writeInt(&m_shmControl->ringBuffer, s);
+    } while (!commitRing());
+    waitForServer();
+}
+
+void
+RemotePluginClient::setOffline(bool offline)
+{
+    do {
+	writeOpcode(&m_shmControl->ringBuffer, RemotePluginSetOffline);
+	writeInt(&m_shmControl->ringBuffer, offline ? 1 : 0);
+    } while (!commitRing());
     waitForServer();
 }
 
 void
 RemotePluginClient::reset()
 {
+    flushPipeline();
     writeOpcode(m_controlRequestFd, RemotePluginReset);
     if (m_shmSize > 0) {
 	memset(m_shm, 0, m_shmSize);
@@ -308,6 +406,19 @@ RemotePluginClient::terminate()
     writeOpcode(m_controlRequestFd, RemotePluginTerminate);
 }
 
+RemotePluginMetadata
+RemotePluginClient::getMetadata()
+{
+    RemotePluginMetadata md;
+    writeOpcode(m_controlRequestFd, RemotePluginGetMetadata);
+    readMetadata(m_controlResponseFd, md);
+    m_numInputs = md.inputs;
+    m_numOutputs = md.outputs;
+    sizeShm();
+    createParameterTable(md.parameterNames.size());
+    return md;
+}
+
 int
 RemotePluginClient::getInputCount()
 {
@@ -330,7 +441,58 @@ int
 RemotePluginClient::getParameterCount()
 {
     writeOpcode(m_controlRequestFd, RemotePluginGetParameterCount);
-    return readInt(m_controlResponseFd);
+    int count = readInt(m_controlResponseFd);
+    createParameterTable(count);
+    return count;
+}
+
+void
+RemotePluginClient::createParameterTable(int count)
+{
+    if (m_paramTable || count <= 0) return;
+
+    char name[] = "/dssi-vst-rplugin_par_XXXXXX";
+    int fd = shm_mkstemp(name);
+    if (fd < 0) {
+	perror("RemotePluginClient: failed to create parameter table");
+	return;
+    }
+
+    size_t sz = shmParameterTableSize(count);
+    ShmParameterTable *table = 0;
+
+    if (ftruncate(fd, sz) == 0) {
+	table = (ShmParameterTable *)
+	    mmap(0, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (table == MAP_FAILED) table = 0;
+    }
+    close(fd);
+
+    if (!table) {
+	perror("RemotePluginClient: failed to map parameter table");
+	shm_unlink(name);
+	return;
+    }
+
+    memset(table, 0, sz);
+    table->count = count;
+    table->queueSize = shmParameterQueueSize(count);
+
+    // The server unlinks the segment once it has it mapped
+    writeOpcode(m_controlRequestFd, RemotePluginSetParameterTable);
+    writeString(m_controlRequestFd, name);
+    writeInt(m_controlRequestFd, count);
+
+    if (!readInt(m_controlResponseFd)) {
+	std::cerr << "RemotePluginClient: server declined parameter table, "
+		  << "parameters will go through the control channel" << std::endl;
+	shm_unlink(name);
+	munmap(table, sz);
+	return;
+    }
+
+    m_paramTable = table;
+    m_paramTableSize = sz;
 }
 
 std::string
@@ -344,15 +506,57 @@ RemotePluginClient::getParameterName(int p)
 void
 RemotePluginClient::setParameter(int p, float v)
 {
-    writeOpcode(&m_shmControl->ringBuffer, RemotePluginSetParameter);
-    writeInt(&m_shmControl->ringBuffer, p);
-    writeFloat(&m_shmControl->ringBuffer, v);
-    commitWrite(&m_shmControl->ringBuffer);
+    if (m_paramTable && p >= 0 && p < m_paramTable->count) {
+	ShmParameter &param = shmParameters(m_paramTable)[p];
+	__atomic_store(&param.hostValue, &v, __ATOMIC_RELEASE);
+	if (__atomic_exchange_n(&param.dirty, 1, __ATOMIC_SEQ_CST) == 0) {
+	    // Not already queued.  An index is only ever queued once
+	    // at a time, so the queue cannot overflow.
+	    uint32_t head = m_paramTable->queueHead;
+	    shmParameterQueue(m_paramTable)[head & (m_paramTable->queueSize - 1)] = p;
+	    __atomic_store_n(&m_paramTable->queueHead, head + 1, __ATOMIC_RELEASE);
+	}
+	return;
+    }
+
+    do {
+	writeOpcode(&m_shmControl->ringBuffer, RemotePluginSetParameter);
+	writeInt(&m_shmControl->ringBuffer, p);
+	writeFloat(&m_shmControl->ringBuffer, v);
+    } while (!commitRing());
+}
+
+void
+RemotePluginClient::setParameter(int p, float v, int frame)
+{
+    if (frame <= 0) {
+	setParameter(p, v);
+	return;
+    }
+    do {
+	writeOpcode(&m_shmControl->ringBuffer, RemotePluginSetParameterAt);
+	writeInt(&m_shmControl->ringBuffer, p);
+	writeFloat(&m_shmControl->ringBuffer, v);
+	writeInt(&m_shmControl->ringBuffer, frame);
+    } while (!commitRing());
 }
 
 float
 RemotePluginClient::getParameter(int p)
 {
+    if (m_paramTable && p >= 0 && p < m_paramTable->count) {
+	// A change we have sent but the server not yet applied is
+	// more current than what the plugin last reported
+	ShmParameter &param = shmParameters(m_paramTable)[p];
+	float v;
+	if (__atomic_load_n(&param.dirty, __ATOMIC_ACQUIRE)) {
+	    __atomic_load(&param.hostValue, &v, __ATOMIC_ACQUIRE);
+	} else {
+	    __atomic_load(&param.pluginValue, &v, __ATOMIC_ACQUIRE);
+	}
+	return v;
+    }
+
     writeOpcode(m_controlRequestFd, RemotePluginGetParameter);
     writeInt(m_controlRequestFd, p);
     return readFloat(m_controlResponseFd);
@@ -369,6 +573,13 @@ RemotePluginClient::getParameterDefault(int p)
 void
 RemotePluginClient::getParameters(int p0, int pn, float *v)
 {
+    if (m_paramTable && p0 >= 0 && pn < m_paramTable->count) {
+	for (int i = p0; i <= pn; ++i) {
+	    v[i - p0] = getParameter(i);
+	}
+	return;
+    }
+
     writeOpcode(m_controlRequestFd, RemotePluginGetParameters);
     writeInt(m_controlRequestFd, p0);
     writeInt(m_controlRequestFd, pn);
@@ -402,19 +613,16 @@ RemotePluginClient::getProgramName(int n)
 void
 RemotePluginClient::setCurrentProgram(int n)
 {
-    writeOpcode(&m_shmControl->ringBuffer, RemotePluginSetCurrentProgram);
-    writeInt(&m_shmControl->ringBuffer, n);
-    commitWrite(&m_shmControl->ringBuffer);
+    do {
+	writeOpcode(&m_shmControl->ringBuffer, RemotePluginSetCurrentProgram);
+	writeInt(&m_shmControl->ringBuffer, n);
+    } while (!commitRing());
     waitForServer();
 }
 
 void
 RemotePluginClient::sendMIDIData(unsigned char *data, int *frameoffsets, int events)
 {
-    writeOpcode(&m_shmControl->ringBuffer, RemotePluginSendMIDIData);
-    writeInt(&m_shmControl->ringBuffer, events);
-    tryWrite(&m_shmControl->ringBuffer, data, events * 3);
-
     if (!frameoffsets) {
 	// This should not happen with a good client, but we'd better
 	// cope as well as possible with the lazy ol' degenerates
@@ -424,8 +632,27 @@ RemotePluginClient::sendMIDIData(unsigned char *data, int *frameoffsets, int eve
 
 //    std::cerr << "RemotePluginClient::sendMIDIData(" << events << ")" << std::endl;
 
-    tryWrite(&m_shmControl->ringBuffer, frameoffsets, events * sizeof(int));
-    commitWrite(&m_shmControl->ringBuffer);
+    // Split into transactions that fit in an empty ring and within
+    // the server's MIDI read buffer; the server collects them all
+    // before the next process call
+    int maxEvents = (m_shmControl->ringBuffer.size -
+		     sizeof(RemotePluginOpcode) - sizeof(int)) /
+	(3 + sizeof(int));
+    if (maxEvents > MIDI_BUFFER_SIZE) maxEvents = MIDI_BUFFER_SIZE;
+
+    while (events > 0) {
+	int n = events;
+	if (n > maxEvents) n = maxEvents;
+	do {
+	    writeOpcode(&m_shmControl->ringBuffer, RemotePluginSendMIDIData);
+	    writeInt(&m_shmControl->ringBuffer, n);
+	    tryWrite(&m_shmControl->ringBuffer, data, n * 3);
+	    tryWrite(&m_shmControl->ringBuffer, frameoffsets, n * sizeof(int));
+	} while (!commitRing());
+	data += n * 3;
+	frameoffsets += n;
+	events -= n;
+    }
 }
 
 void
@@ -434,6 +661,18 @@ RemotePluginClient::process(float **inputs, float **outputs)
     //struct timeval start, finish;
     //gettimeofday(&start, 0);
 
+    startProcess(inputs);
+    finishProcess(outputs);
+
+    //gettimeofday(&finish, 0);
+//	std::cout << "process: time " << finish.tv_sec - start.tv_sec
+//		  << " sec, " << finish.tv_usec - start.tv_usec << " usec"
+//		  << std::endl;
+}
+
+void
+RemotePluginClient::startProcess(float **inputs)
+{
     if (m_bufferSize < 0) {
 	std::cerr << "ERROR: RemotePluginClient::setBufferSize must be called before RemotePluginClient::process" << std::endl;
 	return;
@@ -450,38 +689,174 @@ RemotePluginClient::process(float **inputs, float **outputs)
 	std::cerr << "ERROR: RemotePluginClient::process: no shared memory region available" << std::endl;
 	return;
     }
+    if (m_processStarted) {
+	std::cerr << "ERROR: RemotePluginClient::startProcess called again before finishProcess" << std::endl;
+	return;
+    }
 
     size_t blocksz = m_bufferSize * sizeof(float);
 
     //!!! put counter in shm to indicate number of blocks processed?
     // (so we know if we've screwed up)
 
+    // In pipelined mode this block goes into one region while the
+    // server may still be working on the previous one in the other
+    int inRegion = (m_pipelined ? m_pipelineRegion : 0);
+    int outRegion = (m_pipelined ? 1 - inRegion : inRegion);
+
     for (int i = 0; i < m_numInputs; ++i) {
-	memcpy(m_shm + i * blocksz, inputs[i], blocksz);
+	char *buf = channelBuffer(inRegion, i);
+	if (!inputs[i]) {
+	    memset(buf, 0, blocksz);
+	} else if ((char *)inputs[i] == buf) {
+	    m_bytesSaved += blocksz;
+	} else {
+	    memcpy(buf, inputs[i], blocksz);
+	    m_bytesCopied += blocksz;
+	}
     }
 
-    writeOpcode(&m_shmControl->ringBuffer, RemotePluginProcess);
-    commitWrite(&m_shmControl->ringBuffer);
+    // In pipelined mode the output is that of the previous block,
+    // which is complete once the server has finished with it; the
+    // server only touches the other region while working on this one
+    m_outputValid = true;
+    if (m_pipelined) {
+	m_outputValid = m_pipelinePending;
+	flushPipeline();
+    }
 
-    waitForServer();
+    do {
+	writeOpcode(&m_shmControl->ringBuffer, RemotePluginProcess);
+	writeInt(&m_shmControl->ringBuffer, inRegion);
+    } while (!commitRing());
 
-    for (int i = 0; i < m_numOutputs; ++i) {
-        memcpy(outputs[i], m_shm + (i + m_numInputs) * blocksz, blocksz);
+    if (m_shmControl->signalMode == ShmSignalFutex) {
+	m_processSeq = signalServer();
+    } else {
+	char msg = 0;
+	if (write(m_shmControl->runServerWrite, &msg, 1) != 1) {
+	    throw RemotePluginClosedException();
+	}
+    }
+
+    if (m_pipelined) {
+	m_pipelineSeq = m_processSeq;
+	m_pipelinePending = true;
+	m_pipelineRegion = outRegion;
+    }
+
+    m_outputRegion = outRegion;
+    m_processStarted = true;
+}
+
+void
+RemotePluginClient::finishProcess(float **outputs)
+{
+    if (!m_processStarted) return;
+    m_processStarted = false;
+
+    if (!m_pipelined) {
+	if (m_shmControl->signalMode == ShmSignalFutex) {
+	    waitForSequence(m_processSeq);
+	} else {
+	    char msg = 0;
+	    if (read(m_shmControl->runClientRead, &msg, 1) != 1) {
+		throw RemotePluginClosedException();
+	    }
+	}
     }
 
+    size_t blocksz = m_bufferSize * sizeof(float);
+
+    for (int i = 0; i < m_numOutputs; ++i) {
+	if (!outputs[i]) continue;
+	if (!m_outputValid) {
+	    memset(outputs[i], 0, blocksz);
+	    continue;
+	}
+	char *buf = channelBuffer(m_outputRegion, i + m_numInputs);
+	if ((char *)outputs[i] == buf) {
+	    m_bytesSaved += blocksz;
+	} else {
+	    memcpy(outputs[i], buf, blocksz);
+	    m_bytesCopied += blocksz;
+	}
+    }
 
 //    std::cout << "process: wrote opcode " << RemotePluginProcess << std::endl;
+}
 
-    //gettimeofday(&finish, 0);
-//	std::cout << "process: time " << finish.tv_sec - start.tv_sec
-//		  << " sec, " << finish.tv_usec - start.tv_usec << " usec"
-//		  << std::endl;
-    return;
+bool
+RemotePluginClient::commitRing()
+{
+    // Commit the transaction just written to the process ring.  If it
+    // didn't fit, have the server drain what is already queued and
+    // return false so that the caller writes it again.  Only if it
+    // can't fit in an empty ring either is it dropped.
+
+    RingBuffer *ring = &m_shmControl->ringBuffer;
+
+    if (commitWrite(ring)) return true;
+
+    if (!dataAvailable(ring)) {
+	++ring->overflows;
+	std::cerr << "Operation ring buffer too small for transaction! Dropping events." << std::endl;
+	return true;
+    }
+
+    ++ring->spills;
+    waitForServer();
+    return false;
+}
+
+int
+RemotePluginClient::getRingSpillCount()
+{
+    return m_shmControl->ringBuffer.spills;
+}
+
+int
+RemotePluginClient::getRingOverflowCount()
+{
+    return m_shmControl->ringBuffer.overflows;
+}
+
+float *
+RemotePluginClient::getInputBuffer(int channel)
+{
+    if (!m_shm || m_bufferSize < 0 ||
+	channel < 0 || channel >= m_numInputs) return 0;
+    return (float *)channelBuffer(m_pipelined ? m_pipelineRegion : 0,
+				  channel);
+}
+
+float *
+RemotePluginClient::getOutputBuffer(int channel)
+{
+    if (!m_shm || m_bufferSize < 0 || m_numInputs < 0 ||
+	channel < 0 || channel >= m_numOutputs) return 0;
+    // In pipelined mode the next process call returns the output of
+    // the block submitted from the other region
+    return (float *)channelBuffer(m_pipelined ? 1 - m_pipelineRegion : 0,
+				  channel + m_numInputs);
+}
+
+void
+RemotePluginClient::getCopyStatistics(unsigned long long &copied,
+				      unsigned long long &saved)
+{
+    copied = m_bytesCopied;
+    saved = m_bytesSaved;
 }
 
 void
 RemotePluginClient::waitForServer()
 {
+    if (m_shmControl->signalMode == ShmSignalFutex) {
+	waitForSequence(signalServer());
+	return;
+    }
+
     char msg = 0;
     if (write(m_shmControl->runServerWrite, &msg, 1) != 1) {
 	throw RemotePluginClosedException();
@@ -492,6 +867,98 @@ RemotePluginClient::waitForServer()
     }
 }
 
+int32_t
+RemotePluginClient::signalServer()
+{
+    int32_t seq = __atomic_add_fetch(&m_shmControl->runServer, 1,
+				     __ATOMIC_SEQ_CST);
+    rdwr_spinWake(&m_shmControl->runServer, &m_shmControl->serverWait);
+    return seq;
+}
+
+void
+RemotePluginClient::waitForSequence(int32_t seq)
+{
+    // The server reports the latest sequence number it has seen, which
+    // may already be past seq if we have signalled again since
+    int32_t done;
+    while ((int32_t)((done = __atomic_load_n(&m_shmControl->runClient,
+					     __ATOMIC_ACQUIRE)) - seq) < 0) {
+	rdwr_spinWait(&m_shmControl->runClient, done,
+		      m_shmControl->waitPolicy, &m_spinLimit, -1,
+		      &m_shmControl->clientWait);
+    }
+}
+
+void
+RemotePluginClient::setSignalMode(ShmSignalMode mode)
+{
+    m_shmControl->signalMode = mode;
+}
+
+bool
+RemotePluginClient::setPipelined(bool pipelined)
+{
+    if (pipelined && m_shmControl->signalMode != ShmSignalFutex) {
+	std::cerr << "RemotePluginClient::setPipelined: pipelined processing needs futex signalling" << std::endl;
+	return false;
+    }
+    if (pipelined == m_pipelined) return true;
+
+    flushPipeline();
+    m_pipelined = pipelined;
+    m_pipelineRegion = 0;
+    sizeShm();
+    return true;
+}
+
+int
+RemotePluginClient::getPipelineLatency()
+{
+    return (m_pipelined && m_bufferSize > 0) ? m_bufferSize : 0;
+}
+
+int
+RemotePluginClient::getLatency()
+{
+    int latency = __atomic_load_n(&m_shmControl->latency, __ATOMIC_ACQUIRE);
+    if (latency < 0) latency = 0;
+    return latency + getPipelineLatency();
+}
+
+void
+RemotePluginClient::flushPipeline()
+{
+    if (!m_pipelinePending) return;
+    waitForSequence(m_pipelineSeq);
+    m_pipelinePending = false;
+}
+
+char *
+RemotePluginClient::channelBuffer(int region, int channel)
+{
+    size_t blocksz = m_bufferSize * sizeof(float);
+    return m_shm + (region * (m_numInputs + m_numOutputs) + channel) * blocksz;
+}
+
+void
+RemotePluginClient::setWaitPolicy(ShmWaitPolicy policy)
+{
+    m_shmControl->waitPolicy = policy;
+}
+
+void
+RemotePluginClient::getWaitStatistics(unsigned int &clientHits,
+				      unsigned int &clientMisses,
+				      unsigned int &serverHits,
+				      unsigned int &serverMisses)
+{
+    clientHits = m_shmControl->clientWait.spinHits;
+    clientMisses = m_shmControl->clientWait.spinMisses;
+    serverHits = m_shmControl->serverWait.spinHits;
+    serverMisses = m_shmControl->serverWait.spinMisses;
+}
+
 void
 RemotePluginClient::setDebugLevel(RemotePluginDebugLevel level)
 {
@@ -526,17 +993,44 @@ RemotePluginClient::hideGUI()
 std::vector<char> RemotePluginClient::getVSTChunk()
 {
     std::cerr << "RemotePluginClient::getChunk: getting vst chunk.." << std::endl;
+    std::vector<char> chunk;
     writeOpcode(m_controlRequestFd, RemotePluginGetVSTChunk);
-    std::vector<char> chunk = readRaw(m_controlResponseFd);
+    writeInt(m_controlRequestFd, m_chunkCodec);
+    if (!readChunk(m_controlResponseFd, chunk)) {
+	std::cerr << "RemotePluginClient::getChunk: failed to read vst chunk" << std::endl;
+    }
     std::cerr << "RemotePluginClient::getChunk: got vst chunk, size=" << chunk.size() << std::endl;
     return chunk;
 }
 
-void RemotePluginClient::setVSTChunk(std::vector<char> chunk)
+void RemotePluginClient::setVSTChunk(const std::vector<char> &chunk)
+{
+    std::cerr << "RemotePluginClient::setChunk: writing vst chunk, size=" << chunk.size() << std::endl;
+
+    char name[] = "/dssi-vst-rplugin_chk_XXXXXX";
+    int fd = shm_mkstemp(name);
+    if (fd < 0) {
+	perror("RemotePluginClient::setChunk: failed to create chunk segment");
+	return;
+    }
+
+    try {
+	writeOpcode(m_controlRequestFd, RemotePluginSetVSTChunk);
+	writeChunk(m_controlRequestFd, fd, name, chunk, m_chunkCodec);
+    } catch (RemotePluginClosedException) {
+	close(fd);
+	shm_unlink(name);
+	throw;
+    }
+    close(fd);
+
+    if (!readInt(m_controlResponseFd)) {
+	std::cerr << "RemotePluginClient::setChunk: server failed to read vst chunk" << std::endl;
+    }
+}
+
+void RemotePluginClient::setChunkCodec(RemotePluginChunkCodec codec)
 {
-    std::cerr << "RemotePluginClient::setChunk: writing vst chunk.." << std::endl;
-    std::cerr << "RemotePluginClient::setChunk: read vst chunk, size=" << chunk.size() << std::endl;
-    writeOpcode(m_controlRequestFd, RemotePluginSetVSTChunk);
-    writeRaw(m_controlRequestFd, chunk);
+    m_chunkCodec = codec;
 }
 //Deryabin Andrew: vst chunks support: end code
@@ -34,15 +34,26 @@ public:
     void         setBufferSize(int);
     void         setSampleRate(int);
 
+    // Tell the plugin it is rendering offline rather than in real
+    // time (the VST "offline" process level)
+    void         setOffline(bool);
+
     void         reset();
     void         terminate();
     
+    // All of the counts, names and defaults in a single round trip.
+    // Also serves as getInputCount and getOutputCount for process.
+    RemotePluginMetadata getMetadata();
+
     int          getInputCount();
     int          getOutputCount();
 
     int          getParameterCount();
     std::string  getParameterName(int);
     void         setParameter(int, float);
+    // Change a parameter at the given frame offset within the next
+    // process block, in order with MIDI sent for the same block
+    void         setParameter(int, float, int frame);
     float        getParameter(int);
     float        getParameterDefault(int);
     void         getParameters(int, int, float *);
@@ -59,25 +70,80 @@ public:
     // Either inputs or outputs may be NULL if (and only if) there are none
     void         process(float **inputs, float **outputs);
 
+    // process in two halves: startProcess hands the block to the
+    // server and returns at once, and finishProcess waits for the
+    // server and collects the output.  A host running several plugins
+    // can start them all before finishing any, so that their servers
+    // work on the block at the same time.  Nothing else should be
+    // asked of the same client in between.
+    void         startProcess(float **inputs);
+    void         finishProcess(float **outputs);
+
+    // The shared-memory buffer for each audio channel, valid until the
+    // next setBufferSize call (or NULL if there is none yet).  process
+    // does not copy a channel whose pointer already is this buffer, so
+    // a caller that renders into or reads from these directly saves a
+    // memcpy per channel per block.  A NULL channel pointer in process
+    // is also left alone (inputs are silenced).
+    float       *getInputBuffer(int channel);
+    float       *getOutputBuffer(int channel);
+
+    // Bytes of audio process has copied to and from shared memory, and
+    // bytes it skipped because the caller passed the shm buffers
+    void         getCopyStatistics(unsigned long long &copied,
+				   unsigned long long &saved);
+
     void         waitForServer();
 
+    // Pipelined mode (futex signalling only): process submits each
+    // block and returns the output of the previous one, so the server
+    // works on block N while the host prepares block N+1.  This adds
+    // one block of latency, reported by getPipelineLatency.  Returns
+    // false if the mode is not available.
+    bool         setPipelined(bool);
+    int          getPipelineLatency();
+
+    // Total latency in frames: the plugin's own, as last reported by
+    // the server, plus any pipeline latency
+    int          getLatency();
+
+    // How the process handshake waits in futex signalling mode (see
+    // ShmWaitPolicy), and how often spinning caught the other side
+    void         setWaitPolicy(ShmWaitPolicy);
+    void         getWaitStatistics(unsigned int &clientHits,
+				   unsigned int &clientMisses,
+				   unsigned int &serverHits,
+				   unsigned int &serverMisses);
+
     void         setDebugLevel(RemotePluginDebugLevel);
     bool         warn(std::string);
 
     void         showGUI(std::string guiData);
     void         hideGUI();
 
+    // Process ring statistics: transactions that had to be carried
+    // over an extra handshake because the ring was full, and ones
+    // dropped because they would not fit even in an empty ring
+    int          getRingSpillCount();
+    int          getRingOverflowCount();
+
     //Deryabin Andrew: vst chunks support
     std::vector<char> getVSTChunk();
-    void              setVSTChunk(std::vector<char> chunk);
+    void              setVSTChunk(const std::vector<char> &chunk);
     //Deryabin Andrew: vst chunks support: end code
 
+    // Whether chunks are compressed in transit (raw by default)
+    void              setChunkCodec(RemotePluginChunkCodec);
+
 protected:
     RemotePluginClient();
 
     void         cleanup();
     void         syncStartup();
 
+    // Override the DSSI_VST_SIGNAL choice; only before syncStartup
+    void         setSignalMode(ShmSignalMode);
+
 private:
     RemotePluginClient(const RemotePluginClient &); // not provided
     RemotePluginClient &operator=(const RemotePluginClient &); // not provided
@@ -95,12 +161,39 @@ private:
     char *m_shm;
     size_t m_shmSize;
     ShmControl *m_shmControl;
+    size_t m_shmControlSize;
 
     int m_bufferSize;
     int m_numInputs;
     int m_numOutputs;
 
+    int m_spinLimit;
+
+    unsigned long long m_bytesCopied;
+    unsigned long long m_bytesSaved;
+
+    bool m_pipelined;
+    int m_pipelineRegion;
+    bool m_pipelinePending;
+    int32_t m_pipelineSeq;
+
+    bool m_processStarted;
+    int32_t m_processSeq;
+    int m_outputRegion;
+    bool m_outputValid;
+
+    int m_chunkCodec;
+
+    ShmParameterTable *m_paramTable;
+    size_t m_paramTableSize;
+
     void sizeShm();
+    char *channelBuffer(int region, int channel);
+    int32_t signalServer();
+    void waitForSequence(int32_t);
+    void flushPipeline();
+    void createParameterTable(int count);
+    bool commitRing();
 };
 
 
@@ -8,6 +8,7 @@
 */
 
 #include "remotepluginserver.h"
+#include "paths.h"
 
 #include <sys/mman.h>
 #include <sys/types.h>
@@ -39,6 +40,11 @@ RemotePluginServer::RemotePluginServer(std::string fileIdentifiers) :
     m_shm(0),
     m_shmSize(0),
     m_shmControl(0),
+    m_shmControlSize(0),
+    m_runServerSeen(0),
+    m_spinLimit(RDWR_SPIN_MIN),
+    m_paramTable(0),
+    m_paramTableSize(0),
     m_inputs(0),
     m_outputs(0)
 {
@@ -48,19 +54,34 @@ RemotePluginServer::RemotePluginServer(std::string fileIdentifiers) :
 	    fileIdentifiers.substr(0, 6).c_str());
     m_controlRequestFileName = strdup(tmpFileBase);
 
-    if ((m_controlRequestFd = open(m_controlRequestFileName, O_RDONLY)) < 0) {
+    // Open the request FIFO without waiting for the client, so that
+    // it is already open by the time the client hears from us on the
+    // response FIFO below and can connect at once
+    if ((m_controlRequestFd = open(m_controlRequestFileName, O_RDONLY | O_NONBLOCK)) < 0) {
 	cleanup();
 	throw((std::string)"Failed to open FIFO");
     }
+    fcntl(m_controlRequestFd, F_SETFL,
+	  fcntl(m_controlRequestFd, F_GETFL) & ~O_NONBLOCK);
     
     sprintf(tmpFileBase, "/tmp/rplugin_crs_%s",
 	    fileIdentifiers.substr(6, 6).c_str());
     m_controlResponseFileName = strdup(tmpFileBase);
 
-    if ((m_controlResponseFd = open(m_controlResponseFileName, O_WRONLY)) < 0) {
-	cleanup();
-	throw((std::string)"Failed to open FIFO");
+    // The client opens its end of the response FIFO as soon as it has
+    // asked for us, but it may have died since.  Don't wait for it
+    // forever: a shared server would stop serving all its instances.
+    int attempts = 1000; // of 10 ms each
+    while ((m_controlResponseFd =
+	    open(m_controlResponseFileName, O_WRONLY | O_NONBLOCK)) < 0) {
+	if ((errno != ENXIO && errno != EINTR) || --attempts == 0) {
+	    cleanup();
+	    throw((std::string)"Failed to open FIFO");
+	}
+	usleep(10000);
     }
+    fcntl(m_controlResponseFd, F_SETFL,
+	  fcntl(m_controlResponseFd, F_GETFL) & ~O_NONBLOCK);
 
     bool b = false;
 
@@ -75,8 +96,18 @@ RemotePluginServer::RemotePluginServer(std::string fileIdentifiers) :
 	throw((std::string)"Failed to open or create shared memory file");
     }
 
-    m_shmControl = static_cast<ShmControl *>(mmap(0, sizeof(ShmControl), PROT_READ | PROT_WRITE, MAP_SHARED, m_shmControlFd, 0));
-    if (!m_shmControl) {
+    // Map the fixed part first to find out how big the client made
+    // the process ring, then map the whole thing
+    m_shmControlSize = sizeof(ShmControl);
+    m_shmControl = static_cast<ShmControl *>(mmap(0, m_shmControlSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_shmControlFd, 0));
+    if (m_shmControl != MAP_FAILED) {
+        size_t ringSize = m_shmControl->ringBuffer.size;
+        munmap(m_shmControl, m_shmControlSize);
+        m_shmControlSize = sizeof(ShmControl) + ringSize;
+        m_shmControl = static_cast<ShmControl *>(mmap(0, m_shmControlSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_shmControlFd, 0));
+    }
+    if (m_shmControl == MAP_FAILED) {
+        m_shmControl = 0;
         tryWrite(m_controlResponseFd, &b, sizeof(bool));
         cleanup();
         throw((std::string)"Failed to mmap shared memory file");
@@ -109,9 +140,13 @@ RemotePluginServer::cleanup()
 	m_shm = 0;
     }
     if (m_shmControl) {
-        munmap(m_shmControl, sizeof(ShmControl));
+        munmap(m_shmControl, m_shmControlSize);
         m_shmControl = 0;
     }
+    if (m_paramTable) {
+	munmap(m_paramTable, m_paramTableSize);
+	m_paramTable = 0;
+    }
     if (m_controlRequestFd >= 0) {
 	close(m_controlRequestFd);
 	m_controlRequestFd = -1;
@@ -157,18 +192,23 @@ RemotePluginServer::sizeShm()
 {
     if (m_numInputs < 0 || m_numOutputs < 0 || m_bufferSize < 0) return;
 
+    // The client sizes the segment, and it may hold one or two regions
+    // depending on whether it is pipelining; map whatever is there
+    struct stat st;
+    if (fstat(m_shmFd, &st) < 0 || st.st_size <= 0) return;
+    size_t sz = st.st_size;
+
     delete m_inputs;
     delete m_outputs;
     m_inputs = 0;
     m_outputs = 0;
 
-    size_t sz = (m_numInputs + m_numOutputs) * m_bufferSize * sizeof(float);
-
     if (m_shm) {
 	m_shm = (char *)mremap(m_shm, m_shmSize, sz, MREMAP_MAYMOVE);
     } else {
 	m_shm = (char *)mmap(0, sz, PROT_READ | PROT_WRITE, MAP_SHARED, m_shmFd, 0);
     }
+    if (m_shm == MAP_FAILED) m_shm = 0;
     if (!m_shm) {
 	std::cerr << "RemotePluginServer::sizeShm: ERROR: mmap or mremap for failed for " << sz
 		  << " bytes from fd " << m_shmFd << "!" << std::endl;
@@ -185,6 +225,118 @@ RemotePluginServer::sizeShm()
     }
 }    
 
+bool
+RemotePluginServer::mapParameterTable(std::string name, int count)
+{
+    if (m_paramTable || count <= 0 || count != getParameterCount()) {
+	return false;
+    }
+
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+	perror("RemotePluginServer: failed to open parameter table");
+	return false;
+    }
+    shm_unlink(name.c_str());
+
+    size_t sz = shmParameterTableSize(count);
+    ShmParameterTable *table = (ShmParameterTable *)
+	mmap(0, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (table == MAP_FAILED) {
+	perror("RemotePluginServer: failed to map parameter table");
+	return false;
+    }
+    if (table->count != count ||
+	table->queueSize != shmParameterQueueSize(count)) {
+	munmap(table, sz);
+	return false;
+    }
+
+    m_paramTableSize = sz;
+    __atomic_store_n(&m_paramTable, table, __ATOMIC_RELEASE);
+    publishParameters();
+    return true;
+}
+
+void
+RemotePluginServer::applyParameterTable()
+{
+    ShmParameterTable *table = __atomic_load_n(&m_paramTable, __ATOMIC_ACQUIRE);
+    if (!table) return;
+
+    ShmParameter *params = shmParameters(table);
+    int32_t *queue = shmParameterQueue(table);
+    uint32_t mask = table->queueSize - 1;
+    uint32_t tail = table->queueTail;
+    uint32_t head = __atomic_load_n(&table->queueHead, __ATOMIC_ACQUIRE);
+
+    while (tail != head) {
+	int p = queue[tail & mask];
+	++tail;
+	if (p < 0 || p >= table->count) continue;
+	// Clear the dirty flag before reading the value: a change the
+	// host makes after this either gets read here or queued again
+	__atomic_store_n(&params[p].dirty, 0, __ATOMIC_SEQ_CST);
+	float v;
+	__atomic_load(&params[p].hostValue, &v, __ATOMIC_ACQUIRE);
+	setParameter(p, v);
+	publishParameter(p, getParameter(p));
+    }
+
+    __atomic_store_n(&table->queueTail, tail, __ATOMIC_RELEASE);
+}
+
+void
+RemotePluginServer::publishParameter(int p, float v)
+{
+    ShmParameterTable *table = __atomic_load_n(&m_paramTable, __ATOMIC_ACQUIRE);
+    if (!table || p < 0 || p >= table->count) return;
+    __atomic_store(&shmParameters(table)[p].pluginValue, &v, __ATOMIC_RELEASE);
+}
+
+void
+RemotePluginServer::publishParameters()
+{
+    ShmParameterTable *table = __atomic_load_n(&m_paramTable, __ATOMIC_ACQUIRE);
+    if (!table) return;
+    for (int i = 0; i < table->count; ++i) {
+	publishParameter(i, getParameter(i));
+    }
+}
+
+void
+RemotePluginServer::publishLatency(int frames)
+{
+    if (!m_shmControl) return;
+    __atomic_store_n(&m_shmControl->latency, frames, __ATOMIC_RELEASE);
+}
+
+void
+RemotePluginServer::getMetadata(RemotePluginMetadata &md)
+{
+    md.name = getName();
+    md.maker = getMaker();
+    md.inputs = getInputCount();
+    md.outputs = getOutputCount();
+    md.flags = hasMIDIInput() ? RemotePluginMetadataHasMIDIInput : 0;
+
+    int n = getParameterCount();
+    md.parameterNames.clear();
+    md.parameterDefaults.clear();
+    for (int i = 0; i < n; ++i) {
+	md.parameterNames.push_back(getParameterName(i));
+	md.parameterDefaults.push_back(getParameterDefault(i));
+    }
+
+    n = getProgramCount();
+    md.programNames.clear();
+    for (int i = 0; i < n; ++i) {
+	md.programNames.push_back(getProgramName(i));
+    }
+}
+
 void
 RemotePluginServer::dispatchControl(int timeout)
 {
@@ -204,9 +356,35 @@ RemotePluginServer::dispatchControl(int timeout)
     }
 }
 
+bool
+RemotePluginServer::usesFutexSignal() const
+{
+    return m_shmControl && m_shmControl->signalMode == ShmSignalFutex;
+}
+
 void
 RemotePluginServer::dispatchProcess(int timeout)
 {
+    if (m_shmControl->signalMode == ShmSignalFutex) {
+
+	if (!rdwr_spinWait(&m_shmControl->runServer, m_runServerSeen,
+			   m_shmControl->waitPolicy, &m_spinLimit, timeout,
+			   &m_shmControl->serverWait)) {
+	    return; // timed out, nothing to do
+	}
+	m_runServerSeen = __atomic_load_n(&m_shmControl->runServer,
+					  __ATOMIC_ACQUIRE);
+
+	while (dataAvailable(&m_shmControl->ringBuffer)) {
+	    dispatchProcessEvents();
+	}
+
+	__atomic_store_n(&m_shmControl->runClient, m_runServerSeen,
+			 __ATOMIC_SEQ_CST);
+	rdwr_spinWake(&m_shmControl->runClient, &m_shmControl->clientWait);
+	return;
+    }
+
     char msg;
     if (read(m_shmControl->runServerRead, &msg, 1) != 1) {
         throw RemotePluginClosedException();
@@ -247,9 +425,19 @@ RemotePluginServer::dispatchProcessEvents()
 	    std::cerr << "ERROR: RemotePluginServer: output count must be tested before process" << std::endl;
 	    return;
 	}
-	if (!m_shm) {
+
+	int region = readInt(&m_shmControl->ringBuffer);
+	size_t blocksz = m_bufferSize * sizeof(float);
+	size_t regionsz = (m_numInputs + m_numOutputs) * blocksz;
+	char *base = 0;
+
+	if (region < 0 || region > 1) {
+	    std::cerr << "ERROR: RemotePluginServer: bad process region " << region << std::endl;
+	    return;
+	}
+	if (!m_shm || m_shmSize < (region + 1) * regionsz) {
 	    sizeShm();
-	    if (!m_shm) {
+	    if (!m_shm || m_shmSize < (region + 1) * regionsz) {
 		std::cerr << "ERROR: RemotePluginServer: no shared memory region available" << std::endl;
 		return;
 	    }
@@ -257,13 +445,15 @@ RemotePluginServer::dispatchProcessEvents()
 
 //	std::cerr << "server process: entering" << std::endl;
 
-	size_t blocksz = m_bufferSize * sizeof(float);
+	applyParameterTable();
+
+	base = m_shm + region * regionsz;
 
 	for (int i = 0; i < m_numInputs; ++i) {
-	    m_inputs[i] = (float *)(m_shm + i * blocksz);
+	    m_inputs[i] = (float *)(base + i * blocksz);
 	}
 	for (int i = 0; i < m_numOutputs; ++i) {
-	    m_outputs[i] = (float *)(m_shm + (i + m_numInputs) * blocksz);
+	    m_outputs[i] = (float *)(base + (i + m_numInputs) * blocksz);
 	}
 
 	process(m_inputs, m_outputs);
@@ -279,19 +469,30 @@ RemotePluginServer::dispatchProcessEvents()
 	break;
     }
 
+    case RemotePluginSetParameterAt:
+    {
+        int pn(readInt(&m_shmControl->ringBuffer));
+        float v(readFloat(&m_shmControl->ringBuffer));
+        setParameterAt(pn, v, readInt(&m_shmControl->ringBuffer));
+	break;
+    }
+
     case RemotePluginSetCurrentProgram:
+	// Parameter changes the host made before the program change
+	// must not land after it and override the program's values
+	applyParameterTable();
 	setCurrentProgram(readInt(&m_shmControl->ringBuffer));
+	publishParameters();
 	break;
 
     case RemotePluginSendMIDIData:
     {
-	int events = 0;
-	int *frameoffsets = 0;
-	unsigned char *data = readMIDIData(&m_shmControl->ringBuffer, &frameoffsets, events);
-	if (events && data && frameoffsets) {
+	int events = readMIDIData(&m_shmControl->ringBuffer, m_midiData,
+				  m_midiFrameOffsets);
+	if (events) {
 //    std::cerr << "RemotePluginServer::sendMIDIData(" << events << ")" << std::endl;
 
-	    sendMIDIData(data, frameoffsets, events);
+	    sendMIDIData(m_midiData, m_midiFrameOffsets, events);
 	}
 	break;
     }
@@ -301,12 +502,19 @@ RemotePluginServer::dispatchProcessEvents()
 	int newSize = readInt(&m_shmControl->ringBuffer);
 	setBufferSize(newSize);
 	m_bufferSize = newSize;
+	// the client has resized the segment, so the old mapping may no
+	// longer cover it
+	if (m_shm) sizeShm();
 	break;
     }
 
     case RemotePluginSetSampleRate:
 	setSampleRate(readInt(&m_shmControl->ringBuffer));
 	break;
+
+    case RemotePluginSetOffline:
+	setOffline(readInt(&m_shmControl->ringBuffer) != 0);
+	break;
     
     default:
 	std::cerr << "WARNING: RemotePluginServer::dispatchProcessEvents: unexpected opcode "
@@ -318,7 +526,6 @@ void
 RemotePluginServer::dispatchControlEvents()
 {    
     RemotePluginOpcode opcode = RemotePluginNoOpcode;
-    static float *parameterBuffer = 0;
 
     tryRead(m_controlRequestFd, &opcode, sizeof(RemotePluginOpcode));
 
@@ -340,6 +547,16 @@ RemotePluginServer::dispatchControlEvents()
 	terminate();
 	break;
     
+    case RemotePluginGetMetadata:
+    {
+	RemotePluginMetadata md;
+	getMetadata(md);
+	m_numInputs = md.inputs;
+	m_numOutputs = md.outputs;
+	writeMetadata(m_controlResponseFd, md);
+	break;
+    }
+
     case RemotePluginGetInputCount:
 	m_numInputs = getInputCount();
 	writeInt(m_controlResponseFd, m_numInputs);
@@ -368,13 +585,34 @@ RemotePluginServer::dispatchControlEvents()
 
     case RemotePluginGetParameters:
     {
-	if (!parameterBuffer) {
-	    parameterBuffer = new float[getParameterCount()];
-	}
 	int p0 = readInt(m_controlRequestFd);
 	int pn = readInt(m_controlRequestFd);
-	getParameters(p0, pn, parameterBuffer);
-	tryWrite(m_controlResponseFd, parameterBuffer, (pn - p0 + 1) * sizeof(float));
+	if (pn < p0) break;
+
+	// The client waits for pn - p0 + 1 values whatever happens, so
+	// any outside the plugin's range are sent as zero
+	m_parameterBuffer.assign(pn - p0 + 1, 0.0f);
+	int first = p0, last = pn;
+	if (first < 0) first = 0;
+	if (last >= getParameterCount()) last = getParameterCount() - 1;
+	if (first != p0 || last != pn) {
+	    std::cerr << "WARNING: RemotePluginServer: parameters " << p0
+		      << " to " << pn << " requested, but plugin has "
+		      << getParameterCount() << std::endl;
+	}
+	if (first <= last) {
+	    getParameters(first, last, &m_parameterBuffer[first - p0]);
+	}
+	tryWrite(m_controlResponseFd, &m_parameterBuffer[0],
+		 m_parameterBuffer.size() * sizeof(float));
+	break;
+    }
+
+    case RemotePluginSetParameterTable:
+    {
+	std::string name = readString(m_controlRequestFd);
+	int count = readInt(m_controlRequestFd);
+	writeInt(m_controlResponseFd, mapParameterTable(name, count) ? 1 : 0);
 	break;
     }
 
@@ -432,15 +670,32 @@ RemotePluginServer::dispatchControlEvents()
     //Deryabin Andrew: vst chunks support
     case RemotePluginGetVSTChunk:
     {
+	int codec = readInt(m_controlRequestFd);
         std::vector<char> chunk = getVSTChunk();
-        writeRaw(m_controlResponseFd, chunk);
+	char name[] = "/dssi-vst-rplugin_chk_XXXXXX";
+	int fd = shm_mkstemp(name);
+	if (fd < 0) {
+	    perror("RemotePluginServer: failed to create chunk segment");
+	    throw RemotePluginClosedException();
+	}
+	try {
+	    writeChunk(m_controlResponseFd, fd, name, chunk, codec);
+	} catch (RemotePluginClosedException) {
+	    close(fd);
+	    shm_unlink(name);
+	    throw;
+	}
+	close(fd);
         break;
     }
 
     case RemotePluginSetVSTChunk:
     {
-        std::vector<char> chunk = readRaw(m_controlRequestFd);
-        setVSTChunk(chunk);
+        std::vector<char> chunk;
+	bool ok = readChunk(m_controlRequestFd, chunk);
+	if (ok) ok = setVSTChunk(chunk);
+	if (ok) publishParameters();
+	writeInt(m_controlResponseFd, ok ? 1 : 0);
         break;
     }
     //Deryabin Andrew: vst chunks support: end code
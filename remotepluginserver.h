@@ -28,6 +28,7 @@ public:
 
     virtual void         setBufferSize(int) = 0;
     virtual void         setSampleRate(int) = 0;
+    virtual void         setOffline(bool)                     { return; }
 
     virtual void         reset() = 0;
     virtual void         terminate() = 0;
@@ -38,6 +39,11 @@ public:
     virtual int          getParameterCount()                  { return 0; }
     virtual std::string  getParameterName(int)                { return ""; }
     virtual void         setParameter(int, float)             { return; }
+    // As setParameter, but to take effect at the given frame of the
+    // next process block.  Default ignores the timing.
+    virtual void         setParameterAt(int p, float v, int frame) {
+	setParameter(p, v);
+    }
     virtual float        getParameter(int)                    { return 0.0f; }
     virtual float        getParameterDefault(int)             { return 0.0f; }
     virtual void         getParameters(int p0, int pn, float *v) {
@@ -55,6 +61,9 @@ public:
 
     virtual void         process(float **inputs, float **outputs) = 0;
 
+    // Default builds the answer from the individual getters above
+    virtual void         getMetadata(RemotePluginMetadata &);
+
     virtual void         setDebugLevel(RemotePluginDebugLevel) { return; } 
     virtual bool         warn(std::string) = 0;
 
@@ -63,12 +72,28 @@ public:
 
     //Deryabin Andrew: vst chunks support
     virtual std::vector<char> getVSTChunk() = 0;
-    virtual bool setVSTChunk(std::vector<char>) = 0;
+    virtual bool setVSTChunk(const std::vector<char> &) = 0;
     //Deryabin Andrew: vst chunks support: end code
 
+    // Make a plugin-side parameter value visible to the client without
+    // a round trip (no-op if the client has no parameter table)
+    void publishParameter(int p, float v);
+    void publishParameters();
+
+    // Report the plugin's processing latency (in frames) to the client
+    void publishLatency(int frames);
+
     void dispatchControl(int timeout = -1); // may throw RemotePluginClosedException
     void dispatchProcess(int timeout = -1); // may throw RemotePluginClosedException
 
+    // For servers hosting several instances, which poll the control
+    // fds themselves before calling dispatchControl(0)
+    int          getControlFd() const { return m_controlRequestFd; }
+
+    // Whether the client wakes us through the shared-memory counters
+    // rather than pipes inherited from it
+    bool         usesFutexSignal() const;
+
 protected:
     RemotePluginServer(std::string fileIdentifiers);
 
@@ -98,13 +123,26 @@ private:
     char *m_shm;
     size_t m_shmSize;
     ShmControl *m_shmControl;
+    size_t m_shmControlSize;
+    int32_t m_runServerSeen;
+    int m_spinLimit;
+
+    ShmParameterTable *m_paramTable;
+    size_t m_paramTableSize;
 
     float **m_inputs;
     float **m_outputs;
 
+    // Per instance, as a shared server runs each in its own thread
+    unsigned char m_midiData[MIDI_BUFFER_SIZE * 3];
+    int m_midiFrameOffsets[MIDI_BUFFER_SIZE];
+    std::vector<float> m_parameterBuffer;
+
     RemotePluginDebugLevel m_debugLevel;
 
     void sizeShm();
+    bool mapParameterTable(std::string name, int count);
+    void applyParameterTable();
 };
 
 #endif
@@ -19,12 +19,22 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/file.h>
 #include <errno.h>
 #include <cstdio>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <set>
 
 #include "rdwrops.h"
 #include "paths.h"
+#include "pluginindex.h"
+
+// Seconds to allow a newly started server pool to come up before
+// deciding it needs filling again
+static const int poolRefillInterval = 10;
 
 RemoteVSTClient::RemoteVSTClient(std::string dllName, bool showGUI) :
     RemotePluginClient()
@@ -47,6 +57,7 @@ RemoteVSTClient::RemoteVSTClient(std::string dllName, bool showGUI) :
     bool found = false;
 
     std::string sought;
+    std::string serverPath;
 
     for (size_t i = 0; i < dssiPath.size(); ++i) {
 
@@ -76,33 +87,200 @@ RemoteVSTClient::RemoteVSTClient(std::string dllName, bool showGUI) :
 	}
 
 	found = true;
+	serverPath = fileName;
+	break;
+    }
+
+    if (!found) {
+	cleanup();
+	throw(std::string("Failed to find dssi-vst-server.exe [tried:" +
+			  sought + "]"));
+    }
 
-	std::cerr << "RemoteVSTClient: executing "
-		  << fileName << " " << argStr << std::endl;
+    char *shared = getenv("DSSI_VST_SHARED_SERVER");
+    char *pool = getenv("DSSI_VST_SERVER_POOL");
+    int poolSize = (pool ? atoi(pool) : 0);
 
-        const char* fileNameStr = fileName.c_str();
-        if ((child = vfork()) < 0) {
+    if ((shared && *shared && strcmp(shared, "0")) || poolSize > 0) {
+	if (arg.length() >= (size_t)RemotePluginServerRequestSize) {
 	    cleanup();
-	    throw((std::string)"Fork failed");
-	} else if (child == 0) { // child process
+	    throw((std::string)"Request too long for plugin server");
+	}
+	// Shared and pooled servers can't inherit our run pipes
+	setSignalMode(ShmSignalFutex);
+    }
+
+    if (shared && *shared && strcmp(shared, "0")) {
+	requestSharedServer(serverPath, arg);
+	syncStartup();
+	return;
+    }
+
+    if (poolSize > 0 && requestPooledServer(serverPath, arg, poolSize)) {
+	syncStartup();
+	return;
+    }
+
+    std::cerr << "RemoteVSTClient: executing "
+	      << serverPath << " " << argStr << std::endl;
+
+    const char* fileNameStr = serverPath.c_str();
+    if ((child = vfork()) < 0) {
+	cleanup();
+	throw((std::string)"Fork failed");
+    } else if (child == 0) { // child process
+	if (execlp(fileNameStr, fileNameStr, argStr, NULL)) {
+	    // vfork() docs say you shouldn't call a function here,
+	    // but it seems to work for me.
+	    perror("Exec failed");
+	    _exit(1);
+	}
+    }
+
+    syncStartup();
+}
+
+void
+RemoteVSTClient::startDetachedServer(std::string serverPath, std::string arg)
+{
+    std::cerr << "RemoteVSTClient: executing "
+	      << serverPath << " " << arg << std::endl;
+
+    const char *fileNameStr = serverPath.c_str();
+    const char *argStr = arg.c_str();
+    long maxFd = sysconf(_SC_OPEN_MAX);
+
+    // Fork twice so that the server, which may outlive us, is not
+    // left as our child, and give it its own session so it doesn't
+    // get the host's terminal signals
+    pid_t child;
+    if ((child = fork()) < 0) {
+	cleanup();
+	throw((std::string)"Fork failed");
+    } else if (child == 0) { // child process
+	if (fork() == 0) {
+	    setsid();
+	    // Don't let it hold on to our files either, in particular
+	    // other instances' FIFOs
+	    for (long i = 3; i < maxFd; ++i) close(i);
 	    if (execlp(fileNameStr, fileNameStr, argStr, NULL)) {
-                // vfork() docs say you shouldn't call a function here,
-                // but it seems to work for me.
 		perror("Exec failed");
-		_exit(1);
 	    }
 	}
+	_exit(0);
+    }
 
-	break;
+    waitpid(child, NULL, 0);
+}
+
+static bool
+writeRequest(const char *fifoFile, std::string request)
+{
+    // A record no bigger than PIPE_BUF is written atomically, so
+    // requests from several hosts can't interleave
+    char record[RemotePluginServerRequestSize];
+    memset(record, 0, sizeof(record));
+    strncpy(record, request.c_str(), sizeof(record) - 1);
+
+    int fd = open(fifoFile, O_WRONLY | O_NONBLOCK | O_NOFOLLOW);
+    if (fd < 0) return false;
+
+    // The FIFO's name is predictable, so make sure it is ours before
+    // telling whoever reads it the names of our FIFOs and shm
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISFIFO(st.st_mode) || st.st_uid != getuid()) {
+	close(fd);
+	std::cerr << "RemoteVSTClient: " << fifoFile
+		  << " is not a FIFO belonging to this user" << std::endl;
+	errno = EPERM;
+	return false;
     }
 
-    if (!found) {
-	cleanup();
-	throw(std::string("Failed to find dssi-vst-server.exe [tried:" +
-			  sought + "]"));
-    } else {
-	syncStartup();
+    ssize_t w = write(fd, record, sizeof(record));
+    close(fd);
+
+    if (w != (ssize_t)sizeof(record)) {
+	perror(fifoFile);
+	errno = EIO;
+	return false;
+    }
+    return true;
+}
+
+void
+RemoteVSTClient::requestSharedServer(std::string serverPath, std::string request)
+{
+    // One server per user, found through a FIFO that has a reader
+    // only while the server is running.  If nobody is listening,
+    // start a server and keep trying while it comes up.
+
+    char fifoFile[60];
+    sprintf(fifoFile, "/tmp/dssi-vst-server-%d", (int)getuid());
+
+    bool started = false;
+    int timeout = 400; // tenths of a second
+
+    for (int attempt = 0; attempt < timeout; ++attempt) {
+
+	if (writeRequest(fifoFile, request)) return;
+
+	if (errno != ENXIO && errno != ENOENT) {
+	    // an actual error occurred
+	    perror(fifoFile);
+	    break;
+	}
+
+	if (!started) {
+	    startDetachedServer(serverPath, std::string("-s ") + fifoFile);
+	    started = true;
+	}
+
+	usleep(100000);
     }
+
+    cleanup();
+    throw((std::string)"Failed to contact shared plugin server");
+}
+
+bool
+RemoteVSTClient::requestPooledServer(std::string serverPath, std::string request,
+				     int poolSize)
+{
+    // Idle pooled servers all wait on the one FIFO, and whichever
+    // reads a request first serves it.  The FIFO has no reader when
+    // none is waiting, in which case the caller starts a server of
+    // its own as usual.
+
+    char fifoFile[60];
+    sprintf(fifoFile, "/tmp/dssi-vst-pool-%d", (int)getuid());
+    std::string arg = std::string("-p ") + fifoFile;
+
+    if (writeRequest(fifoFile, request)) {
+	std::cerr << "RemoteVSTClient: using pooled server" << std::endl;
+	// Replace the server we've just taken
+	startDetachedServer(serverPath, arg);
+	return true;
+    }
+
+    // Pooled servers couldn't listen on a FIFO that isn't ours either
+    if (errno != ENXIO && errno != ENOENT) {
+	perror(fifoFile);
+	return false;
+    }
+
+    // Fill the pool for next time, unless we did so recently enough
+    // that the servers may still be starting up
+    static time_t lastFilled = 0;
+    time_t now = time(0);
+
+    if (now - lastFilled >= poolRefillInterval) {
+	lastFilled = now;
+	for (int i = 0; i < poolSize; ++i) {
+	    startDetachedServer(serverPath, arg);
+	}
+    }
+
+    return false;
 }
 
 RemoteVSTClient::~RemoteVSTClient()
@@ -168,32 +346,455 @@ RemoteVSTClient::addFromFd(int fd, PluginRecord &rec)
     return true;
 }
     
-void
-RemoteVSTClient::queryPlugins(std::vector<PluginRecord> &plugins)
+// We want to run the dssi-vst-scanner script, which runs wine
+// dssi-vst-scanner.exe.so, or the dssi-vst-indexer program.  We
+// expect to find these in the same subdirectory of a directory in the
+// DSSI_PATH as a host would look for the GUI for this plugin: one
+// called dssi-vst.  See also the RemoteVSTClient constructor above.
+static std::string
+findHelper(std::string name)
 {
-    // First check whether there are any DLLs in the same VST path as
-    // the scanner uses.  If not, we know immediately there are no
-    // plugins and we don't need to run the (Wine-based) scanner.
-    // If there are, but they all have up-to-date cache files, then
-    // we can just read those and again not have to run the scanner.
-    
-    std::vector<std::string> vstPath = Paths::getPath
-	("VST_PATH", "/usr/local/lib/vst:/usr/lib/vst", "/vst");
+    std::vector<std::string> dssiPath = Paths::getPath
+	("DSSI_PATH", "/usr/local/lib/dssi:/usr/lib/dssi", "/.dssi");
 
-    bool haveDll = false;
-    bool haveAllCaches = false;
-    bool haveCacheDir = false;
-    int version = int(RemotePluginVersion * 1000);
+    std::string sought;
 
-    char *home = getenv("HOME");
-    std::string cacheDir = std::string(home) + "/.dssi-vst";
-    DIR *test = opendir(cacheDir.c_str());
-    if (test) {
-	haveCacheDir = true;
-	haveAllCaches = true; // until proven otherwise
-	closedir(test);
+    for (size_t i = 0; i < dssiPath.size(); ++i) {
+
+	std::string subDir = dssiPath[i] + "/dssi-vst";
+	std::string fileName = subDir + "/" + name;
+
+	DIR *directory = opendir(subDir.c_str());
+	if (!directory) {
+	    sought += " " + fileName;
+	    continue;
+	}
+	closedir(directory);
+
+	struct stat st;
+
+	if (stat(fileName.c_str(), &st)) {
+	    sought += " " + fileName;
+	    continue;
+	}
+
+	if (!(S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) ||
+	    !(st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))) {
+	    sought += " " + fileName;
+	    std::cerr << "RemoteVSTClient: file " << fileName
+		      << " exists but can't be executed" << std::endl;
+	    continue;
+	}
+
+	return fileName;
     }
 
+    throw(std::string("Failed to find " + name + " [tried:" +
+		      sought + "]"));
+}
+
+static std::string
+findScanner()
+{
+    return findHelper("dssi-vst-scanner.exe");
+}
+
+static std::string
+cacheFileFor(std::string cacheDir, std::string dllPath)
+{
+    return cacheDir + "/" + dllPath.substr(dllPath.rfind('/') + 1) + ".cache";
+}
+
+// Read the header from the start of a cache file, returning true if
+// it is for this DLL as it is now
+static bool
+readCacheHeader(int fd, const PluginIndex::Dll &dll)
+{
+    DllStamp cached;
+    std::string cachedPath;
+
+    return (parseCacheHeader(fd, int(RemotePluginVersion * 1000),
+			     cached, cachedPath) &&
+	    cachedPath == dll.path &&
+	    isSameDll(cached, dll.stamp));
+}
+
+static bool
+haveValidCache(std::string cacheFileName, const PluginIndex::Dll &dll)
+{
+    int fd = open(cacheFileName.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    bool valid = readCacheHeader(fd, dll);
+    close(fd);
+    return valid;
+}
+
+// A cache file with no plugin record in it, as the scanner writes for
+// a DLL with no usable plugin, stops the DLL being scanned again
+// until it changes
+static void
+blacklistDll(std::string cacheFileName, const PluginIndex::Dll &dll)
+{
+    std::string tmpFileName = cacheFileName + ".tmp";
+    int fd = open(tmpFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+	perror(tmpFileName.c_str());
+	return;
+    }
+
+    std::vector<char> header;
+    appendCacheHeader(header, int(RemotePluginVersion * 1000),
+		      dll.stamp, dll.path);
+    bool ok = (write(fd, &header[0], header.size()) == (ssize_t)header.size());
+    close(fd);
+
+    if (!ok || rename(tmpFileName.c_str(), cacheFileName.c_str())) {
+	perror(cacheFileName.c_str());
+	unlink(tmpFileName.c_str());
+    }
+}
+
+// Remove the temporary files ("<cache file>.tmp<pid>") that a scanner
+// killed or crashed while scanning a DLL left behind for it
+static void
+removeScannerTempFiles(std::string cacheFileName)
+{
+    std::string::size_type slash = cacheFileName.rfind('/');
+    std::string dir = cacheFileName.substr(0, slash);
+    std::string prefix = cacheFileName.substr(slash + 1) + ".tmp";
+
+    DIR *directory = opendir(dir.c_str());
+    if (!directory) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(directory))) {
+	std::string fileName = entry->d_name;
+	if (fileName.length() > prefix.length() &&
+	    fileName.compare(0, prefix.length(), prefix) == 0 &&
+	    fileName.find_first_not_of("0123456789", prefix.length()) ==
+	    std::string::npos) {
+	    unlink((dir + "/" + fileName).c_str());
+	}
+    }
+
+    closedir(directory);
+}
+
+// One scanner process working through its share of the DLLs
+struct ScanJob {
+    std::vector<PluginIndex::Dll> dlls;
+    size_t next; // first DLL without a cache file yet
+    pid_t pid;
+    std::string jobFile;
+    time_t lastProgress;
+};
+
+static bool
+startScanJob(std::string scanner, ScanJob &job)
+{
+    char jobFile[60];
+    sprintf(jobFile, "/tmp/dssi-vst-scan-XXXXXX");
+
+    int fd = mkstemp(jobFile);
+    if (fd < 0) {
+	perror("Failed to create scanner job list");
+	return false;
+    }
+
+    std::string list;
+    for (size_t i = job.next; i < job.dlls.size(); ++i) {
+	list += job.dlls[i].path + "\n";
+    }
+    bool ok = (write(fd, list.c_str(), list.length()) == (ssize_t)list.length());
+    close(fd);
+
+    const char *scannerStr = scanner.c_str();
+    long maxFd = sysconf(_SC_OPEN_MAX);
+
+    pid_t child;
+    if (!ok || (child = fork()) < 0) {
+	perror("Failed to start scanner");
+	unlink(jobFile);
+	return false;
+    } else if (child == 0) { // child process
+	// In a group of its own, so that we can kill whatever Wine
+	// starts for it as well, and with nothing of ours open
+	setpgid(0, 0);
+	for (long i = 3; i < maxFd; ++i) close(i);
+	execlp(scannerStr, scannerStr, "-j", jobFile, NULL);
+	perror("Exec failed");
+	_exit(1);
+    }
+
+    setpgid(child, child);
+    job.pid = child;
+    job.jobFile = jobFile;
+    job.lastProgress = time(0);
+    return true;
+}
+
+static void
+finishScanJob(ScanJob &job)
+{
+    unlink(job.jobFile.c_str());
+    job.pid = 0;
+}
+
+// Bring the cache files for the given DLLs up to date by sharing
+// them out between several scanners (DSSI_VST_SCAN_JOBS, by default
+// one per CPU).  A scanner that makes no progress for
+// DSSI_VST_SCAN_TIMEOUT seconds is killed; the DLL it was stuck on,
+// or had crashed on, is blacklisted, and a new scanner carries on
+// with the rest of its share.
+static void
+scanToCache(const std::vector<PluginIndex::Dll> &dlls, std::string cacheDir)
+{
+    std::string scanner = findScanner();
+
+    int jobCount = sysconf(_SC_NPROCESSORS_ONLN);
+    char *env = getenv("DSSI_VST_SCAN_JOBS");
+    if (env && atoi(env) > 0) jobCount = atoi(env);
+    if (jobCount > (int)dlls.size()) jobCount = dlls.size();
+    if (jobCount < 1) jobCount = 1;
+
+    int timeout = 40;
+    env = getenv("DSSI_VST_SCAN_TIMEOUT");
+    if (env && atoi(env) > 0) timeout = atoi(env);
+
+    std::vector<ScanJob> jobs(jobCount);
+    for (size_t i = 0; i < dlls.size(); ++i) {
+	jobs[i % jobCount].dlls.push_back(dlls[i]);
+    }
+
+    std::cerr << "RemoteVSTClient: scanning " << dlls.size()
+	      << " DLL(s) with " << jobCount << " scanner(s)" << std::endl;
+
+    int running = 0;
+    for (int j = 0; j < jobCount; ++j) {
+	jobs[j].next = 0;
+	jobs[j].pid = 0;
+	if (startScanJob(scanner, jobs[j])) ++running;
+    }
+
+    while (running > 0) {
+
+	usleep(100000);
+	time_t now = time(0);
+
+	for (int j = 0; j < jobCount; ++j) {
+
+	    ScanJob &job = jobs[j];
+	    if (!job.pid) continue;
+
+	    // Check for exit first, so that any cache file written
+	    // before the scanner exited is seen below
+	    bool exited = (waitpid(job.pid, NULL, WNOHANG) == job.pid);
+
+	    while (job.next < job.dlls.size() &&
+		   haveValidCache(cacheFileFor(cacheDir, job.dlls[job.next].path),
+				  job.dlls[job.next])) {
+		++job.next;
+		job.lastProgress = now;
+	    }
+
+	    if (!exited) {
+		if (now - job.lastProgress < timeout) continue;
+		kill(-job.pid, SIGKILL);
+		waitpid(job.pid, NULL, 0);
+		if (job.next < job.dlls.size()) {
+		    std::cerr << "RemoteVSTClient: scanner timed out on "
+			      << job.dlls[job.next].path << std::endl;
+		}
+	    } else if (job.next < job.dlls.size()) {
+		std::cerr << "RemoteVSTClient: scanner failed on "
+			  << job.dlls[job.next].path << std::endl;
+	    }
+
+	    finishScanJob(job);
+
+	    if (job.next < job.dlls.size()) {
+		std::string cacheFileName =
+		    cacheFileFor(cacheDir, job.dlls[job.next].path);
+		std::cerr << "RemoteVSTClient: ignoring it from now on (remove "
+			  << cacheFileName << " to try again)" << std::endl;
+		removeScannerTempFiles(cacheFileName);
+		blacklistDll(cacheFileName, job.dlls[job.next]);
+		++job.next;
+		if (job.next < job.dlls.size() && startScanJob(scanner, job)) {
+		    continue;
+		}
+	    }
+
+	    --running;
+	}
+    }
+}
+
+// Remove the cache files of DLLs that have gone.  Other hosts may use
+// another VST path, so a cache file for a DLL outside ours is only
+// removed if the DLL it was made from is missing from a directory
+// that is still there; that of a DLL on an unmounted drive is kept.
+static void
+removeStaleCaches(std::string cacheDir, const std::set<std::string> &libnames)
+{
+    DIR *directory = opendir(cacheDir.c_str());
+    if (!directory) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(directory))) {
+
+	std::string fileName = entry->d_name;
+	size_t n = fileName.length();
+
+	if (n <= 6 || fileName.substr(n - 6) != ".cache" ||
+	    libnames.find(fileName.substr(0, n - 6)) != libnames.end()) {
+	    continue;
+	}
+
+	// Files of another version are left for that version to use
+	std::string cacheFileName = cacheDir + "/" + fileName;
+	int fd = open(cacheFileName.c_str(), O_RDONLY);
+	if (fd < 0) continue;
+	DllStamp stamp;
+	std::string dllPath;
+	bool parsed = parseCacheHeader(fd, int(RemotePluginVersion * 1000),
+				       stamp, dllPath);
+	close(fd);
+	if (!parsed) continue;
+
+	struct stat st;
+	std::string dllDir = dllPath.substr(0, dllPath.rfind('/') + 1);
+	if (!stat(dllPath.c_str(), &st) || errno != ENOENT ||
+	    dllDir == "" || stat(dllDir.c_str(), &st) || !S_ISDIR(st.st_mode)) {
+	    continue;
+	}
+
+	std::cerr << "RemoteVSTClient: removing cache file for missing DLL "
+		  << dllPath << std::endl;
+	unlink(cacheFileName.c_str());
+    }
+
+    closedir(directory);
+}
+
+static bool
+indexMatches(const PluginIndex &index, const std::vector<PluginIndex::Dll> &dlls)
+{
+    if (index.getDllCount() != (int)dlls.size()) return false;
+
+    for (size_t i = 0; i < dlls.size(); ++i) {
+	if (dlls[i].path != index.getDllPath(i) ||
+	    !isSameDll(index.getDllStamp(i), dlls[i].stamp)) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+// Build an index from the cache files of the given DLLs.  A DLL
+// without a valid cache file goes into the index with no stamp, so
+// that the index won't match it next time and it is tried again.
+static std::vector<char>
+indexFromCaches(std::string cacheDir, std::vector<PluginIndex::Dll> dlls)
+{
+    std::vector<RemoteVSTClient::PluginRecord> plugins;
+
+    for (size_t i = 0; i < dlls.size(); ++i) {
+
+	std::string cacheFileName = cacheFileFor(cacheDir, dlls[i].path);
+	int fd = -1;
+
+	if ((fd = open(cacheFileName.c_str(), O_RDONLY)) < 0) {
+	    memset(&dlls[i].stamp, 0, sizeof(DllStamp));
+	    continue;
+	}
+	if (!readCacheHeader(fd, dlls[i])) {
+	    memset(&dlls[i].stamp, 0, sizeof(DllStamp));
+	    close(fd);
+	    continue;
+	}
+
+	RemoteVSTClient::PluginRecord rec;
+	try {
+	    if (RemoteVSTClient::addFromFd(fd, rec)) {
+		plugins.push_back(rec);
+	    }
+	} catch (RemotePluginClosedException) {
+	    std::cerr << "RemoteVSTClient: truncated cache file "
+		      << cacheFileName << std::endl;
+	}
+
+	close(fd);
+    }
+
+    return PluginIndex::build(dlls, plugins);
+}
+
+// Start dssi-vst-indexer, detached, to bring the index up to date so
+// that the host's plugin discovery isn't held up: the new index is
+// picked up the next time the host starts.
+static void
+rescanInBackground()
+{
+    std::string indexer;
+    try {
+	indexer = findHelper("dssi-vst-indexer");
+    } catch (std::string error) {
+	std::cerr << "RemoteVSTClient: " << error << std::endl;
+	return;
+    }
+
+    std::cerr << "RemoteVSTClient: updating plugin index in the background; "
+	      << "new plugins will appear when the host is next started"
+	      << std::endl;
+
+    const char *indexerStr = indexer.c_str();
+    long maxFd = sysconf(_SC_OPEN_MAX);
+    sigset_t signals;
+    sigemptyset(&signals);
+
+    pid_t child;
+    if ((child = fork()) < 0) {
+	perror("Failed to start background scan");
+	return;
+    } else if (child > 0) {
+	waitpid(child, NULL, 0);
+	return;
+    }
+
+    // The host may have other threads, which could have held any lock
+    // when we forked, so only async-signal-safe calls from here to the
+    // exec.  The intermediate child exits at once, so that the indexer
+    // is reparented and the host never has to reap it.
+    if (fork() != 0) _exit(0);
+
+    setsid();
+    signal(SIGCHLD, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &signals, 0);
+
+    int nullfd = open("/dev/null", O_RDWR);
+    if (nullfd >= 0) {
+	dup2(nullfd, 0);
+	dup2(nullfd, 1);
+    }
+
+    // Don't keep the host's audio devices, sockets and FIFOs open for
+    // as long as the scan takes
+    for (long i = 3; i < maxFd; ++i) close(i);
+
+    execl(indexerStr, indexerStr, (char *)0);
+    _exit(1);
+}
+
+// Find the DLLs in the VST path, as the scanner does.  Only the first
+// DLL of a given name is used, as that's all the cache can tell apart.
+static void
+findDlls(std::vector<PluginIndex::Dll> &dlls, std::set<std::string> &libnames)
+{
+    std::vector<std::string> vstPath = Paths::getPath
+	("VST_PATH", "/usr/local/lib/vst:/usr/lib/vst", "/vst");
+
     for (size_t i = 0; i < vstPath.size(); ++i) {
 	
 	std::string vstDir = vstPath[i];
@@ -201,6 +802,8 @@ RemoteVSTClient::queryPlugins(std::vector<PluginRecord> &plugins)
 	if (!directory) continue;
 	struct dirent *entry;
 
+	if (vstDir[vstDir.length()-1] != '/') vstDir += "/";
+
 	while ((entry = readdir(directory))) {
 	    
 	    std::string libname = entry->d_name;
@@ -208,83 +811,141 @@ RemoteVSTClient::queryPlugins(std::vector<PluginRecord> &plugins)
 	    if (libname[0] != '.' &&
 		libname.length() >= 5 &&
 		(libname.substr(libname.length() - 4) == ".dll" ||
-		 libname.substr(libname.length() - 4) == ".DLL")) {
-
-		haveDll = true;
-		if (!haveCacheDir) break;
-
-		if (haveAllCaches) {
-
-		    std::string cacheFileName = cacheDir + "/" + libname + ".cache";
-		    struct stat st;
-
-		    if (stat(cacheFileName.c_str(), &st)) {
-			haveAllCaches = false;
-		    } else {
-			int testfd = open(cacheFileName.c_str(), O_RDONLY);
-			int testVersion = 0;
-			if (testfd < 0 || 
-			    read(testfd, &testVersion, sizeof(int)) != sizeof(int) ||
-			    testVersion != version) {
-			    haveAllCaches = false;
-			}
-			if (testfd >= 0) close(testfd);
-		    }
-		}
+		 libname.substr(libname.length() - 4) == ".DLL") &&
+		libnames.find(libname) == libnames.end()) {
+		PluginIndex::Dll dll;
+		dll.path = vstDir + libname;
+		if (!getDllStamp(dll.path, dll.stamp)) continue;
+		libnames.insert(libname);
+		dlls.push_back(dll);
 	    }
 	}
 
 	closedir(directory);
-	if (haveDll && !haveAllCaches) break;
     }
+}
 
-    if (!haveDll) return;
+// ~/.dssi-vst, created if need be, or empty if it can't be
+static std::string
+getCacheDir()
+{
+    char *home = getenv("HOME");
+    if (!home) return "";
 
-    if (haveCacheDir && haveAllCaches) {
-	
-	std::cerr << "RemoteVSTClient: all cache files are up-to-date, "
-		  << "not running scanner" << std::endl;
+    std::string cacheDir = std::string(home) + "/.dssi-vst";
+    DIR *test = opendir(cacheDir.c_str());
+    if (test) {
+	closedir(test);
+    } else if (mkdir(cacheDir.c_str(), 0755)) {
+	perror(cacheDir.c_str());
+	return "";
+    }
+    return cacheDir;
+}
 
-	for (size_t i = 0; i < vstPath.size(); ++i) {
-	
-	    std::string vstDir = vstPath[i];
-	    DIR *directory = opendir(vstDir.c_str());
-	    if (!directory) continue;
-	    struct dirent *entry;
+bool
+RemoteVSTClient::updateIndex()
+{
+    std::string cacheDir = getCacheDir();
+    if (cacheDir == "") return false;
+
+    // A lock file keeps two hosts starting at once from scanning the
+    // same DLLs.  Our scanners mustn't inherit it, or a scanner that
+    // outlived us would hold the lock.
+    std::string lockFileName = cacheDir + "/scan.lock";
+    int lockfd = open(lockFileName.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (lockfd < 0 || flock(lockfd, LOCK_EX | LOCK_NB)) {
+	std::cerr << "RemoteVSTClient: another scan is already running"
+		  << std::endl;
+	return false;
+    }
 
-	    while ((entry = readdir(directory))) {
-	    
-		std::string libname = entry->d_name;
-
-		if (libname[0] != '.' &&
-		    libname.length() >= 5 &&
-		    (libname.substr(libname.length() - 4) == ".dll" ||
-		     libname.substr(libname.length() - 4) == ".DLL")) {
-
-		    std::string cacheFileName = cacheDir + "/" + libname + ".cache";
-		    int fd = -1;
-		    int testVersion = 0;
-
-		    if ((fd = open(cacheFileName.c_str(), O_RDONLY)) < 0) continue;
-		    if (read(fd, &testVersion, sizeof(int)) != sizeof(int) ||
-			testVersion != version) {
-			close(fd);
-			continue;
-		    }
-
-		    PluginRecord rec;
-		    if (addFromFd(fd, rec)) {
-			plugins.push_back(rec);
-		    }
-
-		    close(fd);
-		}
+    std::vector<PluginIndex::Dll> dlls;
+    std::set<std::string> libnames;
+    findDlls(dlls, libnames);
+
+    std::vector<PluginIndex::Dll> stale;
+    for (size_t i = 0; i < dlls.size(); ++i) {
+	if (!haveValidCache(cacheFileFor(cacheDir, dlls[i].path), dlls[i])) {
+	    stale.push_back(dlls[i]);
+	}
+    }
+
+    try {
+	if (!stale.empty()) scanToCache(stale, cacheDir);
+    } catch (std::string error) {
+	std::cerr << "RemoteVSTClient: " << error << std::endl;
+	close(lockfd);
+	return false;
+    }
+
+    removeStaleCaches(cacheDir, libnames);
+    bool saved = PluginIndex::save(cacheDir + "/plugins.index",
+				   indexFromCaches(cacheDir, dlls));
+    close(lockfd);
+    return saved;
+}
+
+void
+RemoteVSTClient::queryPlugins(PluginIndex &index)
+{
+    // First find the DLLs in the same VST path as the scanner uses.
+    // If there are none, we know immediately there are no plugins
+    // and we don't need to run the (Wine-based) scanner.  If the
+    // plugin index was made from exactly these DLLs, we can use it
+    // as it is.  Otherwise we still use it (or, if there isn't one,
+    // whatever the cache files hold) rather than make the host wait
+    // for the scanner, and bring the index up to date in the
+    // background for next time.  (The DSSI plugin refuses to
+    // instantiate a plugin whose ports no longer match its entry.)
+
+    std::vector<PluginIndex::Dll> dlls;
+    std::set<std::string> libnames;
+    findDlls(dlls, libnames);
+
+    std::vector<PluginRecord> plugins;
+
+    if (dlls.empty()) {
+	index.set(PluginIndex::build(dlls, plugins));
+	return;
+    }
+
+    std::string cacheDir = getCacheDir();
+
+    if (cacheDir != "") {
+
+	std::string indexFileName = cacheDir + "/plugins.index";
+
+	if (index.load(indexFileName)) {
+	    if (indexMatches(index, dlls)) {
+		std::cerr << "RemoteVSTClient: plugin index is up-to-date, "
+			  << "not running scanner" << std::endl;
+	    } else {
+		rescanInBackground();
 	    }
+	    return;
 	}
 
+	// No usable index at all.  Offer whatever is already cached,
+	// and leave the rest to the background scan.
+	std::vector<char> image = indexFromCaches(cacheDir, dlls);
+	index.set(image);
+	if (indexMatches(index, dlls)) {
+	    std::cerr << "RemoteVSTClient: all cache files are up-to-date, "
+		      << "not running scanner" << std::endl;
+	    removeStaleCaches(cacheDir, libnames);
+	    PluginIndex::save(indexFileName, image);
+	} else {
+	    rescanInBackground();
+	}
 	return;
     }
 
+    // Without a cache directory, the scanner sends us its records
+    // directly
+
+    std::string fileName = findScanner();
+
     char fifoFile[60];
 
     sprintf(fifoFile, "/tmp/rplugin_qry_XXXXXX");
@@ -309,70 +970,19 @@ RemoteVSTClient::queryPlugins(std::vector<PluginRecord> &plugins)
 	throw((std::string)"Failed to open FIFO");
     }
 
-    // We want to run the dssi-vst-scanner script, which runs wine
-    // dssi-vst-scanner.exe.so.  We expect to find this script in the
-    // same subdirectory of a directory in the DSSI_PATH as a host
-    // would look for the GUI for this plugin: one called dssi-vst.
-    // See also the RemoteVSTClient constructor above.
+    std::cerr << "RemoteVSTClient: executing "
+	      << fileName << " " << fifoFile << std::endl;
 
-    std::vector<std::string> dssiPath = Paths::getPath
-	("DSSI_PATH", "/usr/local/lib/dssi:/usr/lib/dssi", "/.dssi");
-
-    bool found = false;
     pid_t child;
-
-    std::string sought;
-
-    for (size_t i = 0; i < dssiPath.size(); ++i) {
-
-	std::string subDir = dssiPath[i] + "/dssi-vst";
-	std::string fileName = subDir + "/dssi-vst-scanner.exe";
-
-	DIR *directory = opendir(subDir.c_str());
-	if (!directory) {
-	    sought += " " + fileName;
-	    continue;
-	}
-	closedir(directory);
-
-	struct stat st;
-
-	if (stat(fileName.c_str(), &st)) {
-	    sought += " " + fileName;
-	    continue;
-	}
-
-	if (!(S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) ||
-	    !(st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))) {
-	    sought += " " + fileName;
-	    std::cerr << "RemoteVSTClient: file " << fileName
-		      << " exists but can't be executed" << std::endl;
-	    continue;
-	}
-
-	found = true;
-
-	std::cerr << "RemoteVSTClient: executing "
-		  << fileName << " " << fifoFile << std::endl;
-
-	if ((child = fork()) < 0) {
+    if ((child = fork()) < 0) {
+	unlink(fifoFile);
+	throw((std::string)"Fork failed");
+    } else if (child == 0) { // child process
+	if (execlp(fileName.c_str(), fileName.c_str(), fifoFile, NULL)) {
+	    perror("Exec failed");
 	    unlink(fifoFile);
-	    throw((std::string)"Fork failed");
-	} else if (child == 0) { // child process
-	    if (execlp(fileName.c_str(), fileName.c_str(), fifoFile, NULL)) {
-		perror("Exec failed");
-		unlink(fifoFile);
-		exit(1);
-	    }
+	    exit(1);
 	}
-
-	break;
-    }
-
-    if (!found) {
-	unlink(fifoFile);
-	throw(std::string("Failed to find dssi-vst-scanner.exe [tried:" +
-			  sought + "]"));
     }
 
     struct pollfd pfd;
@@ -436,6 +1046,8 @@ RemoteVSTClient::queryPlugins(std::vector<PluginRecord> &plugins)
 	if (waitpid(-1, NULL, WNOHANG)) break;
 	sleep(1);
     }
+
+    index.set(PluginIndex::build(dlls, plugins));
 }
 
 
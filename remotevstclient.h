@@ -12,6 +12,8 @@
 
 #include "remotepluginclient.h"
 
+class PluginIndex;
+
 class RemoteVSTClient : public RemotePluginClient
 {
 public:
@@ -37,12 +39,36 @@ public:
 	std::vector<std::string> programNames;
     };
 
-    static void queryPlugins(std::vector<PluginRecord> &plugins);
+    // Fills the index with every plugin in the VST path.  This
+    // doesn't wait for the scanner if there is a cache directory:
+    // any DLLs that aren't already in the index are scanned in the
+    // background, and show up the next time this is called.
+    static void queryPlugins(PluginIndex &index);
+
+    // Scan whatever DLLs in the VST path lack an up-to-date cache
+    // file and rewrite the plugin index.  This is what the
+    // dssi-vst-indexer helper that queryPlugins starts in the
+    // background runs.  Returns false if another scan was already
+    // running or there is no cache directory.
+    static bool updateIndex();
 
-protected:
+    // Read one plugin record as written by the scanner, returning
+    // false at the end of the list
     static bool addFromFd(int fd, PluginRecord &rec);
 
 private:
+    // Ask the user's shared server (DSSI_VST_SHARED_SERVER) to host
+    // the plugin, starting the server if it isn't running
+    void requestSharedServer(std::string serverPath, std::string request);
+
+    // Hand the plugin to an idle server from the pool
+    // (DSSI_VST_SERVER_POOL), returning false if none is waiting
+    bool requestPooledServer(std::string serverPath, std::string request,
+			     int poolSize);
+
+    // Start a server that is not tied to this instance
+    void startDetachedServer(std::string serverPath, std::string arg);
+
     RemoteVSTClient(const RemoteVSTClient &); // not provided
     RemoteVSTClient &operator=(const RemoteVSTClient &); // not provided
 };    
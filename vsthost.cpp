@@ -8,28 +8,74 @@
 */
 
 #include <ctype.h>
+#include <string.h>
 #include <signal.h>
+#include <getopt.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/mman.h>
 #include <sys/un.h>
-#include <sys/time.h>
 
 #include <alsa/asoundlib.h>
 #include <alsa/seq.h>
 #include <jack/jack.h>
+#include <jack/midiport.h>
 
-#include "remotevstclient.h"
+#include <fstream>
+#include <vector>
 
-static RemotePluginClient *plugin = 0;
+#include "remotevstclient.h"
+#include "offlinerender.h"
 
 #define MIDI_DECODED_SIZE 3
 
-static unsigned char midiStreamBuffer[(MIDI_BUFFER_SIZE + 1) * MIDI_DECODED_SIZE];
-static struct timeval midiTimeBuffer[MIDI_BUFFER_SIZE];
-static int midiFrameOffsets[MIDI_BUFFER_SIZE];
-static int midiReadIndex = 0, midiWriteIndex = 0;
+// One plugin (or chain of plugins in one server) in the rack, with
+// its own JACK ports.  vsthost normally runs a rack of one; with -r
+// or -f it runs several from the one JACK client.
+
+struct RackPlugin {
+    RemotePluginClient *plugin;
+    std::string    name;
+    bool           has_midi;
+    int            alsa_port;
+    int            input_count;
+    int            output_count;
+    jack_port_t  **input_ports;
+    jack_port_t  **output_ports;
+    jack_port_t   *midi_port;
+    float        **input_buffers;
+    float        **output_buffers;
+    int            midi_count;
+    unsigned char  midi_stream[MIDI_BUFFER_SIZE * MIDI_DECODED_SIZE];
+    int            midi_frame_offsets[MIDI_BUFFER_SIZE];
+};
+
+static std::vector<RackPlugin *> rack;
+
+// Events from the ALSA thread to the JACK process callback.  This is
+// a single-producer, single-consumer ring: the ALSA thread only
+// writes eventWriteIndex and the process callback only writes
+// eventReadIndex, so neither ever waits for the other.  Each event
+// is stamped with the JACK frame time at which it arrived.
+
+#define EVENT_QUEUE_SIZE 1024 // must be a power of two
+
+enum HostEventType {
+    HostEventMIDI,
+    HostEventProgram
+};
+
+struct HostEvent {
+    jack_nframes_t time;
+    int type;
+    int target; // index in rack
+    int program;
+    unsigned char data[MIDI_DECODED_SIZE];
+};
+
+static HostEvent eventQueue[EVENT_QUEUE_SIZE];
+static unsigned int eventReadIndex = 0, eventWriteIndex = 0;
 
 static snd_midi_event_t *alsaDecoder = 0;
 
@@ -42,12 +88,6 @@ static snd_seq_t *alsaSeqHandle = 0;
 
 struct JackData {
     jack_client_t *client;
-    int            input_count;
-    int            output_count;
-    jack_port_t  **input_ports;
-    jack_port_t  **output_ports;
-    float        **input_buffers;
-    float        **output_buffers;
     jack_nframes_t sample_rate;
     jack_nframes_t buffer_size;
 };
@@ -56,6 +96,26 @@ static JackData jackData;
 
 void closeJack();
 
+// Called from the ALSA thread only
+static HostEvent *
+startEvent()
+{
+    unsigned int wi = eventWriteIndex;
+    if (wi - __atomic_load_n(&eventReadIndex, __ATOMIC_ACQUIRE) >=
+	EVENT_QUEUE_SIZE) {
+	return 0;
+    }
+    HostEvent *event = &eventQueue[wi % EVENT_QUEUE_SIZE];
+    event->time = jack_frame_time(jackData.client);
+    return event;
+}
+
+static void
+finishEvent()
+{
+    __atomic_store_n(&eventWriteIndex, eventWriteIndex + 1, __ATOMIC_RELEASE);
+}
+
 
 void
 bail(int sig)
@@ -84,8 +144,8 @@ bail(int sig)
 	alsaSeqHandle = 0;
     }
 
-    if (plugin) {
-	delete plugin;
+    for (size_t i = 0; i < rack.size(); ++i) {
+	delete rack[i]->plugin;
     }
 
     // ignore term signals, then send one to the process group
@@ -107,7 +167,9 @@ bufferSizeChanged(jack_nframes_t nframes, void *i)
     pthread_mutex_lock(&pluginMutex);
 
     jackData.buffer_size = nframes;
-    plugin->setBufferSize(nframes);
+    for (size_t p = 0; p < rack.size(); ++p) {
+	rack[p]->plugin->setBufferSize(nframes);
+    }
 
     pthread_mutex_unlock(&pluginMutex);
     return 0;
@@ -121,7 +183,9 @@ sampleRateChanged(jack_nframes_t nframes, void *i)
     pthread_mutex_lock(&pluginMutex);
 
     jackData.sample_rate = nframes;
-    plugin->setSampleRate(nframes);
+    for (size_t p = 0; p < rack.size(); ++p) {
+	rack[p]->plugin->setSampleRate(nframes);
+    }
 
     pthread_mutex_unlock(&pluginMutex);
     return 0;
@@ -144,35 +208,43 @@ alsaSeqCallback(snd_seq_t *alsaSeqHandle)
 		continue;
 	    }
 
-            if (ev->type == SND_SEQ_EVENT_PGMCHANGE) {
-                pthread_mutex_lock(&pluginMutex);
-                plugin->setCurrentProgram(ev->data.control.value);
-                pthread_mutex_unlock(&pluginMutex);
-                continue;
-            }
+	    int target = -1;
+	    for (size_t i = 0; i < rack.size(); ++i) {
+		if (rack[i]->has_midi && rack[i]->alsa_port == ev->dest.port) {
+		    target = i;
+		    break;
+		}
+	    }
+	    if (target < 0) continue;
 
-	    if (midiReadIndex == midiWriteIndex + 1) {
+	    HostEvent *event = startEvent();
+	    if (!event) {
 		fprintf(stderr, "WARNING: MIDI stream buffer overflow\n");
 		continue;
 	    }
 
+	    event->target = target;
+
+	    if (ev->type == SND_SEQ_EVENT_PGMCHANGE) {
+		event->type = HostEventProgram;
+		event->program = ev->data.control.value;
+		finishEvent();
+		continue;
+	    }
+
 	    long count = snd_midi_event_decode
-		(alsaDecoder,
-		 midiStreamBuffer + (midiWriteIndex * MIDI_DECODED_SIZE),
-		 (MIDI_BUFFER_SIZE - midiWriteIndex) * MIDI_DECODED_SIZE,
-		 ev);
+		(alsaDecoder, event->data, MIDI_DECODED_SIZE, ev);
 
 	    if (count > 0 && count <= 3) {
 
 		while (count < 3) {
-		    midiStreamBuffer[midiWriteIndex * MIDI_DECODED_SIZE + count]
-			= '\0';
+		    event->data[count] = '\0';
 		    ++count;
 		}
 
-		gettimeofday(midiTimeBuffer + midiWriteIndex, NULL);
-		midiWriteIndex = (midiWriteIndex + 1) % MIDI_BUFFER_SIZE;
-		
+		event->type = HostEventMIDI;
+		finishEvent();
+
 	    } else if (count > 3) {
 		fprintf(stderr, "WARNING: MIDI event of type %d"
 			" decoded to >3 bytes, discarding\n", ev->type);
@@ -184,18 +256,17 @@ alsaSeqCallback(snd_seq_t *alsaSeqHandle)
 			" for event type %d\n", count, ev->type);
 	    }
 	}
-	
+
     } while (snd_seq_event_input_pending(alsaSeqHandle, 0) > 0);
 }
 
 int
-openAlsaSeq(const char *pluginName)
+openAlsaSeq(const char *clientName)
 {
-    int portid;
     char alsaName[75];
 
-    if (pluginName[0]) {
-	sprintf(alsaName, "%s VST", pluginName);
+    if (clientName[0]) {
+	snprintf(alsaName, 75, "%s VST", clientName);
     } else {
 	sprintf(alsaName, "VST Host");
     }
@@ -209,12 +280,26 @@ openAlsaSeq(const char *pluginName)
 
     snd_seq_set_client_name(alsaSeqHandle, alsaName);
 
-    if ((portid = snd_seq_create_simple_port
-	 (alsaSeqHandle, alsaName,
-	  SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
-	  SND_SEQ_PORT_TYPE_APPLICATION)) < 0) {
-	fprintf(stderr, "ERROR: Failed to create ALSA sequencer port\n");
-	return 1;
+    // One port for each plugin that takes MIDI, named after the
+    // plugin when there is more than one
+    for (size_t i = 0; i < rack.size(); ++i) {
+
+	if (!rack[i]->has_midi) continue;
+
+	char portName[75];
+	if (rack.size() > 1) {
+	    snprintf(portName, 75, "%d %s VST", (int)i + 1, rack[i]->name.c_str());
+	} else {
+	    strcpy(portName, alsaName);
+	}
+
+	if ((rack[i]->alsa_port = snd_seq_create_simple_port
+	     (alsaSeqHandle, portName,
+	      SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+	      SND_SEQ_PORT_TYPE_APPLICATION)) < 0) {
+	    fprintf(stderr, "ERROR: Failed to create ALSA sequencer port\n");
+	    return 1;
+	}
     }
 
     snd_midi_event_new(MIDI_BUFFER_SIZE, &alsaDecoder);
@@ -227,11 +312,91 @@ openAlsaSeq(const char *pluginName)
     return 0;
 }
 
+// Gather the MIDI for each plugin for this block.  Returns false if
+// a plugin has gone away.
+static bool
+collectMIDI(jack_nframes_t nframes)
+{
+    for (size_t p = 0; p < rack.size(); ++p) {
+	rack[p]->midi_count = 0;
+    }
+
+    // Play events one cycle after they arrived, at the same offset
+    // into the cycle as they arrived at into the previous one.  An
+    // event that arrived since this cycle started waits for the next.
+
+    jack_nframes_t cycleStart = jack_last_frame_time(jackData.client) - nframes;
+    unsigned int ri = eventReadIndex;
+    unsigned int wi = __atomic_load_n(&eventWriteIndex, __ATOMIC_ACQUIRE);
+
+    while (ri != wi) {
+
+	const HostEvent &event = eventQueue[ri % EVENT_QUEUE_SIZE];
+	RackPlugin *rp = rack[event.target];
+
+	// Frame times wrap, so compare them by signed difference
+	int32_t offset = (int32_t)(event.time - cycleStart);
+	if (offset >= (int32_t)nframes) break;
+	if (offset < 0) offset = 0;
+
+	if (event.type == HostEventProgram) {
+	    // Takes effect from the start of the block
+	    try {
+		rp->plugin->setCurrentProgram(event.program);
+	    } catch (RemotePluginClosedException) {
+		return false;
+	    }
+	} else if (rp->midi_count < MIDI_BUFFER_SIZE) {
+	    memcpy(rp->midi_stream + rp->midi_count * MIDI_DECODED_SIZE,
+		   event.data, MIDI_DECODED_SIZE);
+	    rp->midi_frame_offsets[rp->midi_count] = offset;
+	    ++rp->midi_count;
+	}
+
+	++ri;
+    }
+
+    __atomic_store_n(&eventReadIndex, ri, __ATOMIC_RELEASE);
+
+    // Events from a JACK MIDI port already carry their offsets into
+    // this cycle, and come in order
+    for (size_t p = 0; p < rack.size(); ++p) {
+
+	RackPlugin *rp = rack[p];
+	if (!rp->midi_port) continue;
+
+	void *midiBuffer = jack_port_get_buffer(rp->midi_port, nframes);
+	uint32_t eventCount = jack_midi_get_event_count(midiBuffer);
+
+	for (uint32_t i = 0; i < eventCount && rp->midi_count < MIDI_BUFFER_SIZE; ++i) {
+
+	    jack_midi_event_t event;
+	    if (jack_midi_event_get(&event, midiBuffer, i)) continue;
+	    if (event.size < 1 || event.size > MIDI_DECODED_SIZE) continue;
+
+	    if ((event.buffer[0] & 0xf0) == 0xc0 && event.size == 2) {
+		try {
+		    rp->plugin->setCurrentProgram(event.buffer[1]);
+		} catch (RemotePluginClosedException) {
+		    return false;
+		}
+		continue;
+	    }
+
+	    unsigned char *data = rp->midi_stream + rp->midi_count * MIDI_DECODED_SIZE;
+	    memset(data, 0, MIDI_DECODED_SIZE);
+	    memcpy(data, event.buffer, event.size);
+	    rp->midi_frame_offsets[rp->midi_count] = event.time;
+	    ++rp->midi_count;
+	}
+    }
+
+    return true;
+}
+
 int
 jackProcess(jack_nframes_t nframes, void *arg)
 {
-    int ri = midiReadIndex, wi = midiWriteIndex;
-
     if (nframes != jackData.buffer_size) {
 	// This is apparently legal, though it will never happen with
 	// current JACK versions.  In theory nframes can be anywhere
@@ -246,72 +411,54 @@ jackProcess(jack_nframes_t nframes, void *arg)
 	return 0;
     }
 
-    for (int i = 0; i < jackData.input_count; ++i) {
-	jackData.input_buffers[i] = (float *)jack_port_get_buffer
-	    (jackData.input_ports[i], jackData.buffer_size);
-    }
-    for (int i = 0; i < jackData.output_count; ++i) {
-	jackData.output_buffers[i] = (float *)jack_port_get_buffer
-	    (jackData.output_ports[i], jackData.buffer_size);
+    for (size_t p = 0; p < rack.size(); ++p) {
+	RackPlugin *rp = rack[p];
+	for (int i = 0; i < rp->input_count; ++i) {
+	    rp->input_buffers[i] = (float *)jack_port_get_buffer
+		(rp->input_ports[i], jackData.buffer_size);
+	}
+	for (int i = 0; i < rp->output_count; ++i) {
+	    rp->output_buffers[i] = (float *)jack_port_get_buffer
+		(rp->output_ports[i], jackData.buffer_size);
+	}
     }
 
     if (exiting) {
 	return 0;
     }
 
+    // The mutex is only held by the buffer size and sample rate
+    // callbacks, while the plugins are being reconfigured
     if (!ready || pthread_mutex_trylock(&pluginMutex)) {
-	for (int i = 0; i < jackData.output_count; ++i) {
-	    memset(jackData.output_buffers[i], 0, jackData.buffer_size * sizeof(float));
+	for (size_t p = 0; p < rack.size(); ++p) {
+	    for (int i = 0; i < rack[p]->output_count; ++i) {
+		memset(rack[p]->output_buffers[i], 0,
+		       jackData.buffer_size * sizeof(float));
+	    }
 	}
 	return 0;
     }
 
-    struct timeval tv, diff;
-    long framediff;
-    jack_nframes_t rate;
-
-    gettimeofday(&tv, NULL);
-    rate = jack_get_sample_rate(jackData.client);
+    // Each plugin runs in its own server, so start them all on the
+    // block before waiting for any: the servers then work on it side
+    // by side rather than one after another
 
-    while (ri != wi) {
-
-	diff.tv_sec = tv.tv_sec - midiTimeBuffer[ri].tv_sec;
+    try {
+	if (!collectMIDI(nframes)) throw RemotePluginClosedException();
 
-	if (tv.tv_usec < midiTimeBuffer[ri].tv_usec) {
-	    --diff.tv_sec;
-	    diff.tv_usec = tv.tv_usec + 1000000 - midiTimeBuffer[ri].tv_usec;
-	} else {
-	    diff.tv_usec = tv.tv_usec - midiTimeBuffer[ri].tv_usec;
+	for (size_t p = 0; p < rack.size(); ++p) {
+	    RackPlugin *rp = rack[p];
+	    if (rp->midi_count > 0) {
+		rp->plugin->sendMIDIData(rp->midi_stream, rp->midi_frame_offsets,
+					 rp->midi_count);
+	    }
+	    rp->plugin->startProcess(rp->input_buffers);
 	}
 
-	framediff =
-	    diff.tv_sec * rate +
-	    ((diff.tv_usec / 1000) * rate) / 1000 +
-	    ((diff.tv_usec - 1000 * (diff.tv_usec / 1000)) * rate) / 1000000;
-
-	if (framediff >= (long)nframes) framediff = nframes - 1;
-	else if (framediff < 0) framediff = 0;
-
-	midiFrameOffsets[ri] = (int)(nframes - framediff - 1);
-	ri = (ri + 1) % MIDI_BUFFER_SIZE;
-    }
-
-    if (midiReadIndex > wi) {
-	plugin->sendMIDIData(midiStreamBuffer + midiReadIndex * MIDI_DECODED_SIZE,
-			     midiFrameOffsets + midiReadIndex,
-			     MIDI_BUFFER_SIZE - midiReadIndex);
-	midiReadIndex = 0;
-    }
-
-    if (midiReadIndex < wi) {
-	plugin->sendMIDIData(midiStreamBuffer + midiReadIndex * MIDI_DECODED_SIZE,
-			     midiFrameOffsets + midiReadIndex,
-			     wi - midiReadIndex);
-	midiReadIndex = wi;
-    }	
+	for (size_t p = 0; p < rack.size(); ++p) {
+	    rack[p]->plugin->finishProcess(rack[p]->output_buffers);
+	}
 
-    try {
-	plugin->process(jackData.input_buffers, jackData.output_buffers);
     } catch (RemotePluginClosedException) {
 	pthread_mutex_unlock(&pluginMutex);
 	exiting = true;
@@ -319,7 +466,7 @@ jackProcess(jack_nframes_t nframes, void *arg)
     }
 
     pthread_mutex_unlock(&pluginMutex);
-    return 0;      
+    return 0;
 }
 
 void
@@ -329,22 +476,41 @@ shutdownJack(void *arg)
     bail(0);
 }
 
+// Lower-case letters only, for JACK client and port names
+static std::string
+shortName(std::string name)
+{
+    std::string s;
+    for (size_t i = 0; i < name.length() && s.length() < 20; ++i) {
+	if (isalpha(name[i])) s += tolower(name[i]);
+    }
+    return s;
+}
+
+static jack_port_t **
+registerPorts(std::string prefix, const char *label, int count, unsigned long flags)
+{
+    if (count <= 0) return 0;
+
+    jack_port_t **ports = new jack_port_t*[count];
+    char portName[100];
+
+    for (int i = 0; i < count; ++i) {
+	snprintf(portName, 100, "%s%s_%d", prefix.c_str(), label, i+1);
+	ports[i] = jack_port_register
+	    (jackData.client, portName, JACK_DEFAULT_AUDIO_TYPE, flags, 0);
+    }
+
+    return ports;
+}
+
 int
-openJack(const char *pluginName)
+openJack(const char *clientName, bool midiPorts)
 {
     const char **ports = 0;
     char jackName[26];
-    char tmpbuf[21];
-    int i = 0, j = 0;
 
-    for (i = 0; i < 20 && pluginName[i]; ++i) {
-	if (isalpha(pluginName[i])) {
-	    tmpbuf[j] = tolower(pluginName[i]);
-	    ++j;
-	}
-    }
-    tmpbuf[j] = '\0';
-    snprintf(jackName, 26, "vst_%s", tmpbuf);
+    snprintf(jackName, 26, "vst_%s", shortName(clientName).c_str());
 
     if ((jackData.client = jack_client_open(jackName, JackNullOption, NULL)) == 0) {
 	fprintf(stderr, "ERROR: Failed to connect to JACK server -- jackd not running?\n");
@@ -353,55 +519,50 @@ openJack(const char *pluginName)
 
     jack_set_process_callback(jackData.client, jackProcess, 0);
     jack_on_shutdown(jackData.client, shutdownJack, 0);
-  
+
     jackData.sample_rate = jack_get_sample_rate(jackData.client);
     jackData.buffer_size = jack_get_buffer_size(jackData.client);
 
-    plugin->setSampleRate(jackData.sample_rate);
-    plugin->setBufferSize(jackData.buffer_size);
-
     ports = jack_get_ports
 	 (jackData.client, NULL, NULL, JackPortIsPhysical | JackPortIsInput);
 
-    jackData.input_count = plugin->getInputCount();
-    jackData.output_count = plugin->getOutputCount();
+    for (size_t p = 0; p < rack.size(); ++p) {
 
-    static char portName[100];
+	RackPlugin *rp = rack[p];
 
-    if (jackData.input_count > 0) {
+	rp->plugin->setSampleRate(jackData.sample_rate);
+	rp->plugin->setBufferSize(jackData.buffer_size);
 
-	jackData.input_ports = new jack_port_t*[jackData.input_count];
-	jackData.input_buffers = new float*[jackData.input_count];
+	rp->input_count = rp->plugin->getInputCount();
+	rp->output_count = rp->plugin->getOutputCount();
 
-	for (int i = 0; i < jackData.input_count; ++i) {
-	    jackData.input_buffers[i] = 0;
-	    snprintf(portName, 100, "in_%d", i+1);
-	    jackData.input_ports[i] = jack_port_register
-		(jackData.client, portName,
-		 JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+	// In a rack, each plugin's ports are prefixed with its
+	// position and name
+	std::string prefix;
+	if (rack.size() > 1) {
+	    char num[20];
+	    sprintf(num, "%d_", (int)p + 1);
+	    prefix = num + shortName(rp->name) + "_";
 	}
 
-    } else {
-	jackData.input_ports = 0;
-	jackData.input_buffers = 0;
-    }
-
-    if (jackData.output_count > 0) {
-
-	jackData.output_ports = new jack_port_t*[jackData.output_count];
-	jackData.output_buffers = new float*[jackData.output_count];
-
-	for (int i = 0; i < jackData.output_count; ++i) {
-	    jackData.output_buffers[i] = 0;
-	    snprintf(portName, 100, "out_%d", i+1);
-	    jackData.output_ports[i] = jack_port_register
-		(jackData.client, portName,
-		 JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+	rp->input_ports = registerPorts(prefix, "in", rp->input_count,
+					JackPortIsInput);
+	rp->output_ports = registerPorts(prefix, "out", rp->output_count,
+					 JackPortIsOutput);
+	rp->input_buffers = (rp->input_count > 0 ?
+			     new float*[rp->input_count]() : 0);
+	rp->output_buffers = (rp->output_count > 0 ?
+			      new float*[rp->output_count]() : 0);
+
+	if (midiPorts && rp->has_midi) {
+	    rp->midi_port = jack_port_register
+		(jackData.client, (prefix + "midi_in").c_str(),
+		 JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
+	    if (!rp->midi_port) {
+		fprintf(stderr, "ERROR: Failed to register JACK MIDI input port\n");
+		return 1;
+	    }
 	}
-
-    } else {
-	jackData.output_ports = 0;
-	jackData.output_buffers = 0;
     }
 
     jack_set_sample_rate_callback(jackData.client, sampleRateChanged, 0);
@@ -411,19 +572,24 @@ openJack(const char *pluginName)
 	fprintf(stderr, "ERROR: Failed to activate JACK client -- some internal error?\n");
 	return 1;
     }
-    
-    bool portsLeft = true;
-    for (int i = 0; i < jackData.output_count; ++i) {
-	if (portsLeft) {
-	    if (ports && ports[i]) {
-		if (jack_connect
-		    (jackData.client,
-		     jack_port_name(jackData.output_ports[i]),
-		     ports[i])) {
-		    fprintf(stderr, "WARNING: Failed to connect output port %d\n", i);
+
+    // Each plugin's outputs go to the physical outputs, as they
+    // would if the plugins were each run by a vsthost of their own
+    for (size_t p = 0; p < rack.size(); ++p) {
+	RackPlugin *rp = rack[p];
+	bool portsLeft = true;
+	for (int i = 0; i < rp->output_count; ++i) {
+	    if (portsLeft) {
+		if (ports && ports[i]) {
+		    if (jack_connect
+			(jackData.client,
+			 jack_port_name(rp->output_ports[i]),
+			 ports[i])) {
+			fprintf(stderr, "WARNING: Failed to connect output port %d\n", i);
+		    }
+		} else {
+		    portsLeft = false;
 		}
-	    } else {
-		portsLeft = false;
 	    }
 	}
     }
@@ -437,12 +603,22 @@ closeJack()
 {
     if (!jackData.client) return;
 
-    for (int i = 0; i < jackData.input_count; ++i) {
-	jack_port_unregister(jackData.client, jackData.input_ports[i]);
-    }
+    for (size_t p = 0; p < rack.size(); ++p) {
+
+	RackPlugin *rp = rack[p];
+
+	for (int i = 0; i < rp->input_count; ++i) {
+	    jack_port_unregister(jackData.client, rp->input_ports[i]);
+	}
+
+	for (int i = 0; i < rp->output_count; ++i) {
+	    jack_port_unregister(jackData.client, rp->output_ports[i]);
+	}
 
-    for (int i = 0; i < jackData.output_count; ++i) {
-	jack_port_unregister(jackData.client, jackData.output_ports[i]);
+	if (rp->midi_port) {
+	    jack_port_unregister(jackData.client, rp->midi_port);
+	    rp->midi_port = 0;
+	}
     }
 
     jack_client_close(jackData.client);
@@ -450,28 +626,87 @@ closeJack()
     jackData.client = 0;
 }
 
+// A rack file lists one plugin per line, as a DLL name or as a chain
+// of DLL names joined by | (in series) or + (side by side).  Blank
+// lines and lines starting with # are ignored.
+static bool
+readRackFile(const char *fileName, std::vector<std::string> &dllnames)
+{
+    std::ifstream file(fileName);
+    if (!file) {
+	fprintf(stderr, "ERROR: Failed to open rack file %s\n", fileName);
+	return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+	size_t start = line.find_first_not_of(" \t\r");
+	if (start == std::string::npos || line[start] == '#') continue;
+	size_t end = line.find_last_not_of(" \t\r");
+	dllnames.push_back(line.substr(start, end - start + 1));
+    }
+
+    return true;
+}
+
 void
 usage()
 {
-    fprintf(stderr, "Usage: vsthost [-n] <dll>\n    -n  No GUI\n");
+    fprintf(stderr, "Usage: vsthost [-n] [-m] <dll>\n       vsthost [-n] [-m] -c <dll> [+] <dll> [[+] <dll> ...]\n       vsthost [-n] [-m] -r <dll> [<dll> ...]\n       vsthost [-n] [-m] -f <rackfile>\n    -n  No GUI\n    -m  Take MIDI from a JACK MIDI port rather than the ALSA sequencer\n    -c  Run the plugins as a chain, in order, in one server;\n        plugins joined by + run side by side and are mixed\n    -r  Run the plugins as a rack, each with its own ports, in one JACK client\n    -f  Run a rack of the plugins listed in a file, one per line\n\n       vsthost [-c] --render <in.wav|-> <out.wav> [--block N] [--midi <file.mid>]\n               [--automation <file>] [--copy] <dll> [[+] <dll> ...]\n    Render a file through the plugin, or with -c the chain, as fast as possible,\n    without JACK; \"-\" for no input file, when rendering MIDI through a synth\n    --block N            Frames per block (default 8192)\n    --midi <file.mid>    Play a standard MIDI file into the plugin\n    --automation <file>  Apply the parameter changes in a file of lines of\n                         \"<seconds> <parameter> <value>\", at their exact frames\n    --copy               Render through vsthost's own buffers rather than\n                         shared memory\n");
     exit(2);
-}    
+}
 
 int
 main(int argc, char **argv)
 {
-    char *dllname = 0;
     bool  gui = true;
+    bool  chain = false;
+    bool  jackMidi = false;
+    bool  rackArgs = false;
+    char *rackFile = 0;
+    bool  render = false;
+    int   renderBlock = 8192;
+    bool  renderCopy = false;
+    std::string midiFile;
+    std::string automationFile;
+
+    static struct option longOptions[] = {
+	{ "render", no_argument, 0, 'R' },
+	{ "block", required_argument, 0, 'B' },
+	{ "midi", required_argument, 0, 'M' },
+	{ "automation", required_argument, 0, 'A' },
+	{ "copy", no_argument, 0, 'C' },
+	{ 0, 0, 0, 0 }
+    };
 
     int npfd;
     struct pollfd *pfd;
 
     while (1) {
-	int c = getopt(argc, argv, "nd:");
-	
+	int c = getopt_long(argc, argv, "nmcrf:d:", longOptions, 0);
+
 	if (c == -1) break;
 	else if (c == 'n') {
 	    gui = false;
+	} else if (c == 'm') {
+	    jackMidi = true;
+	} else if (c == 'c') {
+	    chain = true;
+	} else if (c == 'r') {
+	    rackArgs = true;
+	} else if (c == 'f') {
+	    rackFile = optarg;
+	} else if (c == 'R') {
+	    render = true;
+	} else if (c == 'B') {
+	    renderBlock = atoi(optarg);
+	    if (renderBlock < 1) usage();
+	} else if (c == 'M') {
+	    midiFile = optarg;
+	} else if (c == 'A') {
+	    automationFile = optarg;
+	} else if (c == 'C') {
+	    renderCopy = true;
 	} else if (c == 'd') {
 	    fprintf(stderr, "NOTE: Ignoring unsupported -d option for backward compatibility\n");
 	} else {
@@ -479,11 +714,53 @@ main(int argc, char **argv)
 	}
     }
 
-    if (optind >= argc) usage();
+    if ((chain ? 1 : 0) + (rackArgs ? 1 : 0) + (rackFile ? 1 : 0) > 1) usage();
+
+    // Rendering takes the input and output files before the DLLs,
+    // and has no rack
+    std::string renderIn, renderOut;
+    if (render) {
+	if (rackArgs || rackFile || optind + 2 >= argc) usage();
+	renderIn = argv[optind++];
+	renderOut = argv[optind++];
+	if (renderIn == "-") renderIn = "";
+	if (renderIn == "" && midiFile == "") usage();
+	gui = false;
+    } else if (midiFile != "" || automationFile != "" || renderCopy) {
+	usage();
+    }
 
-    dllname = argv[optind];
+    std::vector<std::string> dllnames;
 
-    if (!dllname) usage();
+    if (rackFile) {
+	if (optind < argc) usage();
+	if (!readRackFile(rackFile, dllnames)) exit(2);
+	if (dllnames.empty()) usage();
+    } else if (rackArgs) {
+	if (optind >= argc) usage();
+	for (int i = optind; i < argc; ++i) {
+	    dllnames.push_back(argv[i]);
+	}
+    } else {
+	// More than one DLL is only a chain if -c says so
+	if (optind >= argc || (!chain && optind + 1 < argc)) usage();
+
+	// The server takes a chain as its DLL names separated by '|',
+	// or by '+' for plugins to be run side by side
+	std::string names = argv[optind];
+	if (chain) {
+	    if (optind + 1 >= argc) usage();
+	    for (int i = optind + 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "+")) {
+		    if (i + 1 >= argc) usage();
+		    names = names + "+" + argv[++i];
+		} else {
+		    names = names + "|" + argv[i];
+		}
+	    }
+	}
+	dllnames.push_back(names);
+    }
 
     setsid();
 
@@ -498,14 +775,37 @@ main(int argc, char **argv)
 
     jackData.client = 0;
 
-    try {
-	plugin = new RemoteVSTClient(dllname, gui);
-    } catch (std::string e) {
-	perror(e.c_str());
-	bail(0);
+    bool hasMIDI = false;
+
+    for (size_t i = 0; i < dllnames.size(); ++i) {
+
+	RackPlugin *rp = new RackPlugin(); // zero-initialised
+
+	try {
+	    rp->plugin = new RemoteVSTClient(dllnames[i], gui);
+	} catch (std::string e) {
+	    perror(e.c_str());
+	    delete rp;
+	    bail(0);
+	}
+
+	rp->name = rp->plugin->getName();
+	rp->has_midi = rp->plugin->hasMIDIInput();
+	rp->alsa_port = -1;
+	if (rp->has_midi) hasMIDI = true;
+
+	rack.push_back(rp);
+    }
+
+    if (render) {
+	bool ok = renderOffline(rack[0]->plugin, renderIn, renderOut,
+				renderBlock, midiFile, automationFile,
+				renderCopy);
+	delete rack[0]->plugin;
+	exit(ok ? 0 : 1);
     }
 
-    std::string pluginName = plugin->getName();
+    std::string clientName = (rack.size() > 1 ? "rack" : rack[0]->name);
 
     // prevent child threads from wanting to handle signals
     sigset_t _signals;
@@ -520,16 +820,18 @@ main(int argc, char **argv)
     sigaddset(&_signals, SIGCHLD);
     pthread_sigmask(SIG_BLOCK, &_signals, 0);
 
-    bool hasMIDI = plugin->hasMIDIInput();
+    // With JACK MIDI ports, the process callback reads the MIDI
+    // itself and there is nothing for this thread to do
+    bool alsaMIDI = (hasMIDI && !jackMidi);
 
-    if (hasMIDI) {
-	if (openAlsaSeq(pluginName.c_str())) {
-	    plugin->warn("Failed to connect to ALSA sequencer MIDI interface");
+    if (alsaMIDI) {
+	if (openAlsaSeq(clientName.c_str())) {
+	    rack[0]->plugin->warn("Failed to connect to ALSA sequencer MIDI interface");
 	    bail(0);
 	}
     }
-    if (openJack(pluginName.c_str())) {
-	plugin->warn("Failed to connect to JACK audio server (jackd not running?)");
+    if (openJack(clientName.c_str(), jackMidi)) {
+	rack[0]->plugin->warn("Failed to connect to JACK audio server (jackd not running?)");
 	bail(0);
     }
 
@@ -538,12 +840,12 @@ main(int argc, char **argv)
 
     ready = true;
 
-    if (hasMIDI) {
+    if (alsaMIDI) {
 
 	npfd = snd_seq_poll_descriptors_count(alsaSeqHandle, POLLIN);
 	pfd = (struct pollfd *)alloca(npfd * sizeof(struct pollfd));
 	snd_seq_poll_descriptors(alsaSeqHandle, pfd, npfd, POLLIN);
-	
+
 	while (1) {
 	    if (poll(pfd, npfd, 1000) > 0) {
 		alsaSeqCallback(alsaSeqHandle);